@@ -39,10 +39,12 @@ int calculateRowPadding(int width) {
         return padding;
     }
 
-bool loadBMP(const std::string& filename, ImageData& currentImage) {
+// Messages go to out/err so background loads can report once they are joined
+bool loadBMP(const std::string& filename, ImageData& currentImage,
+             std::ostream& out = std::cout, std::ostream& err = std::cerr) {
     std::ifstream file(filename, std::ios::binary);
     if (!file.is_open()) {
-        std::cerr << "Error: Cannot open file " << filename << std::endl;
+        err << "Error: Cannot open file " << filename << std::endl;
         return false;
     }
     
@@ -51,13 +53,13 @@ bool loadBMP(const std::string& filename, ImageData& currentImage) {
     file.read(reinterpret_cast<char*>(&fileHeader), sizeof(BMPFileHeader));
     
     if (file.gcount() != sizeof(BMPFileHeader)) {
-        std::cerr << "Error: Failed to read BMP file header" << std::endl;
+        err << "Error: Failed to read BMP file header" << std::endl;
         return false;
     }
     
     // Check BMP signature
     if (fileHeader.signature[0] != 'B' || fileHeader.signature[1] != 'M') {
-        std::cerr << "Error: Invalid BMP file signature" << std::endl;
+        err << "Error: Invalid BMP file signature" << std::endl;
         return false;
     }
     
@@ -66,18 +68,18 @@ bool loadBMP(const std::string& filename, ImageData& currentImage) {
     file.read(reinterpret_cast<char*>(&infoHeader), sizeof(BMPInfoHeader));
     
     if (file.gcount() != sizeof(BMPInfoHeader)) {
-        std::cerr << "Error: Failed to read BMP info header" << std::endl;
+        err << "Error: Failed to read BMP info header" << std::endl;
         return false;
     }
     
     // Validate BMP format
     if (infoHeader.bitsPerPixel != 24) {
-        std::cerr << "Error: Only 24-bit BMP files are supported" << std::endl;
+        err << "Error: Only 24-bit BMP files are supported" << std::endl;
         return false;
     }
     
     if (infoHeader.compression != 0) {
-        std::cerr << "Error: Compressed BMP files are not supported" << std::endl;
+        err << "Error: Compressed BMP files are not supported" << std::endl;
         return false;
     }
     
@@ -85,7 +87,8 @@ bool loadBMP(const std::string& filename, ImageData& currentImage) {
     int imageHeight = abs(infoHeader.height);
     bool topDown = infoHeader.height < 0;
     
-    currentImage.allocate(infoHeader.width, imageHeight);
+    // bitmaps are exactly 8-bit, they stay so until a command needs complex values
+    currentImage.allocate8(infoHeader.width, imageHeight);
     
     // Move to pixel data
     file.seekg(fileHeader.dataOffset, std::ios::beg);
@@ -95,46 +98,42 @@ bool loadBMP(const std::string& filename, ImageData& currentImage) {
     // Read pixel data
     // BMP stores pixels as BGR (Blue, Green, Red) not RGB
     // BMP stores rows bottom-to-top unless height is negative
+    std::vector<unsigned char> line(infoHeader.width * 3 + padding);
     for (int row = 0; row < imageHeight; row++) {
         int y = topDown ? row : (imageHeight - 1 - row);
         
-        for (int x = 0; x < infoHeader.width; x++) {
-            unsigned char bgr[3];
-            file.read(reinterpret_cast<char*>(bgr), 3);
-            
-            if (file.gcount() != 3) {
-                std::cerr << "Error: Failed to read pixel data" << std::endl;
-                currentImage.clear();
-                return false;
-            }
-            
-            // Convert BGR to RGB
-            currentImage.pixels[y][x][0] = uchar_to_complex(bgr[2]); // Red
-            currentImage.pixels[y][x][1] = uchar_to_complex(bgr[1]); // Green
-            currentImage.pixels[y][x][2] = uchar_to_complex(bgr[0]); // Blue
+        file.read(reinterpret_cast<char*>(line.data()), line.size());
+        if (file.gcount() < static_cast<std::streamsize>(infoHeader.width) * 3) {
+            err << "Error: Failed to read pixel data" << std::endl;
+            currentImage.clear();
+            return false;
         }
-        
-        // Skip padding bytes
-        if (padding > 0) {
-            file.seekg(padding, std::ios::cur);
+
+        // Convert BGR to RGB
+        RGB8* px = currentImage.rgb8[y];
+        for (int x = 0; x < infoHeader.width; x++) {
+            px[x][0] = line[3 * x + 2]; // Red
+            px[x][1] = line[3 * x + 1]; // Green
+            px[x][2] = line[3 * x];     // Blue
         }
     }
     
     file.close();
-    std::cout << "Successfully loaded BMP image: " << filename << std::endl;
-    currentImage.printInfo();
+    out << "Successfully loaded BMP image: " << filename << std::endl;
+    currentImage.printInfo(out);
     return true;
 }
 
-bool saveBMP(const std::string& filename, ImageData& currentImage) {
+bool saveBMP(const std::string& filename, const ImageData& currentImage,
+             std::ostream& out = std::cout, std::ostream& err = std::cerr) {
         if (!currentImage.isLoaded) {
-            std::cerr << "Error: No image loaded to save" << std::endl;
+            err << "Error: No image loaded to save" << std::endl;
             return false;
         }
         
         std::ofstream file(filename, std::ios::binary);
         if (!file.is_open()) {
-            std::cerr << "Error: Cannot create file " << filename << std::endl;
+            err << "Error: Cannot create file " << filename << std::endl;
             return false;
         }
         
@@ -170,27 +169,29 @@ bool saveBMP(const std::string& filename, ImageData& currentImage) {
         
         file.write(reinterpret_cast<const char*>(&infoHeader), sizeof(BMPInfoHeader));
         
-        // Write pixel data (bottom-to-top, BGR format)
-        std::vector<unsigned char> paddingBytes(padding, 0);
-        
+        // Write pixel data (bottom-to-top, BGR format), one padded row at a time
+        std::vector<unsigned char> line(currentImage.width * 3 + padding, 0);
         for (int row = currentImage.height - 1; row >= 0; row--) {
-            for (int x = 0; x < currentImage.width; x++) {
-                // Convert RGB to BGR
-                unsigned char bgr[3] = {
-                    complex_to_uchar(currentImage.pixels[row][x][2]), // Blue
-                    complex_to_uchar(currentImage.pixels[row][x][1]), // Green
-                    complex_to_uchar(currentImage.pixels[row][x][0])  // Red
-                };
-                file.write(reinterpret_cast<const char*>(bgr), 3);
-            }
-            
-            // Write padding bytes
-            if (padding > 0) {
-                file.write(reinterpret_cast<const char*>(paddingBytes.data()), padding);
+            // Convert RGB to BGR, 8-bit images are copied as they are
+            if (currentImage.is8bit()) {
+                const RGB8* px = currentImage.rgb8[row];
+                for (int x = 0; x < currentImage.width; x++) {
+                    line[3 * x] = px[x][2];     // Blue
+                    line[3 * x + 1] = px[x][1]; // Green
+                    line[3 * x + 2] = px[x][0]; // Red
+                }
+            } else {
+                const Triple* px = currentImage.pixels[row];
+                for (int x = 0; x < currentImage.width; x++) {
+                    line[3 * x] = complex_to_uchar(px[x][2]);     // Blue
+                    line[3 * x + 1] = complex_to_uchar(px[x][1]); // Green
+                    line[3 * x + 2] = complex_to_uchar(px[x][0]); // Red
+                }
             }
+            file.write(reinterpret_cast<const char*>(line.data()), line.size());
         }
         
         file.close();
-        std::cout << "Successfully saved BMP image: " << filename << std::endl;
+        out << "Successfully saved BMP image: " << filename << std::endl;
         return true;
     }
\ No newline at end of file
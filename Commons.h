@@ -1,5 +1,6 @@
 #pragma once
 
+#include <array>
 #include <complex>
 #include <vector>
 #include <functional>
@@ -11,19 +12,26 @@
 
 using Complex           =       std::complex<double>;
 using Triple            =       std::array<std::complex<double>, 3>;
+using RGB8              =       std::array<unsigned char, 3>;
 
 using TransformFunc     =       std::function<std::vector<Complex>(std::vector<Complex>)>;
 using SortFunc          =       std::function<bool(const std::complex<double>&, const std::complex<double>&)>;
-using PixelFunc         =       std::function<Triple(Triple&)>;
-using PixelFuncComplex  =       std::function<Triple(Triple&, Complex&)>;
-using TwoPixelFunc      =       std::function<Triple(Triple&, Triple&)>;
-using WarpFunc          =       std::function<std::pair<double, double>(double, double)>;
 using FilterFunc        =       std::function<Complex(double, double)>;
 
 const double PI = acos(-1.0);
 const double E = 2.71828182845;
 
 
+// Effect of an operation on the set of channels known to be real
+// keep: a real channel stays real, real: every channel becomes real,
+// mix: channels are combined so all stay real only if all were, complex: no channel is known real
+enum class RealEffect { keep, real, mix, complex };
+
+// Precision a slot is rounded to after every command, computation always happens in double
+// Compressed idle slots store their values at this width
+enum class Precision { f64, f32, f16 };
+
+
 struct frame{
     int x;
     int y;
@@ -0,0 +1,657 @@
+#include "ConvTools.h"
+#include "FFTTools.h"
+#include "ThreadTools.h"
+#include "Utils.h"
+
+#include <algorithm>
+#include <cmath>
+
+
+
+bool Kernel::isReal(int c) const {
+    for (const Complex& t : taps[c]) {
+        if (t.imag() != 0) return false;
+    }
+    return true;
+}
+
+
+// Same separable kernel on every channel
+static void setSeparable(Kernel& kernel, const std::vector<Complex>& row, const std::vector<Complex>& column) {
+    kernel.width = row.size();
+    kernel.height = column.size();
+    kernel.separable = true;
+    for (int c = 0; c < 3; c++) {
+        kernel.row[c] = row;
+        kernel.column[c] = column;
+        kernel.taps[c].resize(row.size() * column.size());
+        for (int y = 0; y < kernel.height; y++) {
+            for (int x = 0; x < kernel.width; x++) kernel.taps[c][y * kernel.width + x] = column[y] * row[x];
+        }
+    }
+}
+
+// Same kernel on every channel
+static void setTaps(Kernel& kernel, int width, int height, const std::vector<Complex>& taps) {
+    kernel.width = width;
+    kernel.height = height;
+    kernel.separable = false;
+    for (int c = 0; c < 3; c++) kernel.taps[c] = taps;
+}
+
+// Sampled normal density of sigma size / 6, normalized
+static std::vector<Complex> gaussian(int size) {
+    double sigma = std::max(size / 6.0, 0.1);
+    std::vector<Complex> g(size);
+    double sum = 0;
+    for (int i = 0; i < size; i++) {
+        double d = i - size / 2;
+        g[i] = std::exp(-0.5 * d * d / (sigma * sigma));
+        sum += g[i].real();
+    }
+    for (Complex& v : g) v /= sum;
+    return g;
+}
+
+
+bool namedKernel(const std::string& name, int size, Kernel& kernel) {
+    kernel.name = name;
+
+    if (name == "box") {
+        std::vector<Complex> line(size, Complex(1.0 / size, 0));
+        setSeparable(kernel, line, line);
+        return true;
+    }
+    if (name == "gauss") {
+        std::vector<Complex> g = gaussian(size);
+        setSeparable(kernel, g, g);
+        return true;
+    }
+    if (name == "motion") {
+        setSeparable(kernel, std::vector<Complex>(size, Complex(1.0 / size, 0)), {Complex(1, 0)});
+        return true;
+    }
+    if (name == "sharpen") {
+        std::vector<Complex> g = gaussian(size);
+        std::vector<Complex> taps(size * size);
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) taps[y * size + x] = -g[y] * g[x];
+        }
+        taps[(size / 2) * size + size / 2] += 2.0;
+        setTaps(kernel, size, size, taps);
+        return true;
+    }
+    if (name == "laplace") {
+        setTaps(kernel, 3, 3, {0, 1, 0, 1, -4, 1, 0, 1, 0});
+        return true;
+    }
+    if (name == "emboss") {
+        setTaps(kernel, 3, 3, {-2, -1, 0, -1, 1, 1, 0, 1, 2});
+        return true;
+    }
+    return false;
+}
+
+
+Kernel imageKernel(const ImageData& img) {
+    Kernel kernel;
+    kernel.name = "slot";
+    kernel.width = img.width;
+    kernel.height = img.height;
+    kernel.separable = true;
+
+    // 8-bit slots are read as they are, they stay 8-bit
+    auto tap = [&img](int y, int x, int c) {
+        return img.is8bit() ? uchar_to_complex(img.rgb8[y][x][c]) : img.pixels[y][x][c];
+    };
+
+    for (int c = 0; c < 3; c++) {
+        std::vector<Complex>& taps = kernel.taps[c];
+        taps.resize(img.width * img.height);
+        Complex sum = 0;
+        for (int y = 0; y < img.height; y++) {
+            for (int x = 0; x < img.width; x++) {
+                taps[y * img.width + x] = tap(y, x, c);
+                sum += taps[y * img.width + x];
+            }
+        }
+        if (std::abs(sum) > 1e-12) {
+            for (Complex& t : taps) t /= sum;
+        }
+
+        // rank one: every row is a multiple of the row through the largest tap
+        int pivot = 0;
+        for (int i = 0; i < (int) taps.size(); i++) {
+            if (std::abs(taps[i]) > std::abs(taps[pivot])) pivot = i;
+        }
+        int px = pivot % img.width;
+        int py = pivot / img.width;
+        kernel.row[c].assign(taps.begin() + py * img.width, taps.begin() + (py + 1) * img.width);
+        kernel.column[c].resize(img.height);
+        for (int y = 0; y < img.height; y++) {
+            kernel.column[c][y] = taps[pivot] == 0.0 ? Complex(0, 0) : taps[y * img.width + px] / taps[pivot];
+        }
+
+        double tolerance = 1e-9 * std::abs(taps[pivot]);
+        for (int y = 0; y < img.height && kernel.separable; y++) {
+            for (int x = 0; x < img.width; x++) {
+                if (std::abs(taps[y * img.width + x] - kernel.column[c][y] * kernel.row[c][x]) > tolerance) {
+                    kernel.separable = false;
+                    break;
+                }
+            }
+        }
+    }
+    return kernel;
+}
+
+
+// -----------------------------------------------------------------------------------------------------------------------------------
+
+
+// Cost model, in units of one complex multiply-add of a direct sum
+// fftCost is per point and per level of a 2D transform, measured on FFTTools' fft, which copies every strip:
+// direct sums win up to about 15x15 kernels, FFT tiles of two to four times the kernel above
+static constexpr double directCost = 1.0;
+static constexpr double fftCost = 7.0;
+static constexpr double productCost = 2.0;
+
+static int nextPow2(int n) {
+    int p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+static double fft2Cost(int tileWidth, int tileHeight) {
+    double points = static_cast<double>(tileWidth) * tileHeight;
+    return fftCost * points * std::log2(points);
+}
+
+
+ConvPlan planConvolution(int width, int height, const Kernel& kernel) {
+    double pixels = static_cast<double>(width) * height;
+    int kw = kernel.width;
+    int kh = kernel.height;
+
+    ConvPlan best;
+    best.method = ConvMethod::direct;
+    double bestCost = pixels * kw * kh * directCost;
+
+    if (kernel.separable && pixels * (kw + kh) * directCost < bestCost) {
+        best.method = ConvMethod::separable;
+        bestCost = pixels * (kw + kh) * directCost;
+    }
+
+    // tiles from twice the kernel up to the whole padded image, each computes tile - kernel + 1 outputs per side
+    int wholeWidth = nextPow2(width + kw - 1);
+    int wholeHeight = nextPow2(height + kh - 1);
+    for (int tw = std::min(nextPow2(2 * kw), wholeWidth); tw <= wholeWidth; tw *= 2) {
+        for (int th = std::min(nextPow2(2 * kh), wholeHeight); th <= wholeHeight; th *= 2) {
+            double tilesX = std::ceil(static_cast<double>(width) / (tw - kw + 1));
+            double tilesY = std::ceil(static_cast<double>(height) / (th - kh + 1));
+            double cost = tilesX * tilesY * (2 * fft2Cost(tw, th) + productCost * tw * th) + fft2Cost(tw, th);
+            if (cost >= bestCost) continue;
+
+            bestCost = cost;
+            best.method = tilesX * tilesY == 1 ? ConvMethod::whole : ConvMethod::tiled;
+            best.tileWidth = tw;
+            best.tileHeight = th;
+        }
+    }
+    return best;
+}
+
+
+std::string describe(const ConvPlan& plan) {
+    switch (plan.method) {
+    case ConvMethod::separable: return "separable passes";
+    case ConvMethod::direct: return "direct";
+    case ConvMethod::tiled: return "FFT tiles " + std::to_string(plan.tileWidth) + "x" + std::to_string(plan.tileHeight);
+    case ConvMethod::whole: return "whole-image FFT " + std::to_string(plan.tileWidth) + "x" + std::to_string(plan.tileHeight);
+    }
+    return "";
+}
+
+
+// -----------------------------------------------------------------------------------------------------------------------------------
+
+
+// out[i] += t * src[i], without the NaN handling of complex products
+static void multiplyAdd(Complex* out, const Complex* src, Complex t, int count) {
+    double tr = t.real();
+    double ti = t.imag();
+    if (ti == 0) {
+        for (int i = 0; i < count; i++) out[i] += tr * src[i];
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        double sr = src[i].real();
+        double si = src[i].imag();
+        out[i] += Complex(tr * sr - ti * si, tr * si + ti * sr);
+    }
+}
+
+
+// The padded plane is (width + kw - 1) x (height + kh - 1), output (x, y) is the sum of
+// taps[j][i] * padded[y + kh - 1 - j][x + kw - 1 - i], the valid part of the full convolution
+
+static void directPass(const std::vector<Complex>& padded, const std::vector<Complex>& taps, int kw, int kh,
+                       int width, int height, std::vector<Complex>& result) {
+    int pw = width + kw - 1;
+    std::fill(result.begin(), result.end(), Complex(0, 0));
+    for (int y = 0; y < height; y++) {
+        Complex* out = result.data() + static_cast<size_t>(y) * width;
+        for (int j = 0; j < kh; j++) {
+            const Complex* src = padded.data() + static_cast<size_t>(y + kh - 1 - j) * pw;
+            for (int i = 0; i < kw; i++) {
+                if (taps[j * kw + i] == 0.0) continue;
+                multiplyAdd(out, src + kw - 1 - i, taps[j * kw + i], width);
+            }
+        }
+    }
+}
+
+static void separablePass(const std::vector<Complex>& padded, const std::vector<Complex>& row, const std::vector<Complex>& column,
+                          int width, int height, std::vector<Complex>& result) {
+    int kw = row.size();
+    int kh = column.size();
+    int pw = width + kw - 1;
+    int ph = height + kh - 1;
+
+    // rows of the padded plane first, then the columns of that
+    std::vector<Complex> rows(static_cast<size_t>(width) * ph, Complex(0, 0));
+    for (int y = 0; y < ph; y++) {
+        const Complex* src = padded.data() + static_cast<size_t>(y) * pw;
+        for (int i = 0; i < kw; i++) multiplyAdd(rows.data() + static_cast<size_t>(y) * width, src + kw - 1 - i, row[i], width);
+    }
+
+    std::fill(result.begin(), result.end(), Complex(0, 0));
+    for (int y = 0; y < height; y++) {
+        Complex* out = result.data() + static_cast<size_t>(y) * width;
+        for (int j = 0; j < kh; j++) {
+            multiplyAdd(out, rows.data() + static_cast<size_t>(y + kh - 1 - j) * width, column[j], width);
+        }
+    }
+}
+
+
+// 2D transform of a tileWidth x tileHeight tile, both powers of 2 so fft is exact
+static void fft2(std::vector<Complex>& tile, int tileWidth, int tileHeight, bool inverse) {
+    std::vector<Complex> strip(tileWidth);
+    for (int y = 0; y < tileHeight; y++) {
+        std::copy(tile.begin() + y * tileWidth, tile.begin() + (y + 1) * tileWidth, strip.begin());
+        strip = inverse ? ifft(strip) : fft(strip);
+        std::copy(strip.begin(), strip.end(), tile.begin() + y * tileWidth);
+    }
+
+    strip.resize(tileHeight);
+    for (int x = 0; x < tileWidth; x++) {
+        for (int y = 0; y < tileHeight; y++) strip[y] = tile[y * tileWidth + x];
+        strip = inverse ? ifft(strip) : fft(strip);
+        for (int y = 0; y < tileHeight; y++) tile[y * tileWidth + x] = strip[y];
+    }
+}
+
+// Overlap-save: each tile of the padded plane is transformed, multiplied by the kernel's transform
+// and transformed back, the part of the circular result that did not wrap around is kept
+static void fftPass(const std::vector<Complex>& padded, const std::vector<Complex>& taps, int kw, int kh,
+                    int width, int height, int tileWidth, int tileHeight, std::vector<Complex>& result) {
+    int pw = width + kw - 1;
+    int ph = height + kh - 1;
+
+    std::vector<Complex> spectrum(static_cast<size_t>(tileWidth) * tileHeight, Complex(0, 0));
+    for (int j = 0; j < kh; j++) {
+        std::copy(taps.begin() + j * kw, taps.begin() + (j + 1) * kw, spectrum.begin() + j * tileWidth);
+    }
+    fft2(spectrum, tileWidth, tileHeight, false);
+
+    int stepX = tileWidth - kw + 1;
+    int stepY = tileHeight - kh + 1;
+    std::vector<Complex> tile(spectrum.size());
+
+    for (int oy = 0; oy < height; oy += stepY) {
+        for (int ox = 0; ox < width; ox += stepX) {
+            std::fill(tile.begin(), tile.end(), Complex(0, 0));
+            for (int y = 0; y < tileHeight && oy + y < ph; y++) {
+                int count = std::min(tileWidth, pw - ox);
+                std::copy(padded.begin() + static_cast<size_t>(oy + y) * pw + ox,
+                          padded.begin() + static_cast<size_t>(oy + y) * pw + ox + count, tile.begin() + y * tileWidth);
+            }
+
+            fft2(tile, tileWidth, tileHeight, false);
+            for (size_t i = 0; i < tile.size(); i++) {
+                double ar = tile[i].real(), ai = tile[i].imag();
+                double br = spectrum[i].real(), bi = spectrum[i].imag();
+                tile[i] = Complex(ar * br - ai * bi, ar * bi + ai * br);
+            }
+            fft2(tile, tileWidth, tileHeight, true);
+
+            for (int y = 0; y < stepY && oy + y < height; y++) {
+                for (int x = 0; x < stepX && ox + x < width; x++) {
+                    result[static_cast<size_t>(oy + y) * width + ox + x] = tile[(y + kh - 1) * tileWidth + x + kw - 1];
+                }
+            }
+        }
+    }
+}
+
+
+void convolve(ImageData& img, const Kernel& kernel, const ConvPlan& plan) {
+    int width = img.width;
+    int height = img.height;
+    int kw = kernel.width;
+    int kh = kernel.height;
+    int pw = width + kw - 1;
+    int ph = height + kh - 1;
+
+    std::vector<Complex> padded(static_cast<size_t>(pw) * ph);
+    std::vector<Complex> result(static_cast<size_t>(width) * height);
+    int mask = img.realMask;
+
+    for (int c = 0; c < 3; c++) {
+        // padded (px, py) is the pixel (px - (kw - 1) + kw / 2, py - (kh - 1) + kh / 2), clamped to the image
+        for (int py = 0; py < ph; py++) {
+            int y = std::clamp(py - (kh - 1) + kh / 2, 0, height - 1);
+            for (int px = 0; px < pw; px++) {
+                int x = std::clamp(px - (kw - 1) + kw / 2, 0, width - 1);
+                padded[static_cast<size_t>(py) * pw + px] = img.pixels[y][x][c];
+            }
+        }
+
+        switch (plan.method) {
+        case ConvMethod::separable:
+            separablePass(padded, kernel.row[c], kernel.column[c], width, height, result);
+            break;
+        case ConvMethod::direct:
+            directPass(padded, kernel.taps[c], kw, kh, width, height, result);
+            break;
+        case ConvMethod::tiled:
+        case ConvMethod::whole:
+            fftPass(padded, kernel.taps[c], kw, kh, width, height, plan.tileWidth, plan.tileHeight, result);
+            break;
+        }
+
+        // the transforms leave rounding noise in the imaginary parts of real results
+        bool real = (mask >> c & 1) && kernel.isReal(c);
+        if (!real) mask &= ~(1 << c);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                Complex v = result[static_cast<size_t>(y) * width + x];
+                img.pixels[y][x][c] = real ? Complex(v.real(), 0) : v;
+            }
+        }
+    }
+    img.realMask = mask;
+}
+
+
+// -----------------------------------------------------------------------------------------------------------------------------------
+
+
+// Young and van Vliet's coefficients, each output is B * input + c1, c2, c3 times the previous three outputs
+// Their q(sigma) fits the shape of the response: its core matches sigma, the slightly heavier tails
+// make the measured standard deviation about 10% larger
+struct RecursiveGauss {
+    double B, c1, c2, c3;
+
+    explicit RecursiveGauss(double sigma) {
+        double q = sigma >= 2.5 ? 0.98711 * sigma - 0.96330 : 3.97156 - 4.14554 * std::sqrt(1 - 0.26891 * sigma);
+        double b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+        double b1 = 2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q;
+        double b2 = -(1.4281 * q * q + 1.26661 * q * q * q);
+        double b3 = 0.422205 * q * q * q;
+        c1 = b1 / b0;
+        c2 = b2 / b0;
+        c3 = b3 / b0;
+        B = 1 - (c1 + c2 + c3);
+    }
+
+    // out[i] = B * in[i] + c1 * p1[i] + c2 * p2[i] + c3 * p3[i], in place over count values
+    void step(double* v, const double* p1, const double* p2, const double* p3, int count) const {
+        for (int i = 0; i < count; i++) v[i] = B * v[i] + c1 * p1[i] + c2 * p2[i] + c3 * p3[i];
+    }
+};
+
+// Causal and anticausal passes along each of rows rows of columns pixels of lanes doubles, line(r) points
+// to row r; before the first value the filter sees the edge value, which it leaves unchanged
+template <typename Line>
+static void recursiveRows(const RecursiveGauss& g, Line line, int columns, int rows, int lanes) {
+    int n = columns * lanes;
+
+    parallelBands(rows, bandRows, [&](int first, int last) {
+        std::vector<double> edge(lanes);
+        for (int y = first; y < last; y++) {
+            double* row = line(y);
+
+            std::copy(row, row + lanes, edge.begin());
+            for (int x = 0; x < columns; x++) {
+                double* v = row + x * lanes;
+                g.step(v, x > 0 ? v - lanes : edge.data(), x > 1 ? v - 2 * lanes : edge.data(), x > 2 ? v - 3 * lanes : edge.data(), lanes);
+            }
+
+            std::copy(row + n - lanes, row + n, edge.begin());
+            for (int x = columns - 1; x >= 0; x--) {
+                double* v = row + x * lanes;
+                int after = columns - 1 - x;
+                g.step(v, after > 0 ? v + lanes : edge.data(), after > 1 ? v + 2 * lanes : edge.data(),
+                       after > 2 ? v + 3 * lanes : edge.data(), lanes);
+            }
+        }
+    });
+}
+
+// Same down the columns of rows rows of n doubles: a band of every row at a time, so the inner loop runs
+// over contiguous values
+template <typename Line>
+static void recursiveColumns(const RecursiveGauss& g, Line line, int rows, int n) {
+    parallelBands(n, bandValues, [&](int first, int last) {
+        int count = last - first;
+        auto at = [&](int y) { return line(y) + first; };
+
+        std::vector<double> edgeRow(at(0), at(0) + count);
+        for (int y = 0; y < rows; y++) {
+            g.step(at(y), y > 0 ? at(y - 1) : edgeRow.data(), y > 1 ? at(y - 2) : edgeRow.data(),
+                   y > 2 ? at(y - 3) : edgeRow.data(), count);
+        }
+
+        int end = rows - 1;
+        edgeRow.assign(at(end), at(end) + count);
+        for (int y = end; y >= 0; y--) {
+            int after = end - y;
+            g.step(at(y), after > 0 ? at(y + 1) : edgeRow.data(), after > 1 ? at(y + 2) : edgeRow.data(),
+                   after > 2 ? at(y + 3) : edgeRow.data(), count);
+        }
+    });
+}
+
+template <typename Line>
+static void recursivePasses(const RecursiveGauss& g, Line line, int columns, int rows, int lanes) {
+    recursiveRows(g, line, columns, rows, lanes);
+    recursiveColumns(g, line, rows, columns * lanes);
+}
+
+
+void recursiveGauss(ImageData& img, const struct frame& f, double sigma) {
+    // pixels are filtered as 6 doubles: real and imaginary part of 3 channels
+    auto line = [&img, &f](int y) { return reinterpret_cast<double*>(img.pixels[f.y + y] + f.x); };
+    recursivePasses(RecursiveGauss(std::max(sigma, 0.5)), line, f.x_size, f.y_size, 6);
+}
+
+void recursiveGauss(std::vector<double>& plane, int width, int height, double sigma) {
+    auto line = [&plane, width](int y) { return plane.data() + static_cast<size_t>(y) * width; };
+    recursivePasses(RecursiveGauss(std::max(sigma, 0.5)), line, width, height, 1);
+}
+
+
+// Range cells of the bilateral grid at most, empty cells added at both ends of the range axis
+static constexpr int maxRangeCells = 256;
+static constexpr int rangePad = 3;
+
+// Below gridMinSigma pixels, or when the grid would hold more than maxGridValues doubles even with its
+// range cells widened down to minRangeCells, the bilateral sum is taken directly over the window
+static constexpr double gridMinSigma = 2;
+static constexpr size_t maxGridValues = size_t(1) << 26;
+static constexpr int minRangeCells = 8;
+
+// Bilateral sum over the window of radius 3 sigmaSpace around each pixel, edges clipped
+// Range weights are read from a table over 6 sigmaRange, beyond it they are 0
+static void directBilateral(ImageData& img, const std::vector<double>& lum, int values, double sigmaSpace, double sigmaRange) {
+    int width = img.width;
+    int height = img.height;
+    int radius = static_cast<int>(std::ceil(3 * sigmaSpace));
+    int window = 2 * radius + 1;
+
+    std::vector<double> spatial(static_cast<size_t>(window) * window);
+    for (int dy = -radius; dy <= radius; dy++) {
+        for (int dx = -radius; dx <= radius; dx++) {
+            spatial[static_cast<size_t>(dy + radius) * window + dx + radius] = std::exp(-(dx * dx + dy * dy) / (2 * sigmaSpace * sigmaSpace));
+        }
+    }
+
+    constexpr int steps = 4096;
+    double perStep = steps / (6 * sigmaRange);
+    std::vector<double> rangeWeight(steps + 1, 0.0);
+    for (int i = 0; i < steps; i++) {
+        double t = (i + 0.5) / perStep / sigmaRange;
+        rangeWeight[i] = std::exp(-0.5 * t * t);
+    }
+
+    std::vector<Triple> source(static_cast<size_t>(width) * height);
+    for (int y = 0; y < height; y++) std::copy(img.pixels[y], img.pixels[y] + width, source.begin() + static_cast<size_t>(y) * width);
+
+    parallelBands(height, bandRows, [&](int first, int last) {
+        for (int y = first; y < last; y++) {
+            for (int x = 0; x < width; x++) {
+                double center = lum[static_cast<size_t>(y) * width + x];
+                double sum[6] = {0, 0, 0, 0, 0, 0};
+                double weight = 0;
+                for (int yy = std::max(0, y - radius); yy <= std::min(height - 1, y + radius); yy++) {
+                    const double* row = spatial.data() + static_cast<size_t>(yy - y + radius) * window + radius - x;
+                    for (int xx = std::max(0, x - radius); xx <= std::min(width - 1, x + radius); xx++) {
+                        size_t at = static_cast<size_t>(yy) * width + xx;
+                        double d = std::min(std::fabs(lum[at] - center) * perStep, static_cast<double>(steps));
+                        double w = row[xx] * rangeWeight[static_cast<int>(d)];
+                        const double* v = reinterpret_cast<const double*>(&source[at]);
+                        if (values == 3) {
+                            sum[0] += w * v[0];
+                            sum[2] += w * v[2];
+                            sum[4] += w * v[4];
+                        } else {
+                            for (int k = 0; k < 6; k++) sum[k] += w * v[k];
+                        }
+                        weight += w;
+                    }
+                }
+                Triple& p = img.pixels[y][x];
+                for (int c = 0; c < 3; c++) {
+                    p[c] = values == 3 ? Complex(sum[2 * c] / weight, 0) : Complex(sum[2 * c] / weight, sum[2 * c + 1] / weight);
+                }
+            }
+        }
+    });
+}
+
+
+void bilateral(ImageData& img, double sigmaSpace, double sigmaRange) {
+    int width = img.width;
+    int height = img.height;
+    double space = std::max(sigmaSpace, 0.5);
+
+    std::vector<double> lum(static_cast<size_t>(width) * height);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const Triple& p = img.pixels[y][x];
+            lum[static_cast<size_t>(y) * width + x] = 0.299 * p[0].real() + 0.587 * p[1].real() + 0.114 * p[2].real();
+        }
+    }
+    auto [low, high] = std::minmax_element(lum.begin(), lum.end());
+    double lowest = *low;
+    double range = std::max({sigmaRange, (*high - lowest) / (maxRangeCells - 1), 1e-9});
+
+    // a pixel is splatted to its nearest cell
+    // a cell holds the sums of the 3 channels (real and imaginary parts unless the image is real), then the weight
+    int values = img.isReal() ? 3 : 6;
+    int lanes = values + 1;
+
+    std::vector<int> cellX(width), cellY(height);
+    for (int x = 0; x < width; x++) cellX[x] = static_cast<int>(std::lround(x / space));
+    for (int y = 0; y < height; y++) cellY[y] = static_cast<int>(std::lround(y / space));
+    int gridWidth = cellX[width - 1] + 1;
+    int gridHeight = cellY[height - 1] + 1;
+
+    // range cells are widened to keep the grid within maxGridValues, too few of them and the sum is direct
+    size_t fit = maxGridValues / (static_cast<size_t>(gridWidth) * gridHeight * lanes);
+    int rangeCells = fit > 2 * rangePad ? static_cast<int>(std::min<size_t>(maxRangeCells, fit - 2 * rangePad)) : 0;
+    if (space < gridMinSigma || rangeCells < minRangeCells) {
+        directBilateral(img, lum, values, space, sigmaRange);
+        return;
+    }
+    range = std::max(range, (*high - lowest) / (rangeCells - 1));
+
+    int depth = static_cast<int>(std::lround((*high - lowest) / range)) + 1 + 2 * rangePad;
+    size_t cellStride = static_cast<size_t>(depth) * lanes;
+    size_t rowStride = cellStride * gridWidth;
+
+    std::vector<double> grid(rowStride * gridHeight, 0.0);
+    auto cell = [&](int gx, int gy) { return grid.data() + gy * rowStride + gx * cellStride; };
+
+    // splat: each band owns whole grid rows, so no two threads add to the same cell
+    parallelBands(gridHeight, 1, [&](int first, int last) {
+        int y0 = std::lower_bound(cellY.begin(), cellY.end(), first) - cellY.begin();
+        int y1 = std::lower_bound(cellY.begin(), cellY.end(), last) - cellY.begin();
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                int z = static_cast<int>(std::lround((lum[static_cast<size_t>(y) * width + x] - lowest) / range)) + rangePad;
+                double* g = cell(cellX[x], cellY[y]) + z * lanes;
+                const double* v = reinterpret_cast<const double*>(&img.pixels[y][x]);
+                for (int k = 0; k < values; k++) g[k] += v[values == 3 ? 2 * k : k];
+                g[values] += 1;
+            }
+        }
+    });
+
+    // blur of one cell along each axis: x and y with every range cell as lanes, then along the range
+    RecursiveGauss g(1.0);
+    recursivePasses(g, [&](int gy) { return cell(0, gy); }, gridWidth, gridHeight, depth * lanes);
+    recursiveRows(g, [&](int c) { return grid.data() + c * cellStride; }, depth, gridWidth * gridHeight, lanes);
+
+    // slice: trilinear read at the pixel's own position and luminance
+    parallelBands(height, bandRows, [&](int first, int last) {
+        std::vector<double> sum(lanes);
+        for (int y = first; y < last; y++) {
+            double fy = std::min(y / space, gridHeight - 1.0);
+            int gy = std::min(static_cast<int>(fy), std::max(gridHeight - 2, 0));
+            double wy = gridHeight > 1 ? fy - gy : 0;
+            int ny = std::min(gy + 1, gridHeight - 1);
+
+            for (int x = 0; x < width; x++) {
+                double fx = std::min(x / space, gridWidth - 1.0);
+                int gx = std::min(static_cast<int>(fx), std::max(gridWidth - 2, 0));
+                double wx = gridWidth > 1 ? fx - gx : 0;
+                int nx = std::min(gx + 1, gridWidth - 1);
+
+                double fz = (lum[static_cast<size_t>(y) * width + x] - lowest) / range + rangePad;
+                int gz = std::min(static_cast<int>(fz), depth - 2);
+                double wz = fz - gz;
+
+                std::fill(sum.begin(), sum.end(), 0.0);
+                const double* corners[4] = {cell(gx, gy), cell(nx, gy), cell(gx, ny), cell(nx, ny)};
+                double weights[4] = {(1 - wx) * (1 - wy), wx * (1 - wy), (1 - wx) * wy, wx * wy};
+                for (int k = 0; k < 4; k++) {
+                    const double* a = corners[k] + gz * lanes;
+                    const double* b = a + lanes;
+                    double w0 = weights[k] * (1 - wz);
+                    double w1 = weights[k] * wz;
+                    for (int l = 0; l < lanes; l++) sum[l] += w0 * a[l] + w1 * b[l];
+                }
+
+                double weight = sum[values];
+                if (weight <= 0) continue;
+                Triple& p = img.pixels[y][x];
+                for (int c = 0; c < 3; c++) {
+                    p[c] = values == 3 ? Complex(sum[c] / weight, 0) : Complex(sum[2 * c] / weight, sum[2 * c + 1] / weight);
+                }
+            }
+        }
+    });
+}
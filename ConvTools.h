@@ -0,0 +1,71 @@
+#pragma once
+
+#include "Commons.h"
+#include "ImageData.h"
+
+#include <string>
+#include <vector>
+
+// Convolution tools
+// Every channel is convolved with its own kernel channel, pixels outside the image repeat the nearest edge
+// The method is picked by a cost model: two 1D passes for separable kernels, direct sums for small ones,
+// overlap-save FFT tiles for larger ones and a single FFT product when the kernel is about image-sized
+// All methods convolve the same edge-padded plane, so they agree up to rounding
+
+
+struct Kernel {
+    std::string name;
+    int width = 0;
+    int height = 0;
+    std::vector<Complex> taps[3];           // row-major, centered on (width / 2, height / 2)
+    bool separable = false;                 // taps[c][y * width + x] = column[c][y] * row[c][x]
+    std::vector<Complex> row[3];
+    std::vector<Complex> column[3];
+
+    bool isReal(int c) const;
+};
+
+// Kernels known by name, size is their width (and height when square), false if the name is unknown
+// box, gauss (sigma = size / 6), motion (horizontal line), sharpen (2 * identity - gauss), laplace, emboss
+bool namedKernel(const std::string& name, int size, Kernel& kernel);
+
+// Kernel from an image, each channel divided by its sum when that is not 0, separability is detected
+// 8-bit images are read without promoting them
+Kernel imageKernel(const ImageData& img);
+
+
+enum class ConvMethod { separable, direct, tiled, whole };
+
+struct ConvPlan {
+    ConvMethod method = ConvMethod::direct;
+    int tileWidth = 0;                      // FFT size of the tiled and whole methods
+    int tileHeight = 0;
+};
+
+// Cheapest method for a width x height image
+ConvPlan planConvolution(int width, int height, const Kernel& kernel);
+
+std::string describe(const ConvPlan& plan);
+
+// Convolve every channel of a complex image, channels that are real with a real kernel stay exactly real
+void convolve(ImageData& img, const Kernel& kernel, const ConvPlan& plan);
+
+
+// Gaussian blur of one frame by a Young - van Vliet recursive filter, a causal and an anticausal
+// third order pass per axis cost the same for any sigma >= 0.5, values beyond the frame repeat its edge
+// Rows are filtered as 6 interleaved doubles per pixel, columns a whole row at a time
+void recursiveGauss(ImageData& img, const struct frame& f, double sigma);
+
+// Same on a row-major plane of real values
+void recursiveGauss(std::vector<double>& plane, int width, int height, double sigma);
+
+
+// Edge-preserving smoothing through a bilateral grid: pixels are splatted into cells of sigmaSpace pixels
+// by sigmaRange of luminance, the grid is blurred with the recursive gaussian along its three axes and
+// each pixel is read back by trilinear interpolation at its position and luminance
+// The grid has about width * height / sigmaSpace^2 cells per range cell, so the cost is linear in the pixels
+// and does not grow with sigmaSpace; range cells are capped at maxRangeCells by widening them, and widened
+// further to keep the grid under 512 MB
+// Below sigmaSpace 2, or when fewer than 8 range cells would fit in 512 MB, the bilateral sum is taken
+// directly over the window of radius 3 sigmaSpace, whose cost grows with sigmaSpace^2
+void bilateral(ImageData& img, double sigmaSpace, double sigmaRange);
@@ -0,0 +1,188 @@
+#include "EdgeTools.h"
+#include "ConvTools.h"
+#include "ThreadTools.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+
+
+// Plane of width + 2 columns whose first and last repeat the edge pixels, rows outside repeat the edge rows
+struct PaddedPlane {
+    int width;
+    int height;
+    std::vector<double> values;
+
+    PaddedPlane(int width, int height) : width(width), height(height), values(static_cast<size_t>(width + 2) * height) {}
+
+    double* row(int y) { return values.data() + static_cast<size_t>(std::clamp(y, 0, height - 1)) * (width + 2); }
+    const double* row(int y) const { return values.data() + static_cast<size_t>(std::clamp(y, 0, height - 1)) * (width + 2); }
+
+    // pixel x of row y is at row(y)[x + 1]
+    void pad(int y) {
+        double* r = row(y);
+        r[0] = r[1];
+        r[width + 1] = r[width];
+    }
+};
+
+
+// Derivative along x and y of row y, scaled so that a slope of 1 per pixel gives 1
+static void gradientRow(const PaddedPlane& p, int y, GradientKernel kernel, double* gx, double* gy) {
+    double outer = kernel == GradientKernel::sobel ? 1 : 3;
+    double middle = kernel == GradientKernel::sobel ? 2 : 10;
+    double scale = 1.0 / (2 * (2 * outer + middle));
+    outer *= scale;
+    middle *= scale;
+
+    const double* up = p.row(y - 1);
+    const double* mid = p.row(y);
+    const double* down = p.row(y + 1);
+    for (int x = 0; x < p.width; x++) {
+        gx[x] = outer * (up[x + 2] - up[x]) + middle * (mid[x + 2] - mid[x]) + outer * (down[x + 2] - down[x]);
+        gy[x] = outer * (down[x] - up[x]) + middle * (down[x + 1] - up[x + 1]) + outer * (down[x + 2] - up[x + 2]);
+    }
+}
+
+
+void gradient(ImageData& img, GradientKernel kernel) {
+    int width = img.width;
+    int height = img.height;
+    PaddedPlane plane(width, height);
+
+    for (int c = 0; c < 3; c++) {
+        for (int y = 0; y < height; y++) {
+            double* r = plane.row(y);
+            for (int x = 0; x < width; x++) r[x + 1] = img.pixels[y][x][c].real();
+            plane.pad(y);
+        }
+
+        parallelBands(height, bandRows, [&](int first, int last) {
+            std::vector<double> gx(width), gy(width);
+            for (int y = first; y < last; y++) {
+                gradientRow(plane, y, kernel, gx.data(), gy.data());
+                for (int x = 0; x < width; x++) img.pixels[y][x][c] = Complex(gx[x], gy[x]);
+            }
+        });
+    }
+    img.realMask = 0;
+}
+
+
+long long canny(ImageData& img, double sigma, double low, double high) {
+    int width = img.width;
+    int height = img.height;
+    size_t size = static_cast<size_t>(width) * height;
+
+    // luminance, read from the bytes of an 8-bit slot
+    std::vector<double> lum(size);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            double r, g, b;
+            if (img.is8bit()) {
+                r = img.rgb8[y][x][0];
+                g = img.rgb8[y][x][1];
+                b = img.rgb8[y][x][2];
+            } else {
+                r = img.pixels[y][x][0].real();
+                g = img.pixels[y][x][1].real();
+                b = img.pixels[y][x][2].real();
+            }
+            lum[static_cast<size_t>(y) * width + x] = 0.299 * r + 0.587 * g + 0.114 * b;
+        }
+    }
+    if (sigma > 0) recursiveGauss(lum, width, height, sigma);
+
+    PaddedPlane plane(width, height);
+    for (int y = 0; y < height; y++) {
+        std::copy(lum.begin() + static_cast<size_t>(y) * width, lum.begin() + static_cast<size_t>(y + 1) * width, plane.row(y) + 1);
+        plane.pad(y);
+    }
+
+    // magnitude and direction, quantized to 0 (across columns), 1 (down-right), 2 (across rows), 3 (down-left)
+    std::vector<double> magnitude(size);
+    std::vector<uint8_t> direction(size);
+    parallelBands(height, bandRows, [&](int first, int last) {
+        const double tan22 = 0.41421356237;
+        std::vector<double> gx(width), gy(width);
+        for (int y = first; y < last; y++) {
+            gradientRow(plane, y, GradientKernel::sobel, gx.data(), gy.data());
+            double* m = magnitude.data() + static_cast<size_t>(y) * width;
+            uint8_t* d = direction.data() + static_cast<size_t>(y) * width;
+            for (int x = 0; x < width; x++) m[x] = std::sqrt(gx[x] * gx[x] + gy[x] * gy[x]);
+            for (int x = 0; x < width; x++) {
+                double ax = std::fabs(gx[x]);
+                double ay = std::fabs(gy[x]);
+                d[x] = ay <= ax * tan22 ? 0 : ax <= ay * tan22 ? 2 : gx[x] * gy[x] > 0 ? 1 : 3;
+            }
+        }
+    });
+
+    // non-maximum suppression: only the ridge along the gradient is kept, ties go to the first pixel
+    std::vector<double>& ridge = lum;
+    parallelBands(height, bandRows, [&](int first, int last) {
+        static const int dx[4] = {1, 1, 0, -1};
+        static const int dy[4] = {0, 1, 1, 1};
+        auto at = [&](int x, int y) {
+            if (x < 0 || x >= width || y < 0 || y >= height) return 0.0;
+            return magnitude[static_cast<size_t>(y) * width + x];
+        };
+        for (int y = first; y < last; y++) {
+            for (int x = 0; x < width; x++) {
+                size_t p = static_cast<size_t>(y) * width + x;
+                int k = direction[p];
+                double m = magnitude[p];
+                bool peak = m > at(x + dx[k], y + dy[k]) && m >= at(x - dx[k], y - dy[k]);
+                ridge[p] = peak ? m : 0;
+            }
+        }
+    });
+
+    // hysteresis: flood from the strong pixels through the 8-connected weak ones
+    std::vector<uint8_t> edge(size, 0);
+    std::vector<size_t> stack;
+    for (size_t p = 0; p < size; p++) {
+        if (ridge[p] >= high && ridge[p] > 0) {
+            edge[p] = 1;
+            stack.push_back(p);
+        }
+    }
+    long long count = 0;
+    while (!stack.empty()) {
+        size_t p = stack.back();
+        stack.pop_back();
+        count++;
+        int x = static_cast<int>(p % width);
+        int y = static_cast<int>(p / width);
+        for (int ny = std::max(y - 1, 0); ny <= std::min(y + 1, height - 1); ny++) {
+            for (int nx = std::max(x - 1, 0); nx <= std::min(x + 1, width - 1); nx++) {
+                size_t q = static_cast<size_t>(ny) * width + nx;
+                if (edge[q] || ridge[q] < low || ridge[q] == 0) continue;
+                edge[q] = 1;
+                stack.push_back(q);
+            }
+        }
+    }
+
+    // the map is bytes, an 8-bit slot stays so and a complex one goes back to it
+    if (img.is8bit()) {
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                unsigned char v = edge[static_cast<size_t>(y) * width + x] ? 255 : 0;
+                img.rgb8[y][x] = RGB8{v, v, v};
+            }
+        }
+    } else {
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                Complex v(edge[static_cast<size_t>(y) * width + x] ? 255 : 0, 0);
+                img.pixels[y][x] = Triple{v, v, v};
+            }
+        }
+        img.realMask = 7;
+        img.demote();
+    }
+    return count;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "Commons.h"
+#include "ImageData.h"
+
+// Edge tools
+// Gradients come from 3x3 Sobel or Scharr kernels with repeated edges, computed over bands of rows in
+// parallel: every output row reads three rows of a plane padded by one column, so its inner loops have
+// no edge cases and vectorize
+
+
+enum class GradientKernel { sobel, scharr };
+
+// Replace every channel by the gradient gx + i gy of its real part, abs and arg then give magnitude and angle
+void gradient(ImageData& img, GradientKernel kernel);
+
+// Canny edges of the luminance: gaussian smoothing of sigma, Sobel gradient, non-maximum suppression
+// across the edges, then hysteresis: pixels above high, and the ones above low connected to them,
+// become 255, all others 0
+// Returns the number of edge pixels
+long long canny(ImageData& img, double sigma, double low, double high);
@@ -0,0 +1,597 @@
+#include "ExprTools.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <map>
+#include <utility>
+
+
+using Op = ExprInstruction::Op;
+
+// Registers are laid out as inputs, then constants, then temporaries
+// Each register holds a block of values, real parts first then imaginary parts
+static constexpr int exprBlock = 256;
+
+enum ExprInput { in_v, in_r, in_g, in_b, in_x, in_y, in_w, in_h, inputCount };
+
+
+// Run one instruction over n values of registers stride values apart
+// Only the real arrays are touched when realOnly, the program is real-safe then
+static void runOp(const ExprInstruction& in, double* regs, int stride, int n, bool realOnly) {
+    double* __restrict dr = regs + (size_t) in.dst * 2 * stride;
+    double* __restrict di = dr + stride;
+    const double* ar = regs + (size_t) in.a * 2 * stride;
+    const double* ai = ar + stride;
+    const double* br = regs + (size_t) in.b * 2 * stride;
+    const double* bi = br + stride;
+
+    switch (in.op) {
+    case Op::add:
+        for (int i = 0; i < n; i++) dr[i] = ar[i] + br[i];
+        if (!realOnly) for (int i = 0; i < n; i++) di[i] = ai[i] + bi[i];
+        break;
+
+    case Op::sub:
+        for (int i = 0; i < n; i++) dr[i] = ar[i] - br[i];
+        if (!realOnly) for (int i = 0; i < n; i++) di[i] = ai[i] - bi[i];
+        break;
+
+    case Op::mul:
+        if (realOnly) {
+            for (int i = 0; i < n; i++) dr[i] = ar[i] * br[i];
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            double re = ar[i] * br[i] - ai[i] * bi[i];
+            double im = ar[i] * bi[i] + ai[i] * br[i];
+            dr[i] = re;
+            di[i] = im;
+        }
+        break;
+
+    case Op::div:
+        if (realOnly) {
+            for (int i = 0; i < n; i++) dr[i] = ar[i] / br[i];
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            double d = br[i] * br[i] + bi[i] * bi[i];
+            double re = (ar[i] * br[i] + ai[i] * bi[i]) / d;
+            double im = (ai[i] * br[i] - ar[i] * bi[i]) / d;
+            dr[i] = re;
+            di[i] = im;
+        }
+        break;
+
+    case Op::neg:
+        for (int i = 0; i < n; i++) dr[i] = -ar[i];
+        if (!realOnly) for (int i = 0; i < n; i++) di[i] = -ai[i];
+        break;
+
+    case Op::powi: {
+        // square and multiply, the element loops stay branch free
+        double baseR[exprBlock], baseI[exprBlock];
+        if (realOnly) {
+            for (int i = 0; i < n; i++) {
+                baseR[i] = ar[i];
+                dr[i] = 1;
+            }
+            for (int e = std::abs(in.n); e; e >>= 1) {
+                if (e & 1) for (int i = 0; i < n; i++) dr[i] *= baseR[i];
+                if (e == 1) break;
+                for (int i = 0; i < n; i++) baseR[i] *= baseR[i];
+            }
+            if (in.n < 0) for (int i = 0; i < n; i++) dr[i] = 1 / dr[i];
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            baseR[i] = ar[i];
+            baseI[i] = ai[i];
+            dr[i] = 1;
+            di[i] = 0;
+        }
+        for (int e = std::abs(in.n); e; e >>= 1) {
+            if (e & 1) {
+                for (int i = 0; i < n; i++) {
+                    double re = dr[i] * baseR[i] - di[i] * baseI[i];
+                    double im = dr[i] * baseI[i] + di[i] * baseR[i];
+                    dr[i] = re;
+                    di[i] = im;
+                }
+            }
+            if (e == 1) break;
+            for (int i = 0; i < n; i++) {
+                double re = baseR[i] * baseR[i] - baseI[i] * baseI[i];
+                double im = 2 * baseR[i] * baseI[i];
+                baseR[i] = re;
+                baseI[i] = im;
+            }
+        }
+        if (in.n < 0) {
+            for (int i = 0; i < n; i++) {
+                double d = dr[i] * dr[i] + di[i] * di[i];
+                dr[i] = dr[i] / d;
+                di[i] = -di[i] / d;
+            }
+        }
+        break;
+    }
+
+    case Op::pow:
+        for (int i = 0; i < n; i++) {
+            Complex v = std::pow(Complex(ar[i], ai[i]), Complex(br[i], bi[i]));
+            dr[i] = v.real();
+            di[i] = v.imag();
+        }
+        break;
+
+    case Op::log:
+        for (int i = 0; i < n; i++) {
+            Complex v = std::log(Complex(ar[i], ai[i]));
+            dr[i] = v.real();
+            di[i] = v.imag();
+        }
+        break;
+
+    case Op::exp:
+        if (realOnly) {
+            for (int i = 0; i < n; i++) dr[i] = std::exp(ar[i]);
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            Complex v = std::exp(Complex(ar[i], ai[i]));
+            dr[i] = v.real();
+            di[i] = v.imag();
+        }
+        break;
+
+    case Op::sqrt:
+        for (int i = 0; i < n; i++) {
+            Complex v = std::sqrt(Complex(ar[i], ai[i]));
+            dr[i] = v.real();
+            di[i] = v.imag();
+        }
+        break;
+
+    case Op::abs:
+        if (realOnly) {
+            for (int i = 0; i < n; i++) dr[i] = std::fabs(ar[i]);
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            dr[i] = std::hypot(ar[i], ai[i]);
+            di[i] = 0;
+        }
+        break;
+
+    case Op::arg:
+        for (int i = 0; i < n; i++) dr[i] = std::atan2(realOnly ? 0.0 : ai[i], ar[i]);
+        if (!realOnly) for (int i = 0; i < n; i++) di[i] = 0;
+        break;
+
+    case Op::conj:
+        for (int i = 0; i < n; i++) dr[i] = ar[i];
+        if (!realOnly) for (int i = 0; i < n; i++) di[i] = -ai[i];
+        break;
+
+    case Op::re:
+        for (int i = 0; i < n; i++) dr[i] = ar[i];
+        if (!realOnly) for (int i = 0; i < n; i++) di[i] = 0;
+        break;
+
+    case Op::im:
+        for (int i = 0; i < n; i++) dr[i] = realOnly ? 0 : ai[i];
+        if (!realOnly) for (int i = 0; i < n; i++) di[i] = 0;
+        break;
+
+    case Op::sin:
+        if (realOnly) {
+            for (int i = 0; i < n; i++) dr[i] = std::sin(ar[i]);
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            Complex v = std::sin(Complex(ar[i], ai[i]));
+            dr[i] = v.real();
+            di[i] = v.imag();
+        }
+        break;
+
+    case Op::cos:
+        if (realOnly) {
+            for (int i = 0; i < n; i++) dr[i] = std::cos(ar[i]);
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            Complex v = std::cos(Complex(ar[i], ai[i]));
+            dr[i] = v.real();
+            di[i] = v.imag();
+        }
+        break;
+    }
+}
+
+
+namespace {
+
+// What a value is when the pixels are real: always real, real when the channels read are, or complex
+enum class Kind { real, input, complex };
+
+struct Operand {
+    int reg = -1;                           // -1 for a constant not loaded in a register yet
+    Complex value;                          // constant value
+    Kind kind = Kind::real;
+    bool temp = false;
+};
+
+
+// Recursive descent parser emitting instructions as it goes
+//   sum     := product (('+' | '-') product)*
+//   product := unary (('*' | '/') unary)*
+//   unary   := '-' unary | '+' unary | power
+//   power   := primary ('^' unary)?
+//   primary := number | name | name '(' sum (',' sum)* ')' | '(' sum ')'
+class Parser {
+public:
+    Parser(const std::string& text, ExprProgram& program, std::ostream& err)
+        : text(text), program(program), err(err) {}
+
+    bool run() {
+        Operand result;
+        if (!parseSum(result)) return false;
+        skipSpace();
+        if (pos < text.size()) return fail(std::string("unexpected '") + text[pos] + "'");
+
+        load(result);
+        program.result = result.reg;
+
+        // temporaries go after the constants, now that they are all known
+        int base = inputCount + (int) program.constants.size();
+        for (ExprInstruction& in : program.code) {
+            for (int* r : {&in.dst, &in.a, &in.b}) {
+                if (*r < 0) *r = base - *r - 1;
+            }
+        }
+        if (program.result < 0) program.result = base - program.result - 1;
+        program.registers = base + temps;
+
+        program.channelWise = (program.inputs & ~(1 << in_v)) == 0;
+
+        bool rgb = program.inputs & ((1 << in_r) | (1 << in_g) | (1 << in_b));
+        if (result.kind == Kind::real) program.effect = RealEffect::real;
+        else if (result.kind == Kind::complex) program.effect = RealEffect::complex;
+        else program.effect = rgb ? RealEffect::mix : RealEffect::keep;
+        return true;
+    }
+
+private:
+    const std::string& text;
+    ExprProgram& program;
+    std::ostream& err;
+    size_t pos = 0;
+
+    int temps = 0;
+    std::vector<int> freeTemps;             // temporaries are numbered -1, -2, ... until the end
+
+    bool fail(const std::string& message) {
+        err << "Error: expr: " << message << " at " << pos + 1 << std::endl;
+        return false;
+    }
+
+    void skipSpace() {
+        while (pos < text.size() && std::isspace((unsigned char) text[pos])) pos++;
+    }
+
+    bool accept(char c) {
+        skipSpace();
+        if (pos < text.size() && text[pos] == c) {
+            pos++;
+            return true;
+        }
+        return false;
+    }
+
+    static bool isNameChar(char c) {
+        return std::isalnum((unsigned char) c) || c == '_';
+    }
+
+    static Operand constant(Complex value) {
+        Operand o;
+        o.value = value;
+        o.kind = value.imag() == 0 ? Kind::real : Kind::complex;
+        return o;
+    }
+
+    // Give a constant its register, equal constants share one
+    void load(Operand& o) {
+        if (o.reg >= 0 || o.temp) return;
+        for (size_t k = 0; k < program.constants.size(); k++) {
+            const Complex& c = program.constants[k];
+            if (c.real() == o.value.real() && c.imag() == o.value.imag()
+                && std::signbit(c.real()) == std::signbit(o.value.real())
+                && std::signbit(c.imag()) == std::signbit(o.value.imag())) {
+                o.reg = inputCount + (int) k;
+                return;
+            }
+        }
+        program.constants.push_back(o.value);
+        o.reg = inputCount + (int) program.constants.size() - 1;
+    }
+
+    void release(const Operand& o) {
+        if (o.temp) freeTemps.push_back(o.reg);
+    }
+
+    // Emit op on a (and b), constant operands are folded by running the same op on one value
+    Operand emit(Op op, Operand a, Operand b = Operand(), int n = 0, bool binary = false) {
+        bool folded = a.reg < 0 && !a.temp && (!binary || (b.reg < 0 && !b.temp));
+        if (folded) {
+            double regs[6] = {a.value.real(), a.value.imag(), b.value.real(), b.value.imag(), 0, 0};
+            ExprInstruction in;
+            in.op = op;
+            in.a = 0;
+            in.b = 1;
+            in.dst = 2;
+            in.n = n;
+            runOp(in, regs, 1, 1, false);
+            return constant(Complex(regs[4], regs[5]));
+        }
+
+        load(a);
+        if (binary) load(b);
+
+        Operand dst;
+        dst.temp = true;
+        if (!freeTemps.empty()) {
+            dst.reg = freeTemps.back();
+            freeTemps.pop_back();
+        } else {
+            dst.reg = -(++temps);
+        }
+
+        ExprInstruction in;
+        in.op = op;
+        in.dst = dst.reg;
+        in.a = a.reg;
+        in.b = binary ? b.reg : a.reg;
+        in.n = n;
+        program.code.push_back(in);
+
+        // released after dst is taken, so an instruction never writes the registers it reads
+        release(a);
+        if (binary) release(b);
+
+        Kind widest = std::max(a.kind, binary ? b.kind : a.kind);
+        switch (op) {
+        case Op::abs: case Op::arg: case Op::re: case Op::im:
+            dst.kind = Kind::real;
+            break;
+        case Op::pow: case Op::log: case Op::sqrt:
+            dst.kind = Kind::complex;
+            break;
+        default:
+            dst.kind = widest;
+        }
+        if (dst.kind == Kind::complex || widest == Kind::complex) program.realSafe = false;
+        return dst;
+    }
+
+    Operand emitPow(Operand a, Operand b) {
+        // small integer exponents are repeated multiplication
+        if (b.reg < 0 && !b.temp && b.value.imag() == 0) {
+            double e = b.value.real();
+            if (e == std::floor(e) && std::fabs(e) <= 64) return emit(Op::powi, a, Operand(), (int) e);
+        }
+        return emit(Op::pow, a, b, 0, true);
+    }
+
+    bool parseSum(Operand& result) {
+        if (!parseProduct(result)) return false;
+        while (true) {
+            Op op;
+            if (accept('+')) op = Op::add;
+            else if (accept('-')) op = Op::sub;
+            else return true;
+
+            Operand rhs;
+            if (!parseProduct(rhs)) return false;
+            result = emit(op, result, rhs, 0, true);
+        }
+    }
+
+    bool parseProduct(Operand& result) {
+        if (!parseUnary(result)) return false;
+        while (true) {
+            Op op;
+            if (accept('*')) op = Op::mul;
+            else if (accept('/')) op = Op::div;
+            else return true;
+
+            Operand rhs;
+            if (!parseUnary(rhs)) return false;
+            result = emit(op, result, rhs, 0, true);
+        }
+    }
+
+    bool parseUnary(Operand& result) {
+        if (accept('-')) {
+            if (!parseUnary(result)) return false;
+            result = emit(Op::neg, result);
+            return true;
+        }
+        if (accept('+')) return parseUnary(result);
+        return parsePower(result);
+    }
+
+    bool parsePower(Operand& result) {
+        if (!parsePrimary(result)) return false;
+        if (!accept('^')) return true;
+
+        Operand exponent;
+        if (!parseUnary(exponent)) return false;
+        result = emitPow(result, exponent);
+        return true;
+    }
+
+    bool parsePrimary(Operand& result) {
+        skipSpace();
+        if (pos >= text.size()) return fail("unexpected end of formula");
+
+        char c = text[pos];
+        if (c == '(') {
+            pos++;
+            if (!parseSum(result)) return false;
+            if (!accept(')')) return fail("missing ')'");
+            return true;
+        }
+
+        if (std::isdigit((unsigned char) c) || c == '.') {
+            const char* begin = text.c_str() + pos;
+            char* end = nullptr;
+            double value = std::strtod(begin, &end);
+            if (end == begin) return fail("bad number");
+            pos += end - begin;
+
+            // a trailing i makes it imaginary
+            if (pos < text.size() && text[pos] == 'i' && (pos + 1 == text.size() || !isNameChar(text[pos + 1]))) {
+                pos++;
+                result = constant(Complex(0, value));
+            } else {
+                result = constant(Complex(value, 0));
+            }
+            return true;
+        }
+
+        if (!std::isalpha((unsigned char) c) && c != '_') return fail(std::string("unexpected '") + c + "'");
+
+        size_t start = pos;
+        while (pos < text.size() && isNameChar(text[pos])) pos++;
+        std::string name = text.substr(start, pos - start);
+
+        skipSpace();
+        if (pos < text.size() && text[pos] == '(') return parseCall(name, start, result);
+
+        static const std::map<std::string, int> inputs = {
+            {"v", in_v}, {"r", in_r}, {"g", in_g}, {"b", in_b},
+            {"x", in_x}, {"y", in_y}, {"w", in_w}, {"h", in_h}
+        };
+        auto input = inputs.find(name);
+        if (input != inputs.end()) {
+            result = Operand();
+            result.reg = input->second;
+            result.kind = input->second <= in_b ? Kind::input : Kind::real;
+            program.inputs |= 1 << input->second;
+            return true;
+        }
+
+        if (name == "i") result = constant(Complex(0, 1));
+        else if (name == "pi") result = constant(Complex(M_PI, 0));
+        else if (name == "e") result = constant(Complex(std::exp(1.0), 0));
+        else {
+            pos = start;
+            return fail("unknown name '" + name + "'");
+        }
+        return true;
+    }
+
+    bool parseCall(const std::string& name, size_t start, Operand& result) {
+        static const std::map<std::string, std::pair<Op, int>> functions = {
+            {"pow", {Op::pow, 2}}, {"log", {Op::log, 1}}, {"exp", {Op::exp, 1}}, {"sqrt", {Op::sqrt, 1}},
+            {"abs", {Op::abs, 1}}, {"arg", {Op::arg, 1}}, {"conj", {Op::conj, 1}}, {"re", {Op::re, 1}},
+            {"im", {Op::im, 1}}, {"sin", {Op::sin, 1}}, {"cos", {Op::cos, 1}}
+        };
+        auto function = functions.find(name);
+        if (function == functions.end()) {
+            pos = start;
+            return fail("unknown function '" + name + "'");
+        }
+
+        accept('(');
+        std::vector<Operand> args(1);
+        if (!parseSum(args.back())) return false;
+        while (accept(',')) {
+            args.emplace_back();
+            if (!parseSum(args.back())) return false;
+        }
+        if (!accept(')')) return fail("missing ')'");
+
+        if ((int) args.size() != function->second.second) {
+            pos = start;
+            return fail(name + " takes " + std::to_string(function->second.second) + " argument(s)");
+        }
+
+        if (function->second.first == Op::pow) result = emitPow(args[0], args[1]);
+        else result = emit(function->second.first, args[0]);
+        return true;
+    }
+};
+
+} // namespace
+
+
+bool compileExpr(const std::string& text, ExprProgram& program, std::ostream& err) {
+    program = ExprProgram();
+    Parser parser(text, program, err);
+    return parser.run();
+}
+
+
+void runExpr(const ExprProgram& program, Triple* px, int x, int y, int count, int width, int height, bool real) {
+    // per thread, so the workers of a batch each have their own
+    thread_local std::vector<double> scratch;
+    size_t size = (size_t) program.registers * 2 * exprBlock;
+    if (scratch.size() < size) scratch.resize(size);
+    double* regs = scratch.data();
+    auto re = [&](int r) { return regs + (size_t) r * 2 * exprBlock; };
+    auto im = [&](int r) { return regs + (size_t) r * 2 * exprBlock + exprBlock; };
+
+    bool realOnly = real && program.realSafe;
+    auto uses = [&](int input) { return (program.inputs >> input) & 1; };
+
+    for (size_t k = 0; k < program.constants.size(); k++) {
+        int r = inputCount + (int) k;
+        std::fill(re(r), re(r) + exprBlock, program.constants[k].real());
+        std::fill(im(r), im(r) + exprBlock, program.constants[k].imag());
+    }
+    for (int input : {in_x, in_y, in_w, in_h}) std::fill(im(input), im(input) + exprBlock, 0.0);
+    std::fill(re(in_y), re(in_y) + exprBlock, (double) y / height);
+    std::fill(re(in_w), re(in_w) + exprBlock, (double) width);
+    std::fill(re(in_h), re(in_h) + exprBlock, (double) height);
+
+    for (int start = 0; start < count; start += exprBlock) {
+        int n = std::min(exprBlock, count - start);
+        Triple* p = px + start;
+
+        for (int c = 0; c < 3; c++) {
+            int r = in_r + c;
+            if (!uses(r)) continue;
+            for (int i = 0; i < n; i++) re(r)[i] = p[i][c].real();
+            if (!realOnly) for (int i = 0; i < n; i++) im(r)[i] = p[i][c].imag();
+        }
+        if (uses(in_x)) {
+            for (int i = 0; i < n; i++) re(in_x)[i] = (double) (x + start + i) / width;
+        }
+
+        // without v every channel gets the same value
+        int passes = uses(in_v) ? 3 : 1;
+        for (int c = 0; c < passes; c++) {
+            if (uses(in_v)) {
+                for (int i = 0; i < n; i++) re(in_v)[i] = p[i][c].real();
+                if (!realOnly) for (int i = 0; i < n; i++) im(in_v)[i] = p[i][c].imag();
+            }
+
+            for (const ExprInstruction& in : program.code) runOp(in, regs, exprBlock, n, realOnly);
+
+            const double* resultRe = re(program.result);
+            const double* resultIm = im(program.result);
+            for (int k = (passes == 1 ? 0 : c); k < (passes == 1 ? 3 : c + 1); k++) {
+                if (realOnly) {
+                    for (int i = 0; i < n; i++) p[i][k].real(resultRe[i]);
+                } else {
+                    for (int i = 0; i < n; i++) p[i][k] = Complex(resultRe[i], resultIm[i]);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "Commons.h"
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Expression tools
+// A per-pixel formula is compiled once into register bytecode, every instruction then runs
+// over a whole block of pixels kept as separate real and imaginary arrays
+//
+//   expr pow(v,2)/255          expr (r+g+b)/3          expr v*exp(2*pi*i*x)
+//
+// variables: v (the channel being computed), r, g, b, x, y (position in [0,1)), w, h (image size)
+// constants: numbers, a trailing i makes them imaginary (2.5i), i, pi, e
+// functions: pow(a,b) log exp sqrt abs arg conj re im sin cos
+// operators: + - * / ^ and parentheses
+
+
+struct ExprInstruction {
+    enum class Op { add, sub, mul, div, neg, powi, pow, log, exp, sqrt, abs, arg, conj, re, im, sin, cos };
+
+    Op op = Op::add;
+    int dst = 0;
+    int a = 0;
+    int b = 0;
+    int n = 0;                              // powi: integer exponent
+};
+
+struct ExprProgram {
+    std::vector<ExprInstruction> code;
+    std::vector<Complex> constants;         // loaded into the registers after the inputs
+    int registers = 0;
+    int result = 0;
+    int inputs = 0;                         // bit k set when input register k is read
+    bool realSafe = true;                   // real inputs only give real values, the imaginary arrays can be skipped
+    bool channelWise = false;               // reads nothing but v, each channel is a function of its own value
+    RealEffect effect = RealEffect::complex;
+};
+
+
+// Compile a formula, syntax errors are reported with their position
+bool compileExpr(const std::string& text, ExprProgram& program, std::ostream& err);
+
+// Replace every channel of count pixels of row y, starting at column x, by the formula
+// real says every channel is real, which lets real-safe programs skip the imaginary parts
+void runExpr(const ExprProgram& program, Triple* px, int x, int y, int count, int width, int height, bool real);
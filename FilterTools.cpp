@@ -1,5 +1,7 @@
 #include "FilterTools.h"
 
+#include <mutex>
+
 
 
 
@@ -8,11 +10,14 @@
 std::map<std::string, FilterFunc> filters;
 
 
+// Safe to call from several threads, the table is only filled once
 void initFilter() {
-
-    filters["radius"] = Filter_radius;
-    filters["square"] = Filter_square;
-    filters["exp"] = Filter_exp;
+    static std::once_flag once;
+    std::call_once(once, [] {
+        filters["radius"] = Filter_radius;
+        filters["square"] = Filter_square;
+        filters["exp"] = Filter_exp;
+    });
 }
 
 
@@ -28,18 +33,6 @@ FilterFunc getFilter(std::string name) {
     return filters.find(name)-> second;
 }
 
-
-// filters 
-
-
-Complex Filter_radius(double x, double y) {
-    return Complex (1 - (x*x + y*y)/2, 0);
-}
-
-Complex Filter_square(double x, double y) {
-    return Complex ((x > 0.5 || y > 0.5 ? 0 : 1), 0);
+bool isRealFilter(std::string name) {
+    return name == "radius" || name == "square" || name == "exp";
 }
-
-Complex Filter_exp(double x, double y) {
-    return Complex (std::exp(- x - y), 0);
-}
\ No newline at end of file
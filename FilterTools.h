@@ -1,8 +1,11 @@
+#pragma once
+
 #include "Commons.h"
 
 
 #include <map>
 #include <string>
+#include <cmath>
 
 
 
@@ -15,9 +18,32 @@ bool hasFilter(std::string name);
 
 FilterFunc getFilter(std::string name);
 
+// True if the filter only returns real values
+bool isRealFilter(std::string name);
+
+
+// filters, x, y are in [0,1]
+
+inline Complex Filter_radius(double x, double y) {
+    return Complex (1 - (x*x + y*y)/2, 0);
+}
+
+inline Complex Filter_square(double x, double y) {
+    return Complex ((x > 0.5 || y > 0.5 ? 0 : 1), 0);
+}
 
-Complex Filter_radius(double x, double y);
+inline Complex Filter_exp(double x, double y) {
+    return Complex (std::exp(- x - y), 0);
+}
 
-Complex Filter_square(double x, double y);
 
-Complex Filter_exp(double x, double y);
\ No newline at end of file
+// Call f with a functor for the named filter, so the filter loop can be instantiated per filter
+// false if there is no such filter
+template <typename F>
+bool visitFilter(const std::string& name, F&& f) {
+    if (name == "radius") f([](double x, double y) { return Filter_radius(x, y); });
+    else if (name == "square") f([](double x, double y) { return Filter_square(x, y); });
+    else if (name == "exp") f([](double x, double y) { return Filter_exp(x, y); });
+    else return false;
+    return true;
+}
@@ -1,10 +1,13 @@
 #include "FragTools.h"
+#include "RandTools.h"
+#include "ThreadTools.h"
 
 
 #include <queue>
-#include <random>
 #include <cmath>
 #include <algorithm>
+#include <array>
+#include <mutex>
 // #include <chrono> 
 
 
@@ -53,31 +56,14 @@ struct CompareNode {
 
 
 // Non-uniform fragmentation
-std::vector<struct frame> nuFrag (int height, int width, int seed, int type){
+// Squares are placed corner by corner, the covered cells of column x are always the rows [0, top[x]),
+// so a skyline of one height per column replaces a width x height grid
+std::vector<struct frame> nuFrag (int height, int width, int seed){
 
-    // for now type is useless
-    if (type == 1){
-        type = 0;
-    }
-
-
-    std::vector<std::vector<int>> filled(width, std::vector<int>(height, 0));
-
-    // Random number generator
-    std::mt19937 rng;
-    if (seed != -1) {
-        rng.seed(seed);
-    } else {
-        // Use a non-deterministic seed
-        std::random_device rd;
-        rng.seed(rd());
-    }
+    std::vector<int> top(width, 0);
 
-    // Helper to generate random integer in [low, high] inclusive
-    auto rand_int = [&rng](int low, int high) -> int {
-        std::uniform_int_distribution<int> dist(low, high);
-        return dist(rng);
-    };
+    // the size of the square at a corner only depends on the seed and the corner
+    uint64_t key = static_cast<uint64_t>(seed);
 
     std::vector<struct frame> frames;
     std::priority_queue<Node, std::vector<Node>, CompareNode> pq;
@@ -95,39 +81,318 @@ std::vector<struct frame> nuFrag (int height, int width, int seed, int type){
         bound = std::min(bound, 25);
         // Bound Adjustment
         for (int i = 0; i < bound; ++i) {
-            if (filled[x + i][y] == 1) {
+            if (top[x + i] > y) {
                 bound = i;
                 break;
             }
         }
 
-        int k = rand_int(1, bound);
+        int k = randInt(philox(key, randCounter(x, y))[0], 1, bound);
 
         // Push the neighbor to the right (if any)
-        if (y + k < height && (x == 0 || filled[x - 1][y + k] == 1)) {
+        if (y + k < height && (x == 0 || top[x - 1] > y + k)) {
             int priority = y + k - x;
             pq.push({priority, x, y + k});
         }
 
-        // Push the neighbour below (if any)
+        // Push the neighbour below (if any), at the first uncovered cell next to the square
         if (x + k < width) {
-            for (int i = 0; i < k; ++i) {
-                if (filled[x + k][y + i] == 0) {
-                    int priority = y + i - x - k;
-                    pq.push({priority, x + k, y + i});
-                    break;
-                }
+            int i = std::max(0, top[x + k] - y);
+            if (i < k) {
+                int priority = y + i - x - k;
+                pq.push({priority, x + k, y + i});
             }
         }
 
         frames.push_back({x, y, k, k});
         
         for (int i = 0; i < k; ++i) {
-            for (int j = 0; j < k; ++j) {
-                filled[x + i][y + j] = 1;
+            top[x + i] = std::max(top[x + i], y + k);
+        }
+    }
+
+    return frames;
+}
+
+
+FragRows fragRows(const std::vector<struct frame>& frames, int height) {
+    FragRows rows;
+    rows.start.assign(height + 1, 0);
+    for (const struct frame& f : frames) {
+        for (int y = f.y; y < f.y + f.y_size; y++) rows.start[y + 1]++;
+    }
+    for (int y = 0; y < height; y++) rows.start[y + 1] += rows.start[y];
+
+    rows.index.resize(rows.start[height]);
+    std::vector<int> next(rows.start.begin(), rows.start.end() - 1);
+    for (int i = 0; i < (int) frames.size(); i++) {
+        const struct frame& f = frames[i];
+        for (int y = f.y; y < f.y + f.y_size; y++) rows.index[next[y]++] = i;
+    }
+
+    for (int y = 0; y < height; y++) {
+        std::sort(rows.index.begin() + rows.start[y], rows.index.begin() + rows.start[y + 1],
+                  [&frames](int a, int b) { return frames[a].x < frames[b].x; });
+    }
+    return rows;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------------------
+
+
+
+// Summed-area table, at(x, y) is the sum over [0, x) x [0, y)
+struct SAT {
+    int width = 0;
+    std::vector<double> sum;
+
+    SAT(int w, int h) : width(w + 1), sum(static_cast<size_t>(w + 1) * (h + 1), 0.0) {}
+
+    double& at(int x, int y) { return sum[static_cast<size_t>(y) * width + x]; }
+    double at(int x, int y) const { return sum[static_cast<size_t>(y) * width + x]; }
+
+    double area(const struct frame& f) const {
+        return at(f.x + f.x_size, f.y + f.y_size) - at(f.x, f.y + f.y_size) - at(f.x + f.x_size, f.y) + at(f.x, f.y);
+    }
+
+    // turn per-pixel values stored at (x + 1, y + 1) into running sums
+    void integrate(int w, int h) {
+        for (int y = 1; y <= h; y++) {
+            double row = 0;
+            for (int x = 1; x <= w; x++) {
+                row += at(x, y);
+                at(x, y) = at(x, y - 1) + row;
             }
         }
     }
+};
+
+
+// Smallest side a quadtree frame is split down to
+static constexpr int quadMinSize = 2;
+
+std::vector<struct frame> quadFrag(const ImageData& img, int threshold, int type) {
+    int width = img.width;
+    int height = img.height;
+
+    auto value = [&img](int x, int y, int c) -> double {
+        if (img.is8bit()) return img.rgb8[y][x][c];
+        return img.pixels[y][x][c].real();
+    };
+
+    // FRAG_VARIANCE: sum and sum of squares per channel, FRAG_EDGES: squared gradient of all channels
+    std::vector<SAT> tables;
+    if (type == FRAG_VARIANCE) {
+        tables.assign(6, SAT(width, height));
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                for (int c = 0; c < 3; c++) {
+                    double v = value(x, y, c);
+                    tables[2 * c].at(x + 1, y + 1) = v;
+                    tables[2 * c + 1].at(x + 1, y + 1) = v * v;
+                }
+            }
+        }
+    } else {
+        tables.assign(1, SAT(width, height));
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                double e = 0;
+                for (int c = 0; c < 3; c++) {
+                    double v = value(x, y, c);
+                    double dx = x + 1 < width ? value(x + 1, y, c) - v : 0;
+                    double dy = y + 1 < height ? value(x, y + 1, c) - v : 0;
+                    e += dx * dx + dy * dy;
+                }
+                tables[0].at(x + 1, y + 1) = e;
+            }
+        }
+    }
+    for (SAT& t : tables) t.integrate(width, height);
+
+    auto busy = [&](const struct frame& f) -> double {
+        double n = static_cast<double>(f.x_size) * f.y_size;
+        if (type != FRAG_VARIANCE) return std::sqrt(tables[0].area(f) / n);
 
+        double var = 0;
+        for (int c = 0; c < 3; c++) {
+            double mean = tables[2 * c].area(f) / n;
+            var = std::max(var, tables[2 * c + 1].area(f) / n - mean * mean);
+        }
+        return std::sqrt(std::max(var, 0.0));
+    };
+
+    // depth first, children in reading order
+    std::vector<struct frame> frames;
+    std::vector<struct frame> stack = {{0, 0, width, height}};
+    while (!stack.empty()) {
+        struct frame f = stack.back();
+        stack.pop_back();
+
+        bool splitX = f.x_size >= 2 * quadMinSize;
+        bool splitY = f.y_size >= 2 * quadMinSize;
+        if ((!splitX && !splitY) || busy(f) <= threshold) {
+            frames.push_back(f);
+            continue;
+        }
+
+        int w0 = splitX ? f.x_size / 2 : f.x_size;
+        int h0 = splitY ? f.y_size / 2 : f.y_size;
+        struct frame children[4] = {
+            {f.x, f.y, w0, h0}, {f.x + w0, f.y, f.x_size - w0, h0},
+            {f.x, f.y + h0, w0, f.y_size - h0}, {f.x + w0, f.y + h0, f.x_size - w0, f.y_size - h0}
+        };
+        for (int i = 3; i >= 0; i--) {
+            if (children[i].x_size > 0 && children[i].y_size > 0) stack.push_back(children[i]);
+        }
+    }
+
+    return frames;
+}
+
+
+// -----------------------------------------------------------------------------------------------------------------------------------
+
+
+
+FragRegions voronoiFrag(int height, int width, int count, int seed) {
+    int size = width * height;
+    count = std::clamp(count, 1, size);
+
+    // distinct seed pixels, seed k draws from its own stream of the key until it finds a free pixel
+    uint64_t key = static_cast<uint64_t>(static_cast<uint32_t>(seed)) << 32 | static_cast<uint32_t>(count);
+    std::vector<int> seedX, seedY;
+    std::vector<int> nearest(size, -1);
+    for (int k = 0; k < count; k++) {
+        RandStream rng(key, static_cast<uint64_t>(k));
+        int p;
+        do {
+            p = randInt(rng(), 0, size - 1);
+        } while (nearest[p] != -1);
+        nearest[p] = k;
+        seedX.push_back(p % width);
+        seedY.push_back(p / width);
+    }
+
+    auto dist = [&](int s, int x, int y) -> long long {
+        long long dx = seedX[s] - x;
+        long long dy = seedY[s] - y;
+        return dx * dx + dy * dy;
+    };
+
+    // every pass offers each pixel the seeds of its 8 neighbours at distance step,
+    // the last pass repeats step 1 to fix most of the pixels the halving steps got wrong
+    std::vector<int> steps;
+    int first = 1;
+    while (2 * first < std::max(width, height)) first *= 2;
+    for (int step = first; step >= 1; step /= 2) steps.push_back(step);
+    steps.push_back(1);
+
+    std::vector<int> next(size);
+    for (int step : steps) {
+        parallelBands(height, bandRows, [&](int firstRow, int lastRow) {
+            for (int y = firstRow; y < lastRow; y++) {
+                for (int x = 0; x < width; x++) {
+                    int best = nearest[y * width + x];
+                    long long bestDist = best == -1 ? 0 : dist(best, x, y);
+                    for (int dy = -step; dy <= step; dy += step) {
+                        int y1 = y + dy;
+                        if (y1 < 0 || y1 >= height) continue;
+                        for (int dx = -step; dx <= step; dx += step) {
+                            int x1 = x + dx;
+                            if (x1 < 0 || x1 >= width) continue;
+                            int s = nearest[y1 * width + x1];
+                            if (s == -1 || s == best) continue;
+                            long long d = dist(s, x, y);
+                            // ties go to the lower seed so the map does not depend on the scan order
+                            if (best == -1 || d < bestDist || (d == bestDist && s < best)) {
+                                best = s;
+                                bestDist = d;
+                            }
+                        }
+                    }
+                    next[y * width + x] = best;
+                }
+            }
+        });
+        nearest.swap(next);
+    }
+
+    // counting sort of the pixels by label keeps each region in reading order
+    FragRegions regions;
+    regions.start.assign(count + 1, 0);
+    for (int p = 0; p < size; p++) regions.start[nearest[p] + 1]++;
+    for (int r = 0; r < count; r++) regions.start[r + 1] += regions.start[r];
+    regions.pixel.resize(size);
+    std::vector<int> fill(regions.start.begin(), regions.start.end() - 1);
+    for (int p = 0; p < size; p++) regions.pixel[fill[nearest[p]]++] = p;
+    regions.label = std::move(nearest);
+    return regions;
+}
+
+
+// Bounding box of every region
+static std::vector<struct frame> regionBoxes(const FragRegions& regions, int width) {
+    std::vector<struct frame> frames;
+    frames.reserve(regions.count());
+    for (int r = 0; r < regions.count(); r++) {
+        int x0 = width, x1 = 0;
+        for (int i = regions.start[r]; i < regions.start[r + 1]; i++) {
+            x0 = std::min(x0, regions.pixel[i] % width);
+            x1 = std::max(x1, regions.pixel[i] % width);
+        }
+        int y0 = regions.pixel[regions.start[r]] / width;
+        int y1 = regions.pixel[regions.start[r + 1] - 1] / width;
+        frames.push_back({x0, y0, x1 - x0 + 1, y1 - y0 + 1});
+    }
     return frames;
-}
\ No newline at end of file
+}
+
+
+// Most recently used plans, first is newest
+static constexpr size_t planCacheSize = 8;
+static std::mutex planMutex;
+static std::vector<std::pair<std::array<int, 6>, std::shared_ptr<const FragPlan>>> planCache;
+
+std::shared_ptr<const FragPlan> fragPlan(const ImageData& img, int sx, int sy, int fr, int type, int seed) {
+    int height = img.height;
+    int width = img.width;
+
+    if (type == FRAG_VARIANCE || type == FRAG_EDGES) {
+        std::shared_ptr<FragPlan> plan = std::make_shared<FragPlan>();
+        plan->frames = quadFrag(img, fr ? fr : defaultQuadThreshold, type);
+        plan->rows = fragRows(plan->frames, height);
+        return plan;
+    }
+
+    // only the parameters the fragmentation depends on
+    std::array<int, 6> key = type == FRAG_VORONOI ? std::array<int, 6>{height, width, seed, 0, fr, type}
+                           : fr == 0 ? std::array<int, 6>{height, width, sx, sy, 0, type}
+                                     : std::array<int, 6>{height, width, 0, 0, fr, type};
+    {
+        std::lock_guard<std::mutex> lock(planMutex);
+        for (size_t i = 0; i < planCache.size(); i++) {
+            if (planCache[i].first != key) continue;
+            std::rotate(planCache.begin(), planCache.begin() + i, planCache.begin() + i + 1);
+            return planCache.front().second;
+        }
+    }
+
+    std::shared_ptr<FragPlan> plan = std::make_shared<FragPlan>();
+    if (type == FRAG_VORONOI) {
+        plan->regions = voronoiFrag(height, width, fr ? fr : defaultVoronoiSeeds, seed);
+        plan->frames = regionBoxes(plan->regions, width);
+    } else if (fr == 0) {
+        plan->frames = GridFrag(height, width, sx, sy);
+    } else {
+        plan->frames = nuFrag(height, width, fr);
+        plan->rows = fragRows(plan->frames, height);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(planMutex);
+        planCache.insert(planCache.begin(), {key, plan});
+        if (planCache.size() > planCacheSize) planCache.pop_back();
+    }
+    return plan;
+}
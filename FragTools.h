@@ -1,5 +1,10 @@
+#pragma once
+
 #include "Commons.h"
+#include "ImageData.h"
 
+#include <algorithm>
+#include <memory>
 #include <vector>
 
 
@@ -9,4 +14,105 @@
 std::vector<struct frame> GridFrag (int height, int width, int sx, int sy);
 
 
-std::vector<struct frame> nuFrag (int height, int width, int seed, int type);
\ No newline at end of file
+std::vector<struct frame> nuFrag (int height, int width, int seed);
+
+
+// Frames covering each row, ordered by x, so the frame of a pixel is found without a per-pixel map
+// the frames of row y are index[start[y]] .. index[start[y + 1] - 1]
+struct FragRows {
+    std::vector<int> start;
+    std::vector<int> index;
+};
+
+FragRows fragRows(const std::vector<struct frame>& frames, int height);
+
+
+// Content adaptive quadtree: frames are split in four while they are busier than threshold
+// FRAG_VARIANCE measures the largest channel standard deviation, FRAG_EDGES the rms gradient
+// Both come from summed-area tables of the real parts, so each split decision is O(1)
+std::vector<struct frame> quadFrag(const ImageData& img, int threshold, int type);
+
+
+// Arbitrary regions given by a label map, with the pixels of each region listed once
+// the pixels of region r are pixel[start[r]] .. pixel[start[r + 1] - 1], as y * width + x in reading order
+struct FragRegions {
+    std::vector<int> label;
+    std::vector<int> start;
+    std::vector<int> pixel;
+
+    int count() const { return static_cast<int>(start.size()) - 1; }
+};
+
+// Voronoi cells of count distinct random seed pixels placed from the key seed, labelled by jump flooding:
+// log2(size) passes each look at 9 pixels, so the map costs O(n log n) whatever the number of seeds
+// Each pass is split into bands of rows filled in parallel
+FragRegions voronoiFrag(int height, int width, int count, int seed = 0);
+
+
+// Fragmentation types, chosen with -ft
+enum FragType { FRAG_RANDOM, FRAG_VARIANCE, FRAG_EDGES, FRAG_VORONOI, FRAG_TYPES };
+
+// Threshold of the quadtree types when -fr is not given
+constexpr int defaultQuadThreshold = 16;
+
+// Number of Voronoi seeds when -fr is not given
+constexpr int defaultVoronoiSeeds = 64;
+
+
+// Frames of an image
+// FRAG_RANDOM: a grid of sx x sy frames if fr is 0, else nuFrag seeded with fr
+// FRAG_VARIANCE, FRAG_EDGES: quadFrag with threshold fr
+// FRAG_VORONOI: voronoiFrag with fr seed pixels placed from seed, frames are the bounding boxes of the regions and overlap
+// rows is only built for non-uniform rectangle plans, regions only for label plans
+struct FragPlan {
+    std::vector<struct frame> frames;
+    FragRows rows;
+    FragRegions regions;
+
+    bool hasRegions() const { return !regions.label.empty(); }
+};
+
+// Frame of successive pixels of row y, for x increasing from x0
+// plan is null for a grid of sx x sy frames, found by division, regions come from the label map
+// and other non-uniform frames (which tile the image) from the frames of the row
+struct FrameCursor {
+    const FragPlan* plan;
+    int width, height, sx, sy, y;
+    const int* span = nullptr;
+    const int* spanEnd = nullptr;
+
+    FrameCursor(const FragPlan* plan, int width, int height, int sx, int sy, int x0, int y)
+        : plan(plan), width(width), height(height), sx(sx), sy(sy), y(y) {
+        if (!plan || plan->hasRegions()) return;
+
+        // last frame of the row starting at or before x0, then walk right
+        const std::vector<struct frame>& frames = plan->frames;
+        const int* first = plan->rows.index.data() + plan->rows.start[y];
+        spanEnd = plan->rows.index.data() + plan->rows.start[y + 1];
+        span = std::upper_bound(first, spanEnd, x0, [&frames](int x, int k) { return x < frames[k].x; });
+        if (span != first) span--;
+    }
+
+    // false when no frame covers the pixel
+    bool at(int x, struct frame& f) {
+        if (!plan) {
+            f.x = x / sx * sx;
+            f.y = y / sy * sy;
+            f.x_size = std::min(sx, width - f.x);
+            f.y_size = std::min(sy, height - f.y);
+            return true;
+        }
+        if (plan->hasRegions()) {
+            f = plan->frames[plan->regions.label[y * width + x]];
+            return true;
+        }
+        while (span != spanEnd && plan->frames[*span].x + plan->frames[*span].x_size <= x) span++;
+        if (span == spanEnd || plan->frames[*span].x > x) return false;
+        f = plan->frames[*span];
+        return true;
+    }
+};
+
+
+// Plans that only depend on the size are cached by their parameters
+std::shared_ptr<const FragPlan> fragPlan(const ImageData& img, int sx, int sy, int fr, int type = FRAG_RANDOM, int seed = 0);
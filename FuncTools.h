@@ -1,54 +1,252 @@
+#pragma once
+
 #include "Commons.h"
+#include "Utils.h"
+
+#include <cmath>
+#include <utility>
 
 
 // Function tools
-// work in progress
+// Pixel, two-pixel and warp functions are small functors: the handlers' loops are templates
+// instantiated per functor, so the calls are inlined instead of going through std::function
 
 
-Complex Quantize(Complex x, int s);
+inline Complex Quantize(Complex x, int s){
+    return Complex(x.real()-(std::fmod(x.real() , s)), 0);
+}
 
 
-Complex Cutoff(Complex x, int s);
+inline Complex Cutoff(Complex x, int s){
+    if (std::abs(x) > s) return x;
+    return Complex(0,0);
+}
 
 
-// Pixel functions
+// Pixel functors
+// operator() transforms one pixel in place, effect is what it does to the real channels
+// With hasReal, real() does the same on the real parts {r, g, b} of a pixel whose channels are all real
+// With hasBytes, bytes() does the same on count values of an 8-bit image, whose results are still bytes
+// perChannel: every channel goes through the same function of its own value only
 
 // fit to [0,255]
-Triple PF_fit(Triple& a);
+struct PF_Fit {
+    static constexpr RealEffect effect = RealEffect::real;
+    static constexpr bool hasReal = false;
+    static constexpr bool hasBytes = true;
+    static constexpr bool perChannel = true;
+    void operator()(Triple& a) const {
+        a[0] = uchar_to_complex(complex_to_uchar(a[0]));
+        a[1] = uchar_to_complex(complex_to_uchar(a[1]));
+        a[2] = uchar_to_complex(complex_to_uchar(a[2]));
+    }
+    void bytes(unsigned char*, int) const {}
+};
 
 
 // use luminance to create grayscale
-Triple PF_grayscale(Triple& a);
+struct PF_Grayscale {
+    static constexpr RealEffect effect = RealEffect::mix;
+    static constexpr bool hasReal = true;
+    static constexpr bool hasBytes = false;
+    static constexpr bool perChannel = false;
+    void operator()(Triple& a) const {
+        Complex gray =
+            Complex(0.299,0) * a[0] +
+            Complex(0.587,0) * a[1] +
+            Complex(0.114,0) * a[2];
+        a[0] = gray;
+        a[1] = gray;
+        a[2] = gray;
+    }
+    void real(double* a) const {
+        double gray = 0.299 * a[0] + 0.587 * a[1] + 0.114 * a[2];
+        a[0] = gray;
+        a[1] = gray;
+        a[2] = gray;
+    }
+};
 
 
 // invert around 255
-Triple PF_invert(Triple& a);
+struct PF_Invert {
+    static constexpr RealEffect effect = RealEffect::keep;
+    static constexpr bool hasReal = true;
+    static constexpr bool hasBytes = true;
+    static constexpr bool perChannel = true;
+    void operator()(Triple& a) const {
+        Complex c_255 = Complex(255,0);
+        a[0] = c_255 - a[0]; // Invert Red
+        a[1] = c_255 - a[1]; // Invert Green
+        a[2] = c_255 - a[2]; // Invert Blue
+    }
+    void real(double* a) const {
+        a[0] = 255 - a[0];
+        a[1] = 255 - a[1];
+        a[2] = 255 - a[2];
+    }
+    void bytes(unsigned char* v, int count) const {
+        for (int i = 0; i < count; i++) v[i] = 255 - v[i];
+    }
+};
 
 // take absolute value
-Triple PF_absolute(Triple& a);
+struct PF_Absolute {
+    static constexpr RealEffect effect = RealEffect::real;
+    static constexpr bool hasReal = false;
+    static constexpr bool hasBytes = false;
+    static constexpr bool perChannel = false;
+    void operator()(Triple& a) const {
+        a[0] = std::abs(a[0]);
+        a[1] = std::abs(a[2]);
+        a[2] = std::abs(a[1]);
+    }
+};
 
 // keep only real
-Triple PF_real(Triple& a);
+struct PF_Real {
+    static constexpr RealEffect effect = RealEffect::real;
+    static constexpr bool hasReal = false;
+    static constexpr bool hasBytes = false;
+    static constexpr bool perChannel = false;
+    void operator()(Triple& a) const {
+        a[0] = std::real(a[0]);
+        a[1] = std::real(a[2]);
+        a[2] = std::real(a[1]);
+    }
+};
 
 
 // keep only imaginary
-Triple PF_im(Triple& a);
+struct PF_Im {
+    static constexpr RealEffect effect = RealEffect::keep;
+    static constexpr bool hasReal = false;
+    static constexpr bool hasBytes = false;
+    static constexpr bool perChannel = false;
+    void operator()(Triple& a) const {
+        a[0] = a[0] - std::real(a[0]);
+        a[1] = a[1] - std::real(a[2]);
+        a[2] = a[2] - std::real(a[1]);
+    }
+};
 
 
 // square each
-Triple PF_square(Triple& a);
-
+struct PF_Square {
+    static constexpr RealEffect effect = RealEffect::keep;
+    static constexpr bool hasReal = true;
+    static constexpr bool hasBytes = false;
+    static constexpr bool perChannel = true;
+    void operator()(Triple& a) const {
+        a[0] = a[0] * a[0];
+        a[1] = a[1] * a[1];
+        a[2] = a[2] * a[2];
+    }
+    void real(double* a) const {
+        a[0] = a[0] * a[0];
+        a[1] = a[1] * a[1];
+        a[2] = a[2] * a[2];
+    }
+};
+
+
+// quantize the real part to multiples of s
+struct PF_Quantize {
+    static constexpr RealEffect effect = RealEffect::real;
+    static constexpr bool hasReal = false;
+    static constexpr bool hasBytes = true;
+    static constexpr bool perChannel = true;
+    int s;
+    void operator()(Triple& a) const {
+        a[0] = Quantize(a[0], s);
+        a[1] = Quantize(a[1], s);
+        a[2] = Quantize(a[2], s);
+    }
+    void bytes(unsigned char* v, int count) const {
+        for (int i = 0; i < count; i++) v[i] = v[i] - v[i] % s;
+    }
+};
+
+
+// zero values of magnitude up to s
+struct PF_Cutoff {
+    static constexpr RealEffect effect = RealEffect::keep;
+    static constexpr bool hasReal = false;
+    static constexpr bool hasBytes = false;
+    static constexpr bool perChannel = true;
+    int s;
+    void operator()(Triple& a) const {
+        a[0] = Cutoff(a[0], s);
+        a[1] = Cutoff(a[1], s);
+        a[2] = Cutoff(a[2], s);
+    }
+};
+
+
+// Apply a pixel functor to count pixels of an 8-bit image
+template <typename F>
+inline void applyBytes(const F& f, RGB8* px, int count) {
+    static_assert(F::hasBytes, "functor has no 8-bit variant");
+    f.bytes(reinterpret_cast<unsigned char*>(px), 3 * count);
+}
+
+
+// Apply a pixel functor to count pixels, through its real variant when every channel is real
+template <typename F>
+inline void applyPixels(const F& f, Triple* px, int count, bool real) {
+    if constexpr (F::hasReal) {
+        if (real) {
+            for (int i = 0; i < count; i++) {
+                double a[3] = {px[i][0].real(), px[i][1].real(), px[i][2].real()};
+                f.real(a);
+                px[i][0].real(a[0]);
+                px[i][1].real(a[1]);
+                px[i][2].real(a[2]);
+            }
+            return;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        f(px[i]);
+    }
+}
+
+
+// Real-channel mask after an operation with effect e on an image with mask (bit c = channel c is real)
+int realMaskAfter(RealEffect e, int mask);
+
+
+// Pixel functors with a complex constant
 
 // multiply by constant
-Triple PFC_mult(Triple& a, Complex& c);
+struct PFC_Mult {
+    void operator()(Triple& a, Complex c) const {
+        a[0] = a[0] * c;
+        a[1] = a[1] * c;
+        a[2] = a[2] * c;
+    }
+};
 
 
 // divide by constant
-Triple PFC_div(Triple& a, Complex& c);
+struct PFC_Div {
+    void operator()(Triple& a, Complex c) const {
+        if (std::abs(c) == 0) return;
+        a[0] = a[0] / c;
+        a[1] = a[1] / c;
+        a[2] = a[2] / c;
+    }
+};
 
 
 // add constant
-Triple PFC_add(Triple& a, Complex& c);
+struct PFC_Add {
+    void operator()(Triple& a, Complex c) const {
+        a[0] = a[0] + c;
+        a[1] = a[1] + c;
+        a[2] = a[2] + c;
+    }
+};
 
 
 // Sort tools
@@ -59,18 +257,51 @@ bool sort_v1(const Complex& a, const Complex& b);
 
 
 // warp tools
+// map normalized destination coordinates to normalized source coordinates
 
-std::pair<double, double> warp_square(double x, double y);
+struct Warp_Square {
+    std::pair<double, double> operator()(double x, double y) const {
+        return std::pair<double, double>(x * x, y * y);
+    }
+};
 
-std::pair<double, double> warp_sqrt(double x, double y);
+struct Warp_Sqrt {
+    std::pair<double, double> operator()(double x, double y) const {
+        return std::pair<double, double>(std::sqrt(x), std::sqrt(y));
+    }
+};
 
 
 // two-pixel functions
 
-Triple D_add(Triple& a, Triple& b);
-
-
-Triple D_mult(Triple& a, Triple& b);
-
-
-Triple D_div(Triple& a, Triple& b);
\ No newline at end of file
+struct D_Add {
+    Triple operator()(const Triple& a, const Triple& b) const {
+        Triple c;
+        c[0] = a[0] + b[0];
+        c[1] = a[1] + b[1];
+        c[2] = a[2] + b[2];
+        return c;
+    }
+};
+
+
+struct D_Mult {
+    Triple operator()(const Triple& a, const Triple& b) const {
+        Triple c;
+        c[0] = a[0] * b[0];
+        c[1] = a[1] * b[1];
+        c[2] = a[2] * b[2];
+        return c;
+    }
+};
+
+
+struct D_Div {
+    Triple operator()(const Triple& a, const Triple& b) const {
+        Triple c;
+        c[0] = (std::abs(b[0]) < 0.0001) ? Complex(10000,0) * a[0] : a[0] / b[0];
+        c[1] = (std::abs(b[1]) < 0.0001) ? Complex(10000,0) * a[1] : a[1] / b[1];
+        c[2] = (std::abs(b[2]) < 0.0001) ? Complex(10000,0) * a[2] : a[2] / b[2];
+        return c;
+    }
+};
@@ -1,28 +1,193 @@
 #include "ImageData.h"
+#include "PackTools.h"
+#include "Utils.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+SpillFile::~SpillFile() {
+    if (fd != -1) close(fd);
+}
+
 
 void ImageData::allocate(int w, int h) {
     width = w;
     height = h;
-    pixels = std::vector<std::vector<std::vector<Complex>>>(
-        height, 
-        std::vector<std::vector<Complex>>(
-            width, 
-            std::vector<Complex>(3, 0) // RGB values
-        )
-    );
+    spilled.reset();
+    packed.reset();
+    rgb8.clear();
+    pixels.allocate(width, height);
+    realMask = 7; // zero filled
+    isLoaded = true;
+}
+
+void ImageData::allocate8(int w, int h) {
+    width = w;
+    height = h;
+    spilled.reset();
+    packed.reset();
+    pixels.clear();
+    rgb8.allocate(width, height);
+    realMask = 7;
     isLoaded = true;
 }
 
 void ImageData::clear() {
     pixels.clear();
+    rgb8.clear();
+    spilled.reset();
+    packed.reset();
+    realMask = 0;
     width = height = 0;
     isLoaded = false;
 }
 
-void ImageData::printInfo() const {
+void ImageData::printInfo(std::ostream& out) const {
     if (isLoaded) {
-        std::cout << "Image loaded: " << width << "x" << height << " pixels" << std::endl;
+        out << "Image loaded: " << width << "x" << height << " pixels" << std::endl;
+    } else {
+        out << "No image loaded" << std::endl;
+    }
+}
+
+size_t ImageData::bytes() const {
+    return pixels.bytes() + rgb8.bytes() + (packed ? packed->capacity() : 0);
+}
+
+size_t ImageData::spilledBytes() const {
+    return spilled ? spilled->bytes : 0;
+}
+
+bool ImageData::spill(const std::string& dir) {
+    if (!isLoaded || spilled) return false;
+
+    // packed images spill their blob, 8-bit ones their bytes
+    const void* src = pixels.raw();
+    size_t n = pixels.size() * sizeof(Triple);
+    if (packed) {
+        src = packed->data();
+        n = packed->size();
+    } else if (is8bit()) {
+        src = rgb8.raw();
+        n = rgb8.size() * sizeof(RGB8);
+    }
+    if (n == 0) return false;
+
+    std::string path = dir + "/nLOSS-spill-XXXXXX";
+    std::vector<char> name(path.begin(), path.end());
+    name.push_back('\0');
+
+    auto file = std::make_shared<SpillFile>();
+    file->fd = mkstemp(name.data());
+    if (file->fd == -1) return false;
+    // nameless from here on, the space is released when the descriptor closes
+    unlink(name.data());
+
+    if (ftruncate(file->fd, n) != 0) return false;
+
+    void* map = mmap(nullptr, n, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+    if (map == MAP_FAILED) return false;
+    std::memcpy(map, src, n);
+    munmap(map, n);
+
+    file->bytes = n;
+    file->packed = packed != nullptr;
+    file->rgb8 = is8bit();
+    spilled = file;
+    pixels.clear();
+    rgb8.clear();
+    packed.reset();
+    return true;
+}
+
+bool ImageData::unspill() {
+    if (!spilled) return true;
+
+    size_t n = spilled->bytes;
+    void* map = mmap(nullptr, n, PROT_READ, MAP_SHARED, spilled->fd, 0);
+    if (map == MAP_FAILED) return false;
+
+    if (spilled->packed) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(map);
+        packed = std::make_shared<const std::vector<uint8_t>>(bytes, bytes + n);
+    } else if (spilled->rgb8) {
+        rgb8.allocate(width, height);
+        std::memcpy(static_cast<void*>(rgb8.raw()), map, n);
     } else {
-        std::cout << "No image loaded" << std::endl;
+        pixels.allocate(width, height);
+        std::memcpy(static_cast<void*>(pixels.raw()), map, n);
     }
+    munmap(map, n);
+
+    spilled.reset();
+    return true;
+}
+
+void ImageData::pack(std::shared_ptr<const std::vector<uint8_t>> blob) {
+    packed = std::move(blob);
+    pixels.clear();
+}
+
+bool ImageData::unpack() {
+    if (!packed) return true;
+
+    PixelBuffer decoded;
+    decoded.allocate(width, height);
+    if (!unpackPixels(*packed, decoded.raw(), decoded.size())) return false;
+
+    pixels = std::move(decoded);
+    packed.reset();
+    return true;
+}
+
+void ImageData::promote() {
+    if (!is8bit()) return;
+
+    PixelBuffer widened;
+    widened.allocate(width, height);
+    const RGB8* src = rgb8.raw();
+    Triple* dst = widened.raw();
+    for (size_t i = 0; i < rgb8.size(); i++) {
+        dst[i][0] = uchar_to_complex(src[i][0]);
+        dst[i][1] = uchar_to_complex(src[i][1]);
+        dst[i][2] = uchar_to_complex(src[i][2]);
+    }
+
+    pixels = std::move(widened);
+    rgb8.clear();
+    realMask = 7;
+}
+
+// A byte: a real integer in [0,255], without negative zeros which promote() would not give back
+static bool isByte(const Complex& v) {
+    return v.imag() == 0 && !std::signbit(v.imag()) && !std::signbit(v.real())
+        && v.real() <= 255 && v.real() == std::floor(v.real());
+}
+
+bool ImageData::demote() {
+    if (pixels.size() == 0) return false;
+
+    const Triple* src = pixels.raw();
+    for (size_t i = 0; i < pixels.size(); i++) {
+        if (!isByte(src[i][0]) || !isByte(src[i][1]) || !isByte(src[i][2])) return false;
+    }
+
+    ByteBuffer narrowed;
+    narrowed.allocate(width, height);
+    RGB8* dst = narrowed.raw();
+    for (size_t i = 0; i < pixels.size(); i++) {
+        dst[i][0] = static_cast<unsigned char>(src[i][0].real());
+        dst[i][1] = static_cast<unsigned char>(src[i][1].real());
+        dst[i][2] = static_cast<unsigned char>(src[i][2].real());
+    }
+
+    rgb8 = std::move(narrowed);
+    pixels.clear();
+    realMask = 7;
+    return true;
 }
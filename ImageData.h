@@ -1,21 +1,142 @@
 // Main structure to hold image data
-// Image is stored as complex [height][width][RGB] array
+// Image is stored as complex [height][width][RGB] array,
+// or as 8-bit RGB while every value is still a byte (just loaded, flipped, inverted, ...)
 // Is automatically cast to unsigned char when saving
 
+#pragma once
+
 #include "Commons.h"
 
+#include <atomic>
+#include <cstdint>
 #include <iostream>
 #include <vector>
+#include <memory>
+#include <string>
+
+
+// Source of buffer generations, never reused, unlike the addresses of freed buffers
+inline std::atomic<uint64_t> pixelGenerations{0};
+
+// Contiguous row-major pixel storage, indexed as pixels[y][x][c]
+// Copies share the same pixels (reference counted), detach() gives a private copy before writing
+template <typename Pixel>
+class PixelStore {
+public:
+    void allocate(int w, int h) {
+        width = w;
+        data = std::make_shared<std::vector<Pixel>>(static_cast<size_t>(w) * h, Pixel{});
+        base = data->data();
+        touch();
+    }
+
+    void clear() {
+        width = 0;
+        base = nullptr;
+        data.reset();
+        gen = 0;
+    }
+
+    // Copy the pixels if they are shared with another buffer
+    void detach() {
+        if (!shared()) return;
+        data = std::make_shared<std::vector<Pixel>>(*data);
+        base = data->data();
+        touch();
+    }
+
+    // Generation of the pixels: new for every buffer and after touch(), 0 when empty
+    uint64_t generation() const { return gen; }
+
+    // Mark the pixels as about to change
+    void touch() {
+        if (data) gen = ++pixelGenerations;
+    }
+
+    bool shared() const { return data && data.use_count() > 1; }
+
+    Pixel* operator[](int y) { return base + static_cast<size_t>(y) * width; }
+    const Pixel* operator[](int y) const { return base + static_cast<size_t>(y) * width; }
+
+    Pixel* raw() { return base; }
+    const Pixel* raw() const { return base; }
+
+    // number of pixels
+    size_t size() const { return data ? data->size() : 0; }
+
+    // heap memory held by the buffer (shared buffers are counted by each holder)
+    size_t bytes() const { return data ? data->capacity() * sizeof(Pixel) : 0; }
+
+private:
+    int width = 0;
+    Pixel* base = nullptr;
+    uint64_t gen = 0;
+    std::shared_ptr<std::vector<Pixel>> data;
+};
+
+using PixelBuffer = PixelStore<Triple>;
+using ByteBuffer = PixelStore<RGB8>;
+
+// rows of 8-bit pixels are handled as flat byte arrays
+static_assert(sizeof(RGB8) == 3, "RGB8 must be packed");
+
+
+// Temp file holding the pixels of a spilled image, unlinked on creation and closed on destruction
+struct SpillFile {
+    int fd = -1;
+    size_t bytes = 0;
+    bool packed = false; // file holds the packed blob instead of raw pixels
+    bool rgb8 = false; // file holds 8-bit pixels
+
+    ~SpillFile();
+};
+
 
 struct ImageData {
     int width = 0;
     int height = 0;
-    std::vector<std::vector<std::vector<Complex>>> pixels; // [height][width][RGB]
+    PixelBuffer pixels; // [height][width][RGB]
+    ByteBuffer rgb8; // set instead of pixels while every value is a real integer in [0,255]
     bool isLoaded = false;
+    std::shared_ptr<SpillFile> spilled; // set while the pixels live on disk
+    std::shared_ptr<const std::vector<uint8_t>> packed; // set while the pixels are compressed in RAM
+    int realMask = 0; // bit c set: channel c is known to have a zero imaginary plane
     
     void allocate(int w, int h);
+
+    // Allocate as 8-bit pixels
+    void allocate8(int w, int h);
     
     void clear();
     
-    void printInfo() const;
-};
\ No newline at end of file
+    void printInfo(std::ostream& out = std::cout) const;
+
+    // memory held in RAM by the pixels
+    size_t bytes() const;
+
+    // memory held on disk by a spilled image
+    size_t spilledBytes() const;
+
+    // Move pixels to a memory-mapped temp file in dir and free them
+    bool spill(const std::string& dir);
+
+    // Page spilled pixels back in
+    bool unspill();
+
+    // Replace the pixels by a blob made from them with packPixels
+    void pack(std::shared_ptr<const std::vector<uint8_t>> blob);
+
+    // Decode packed pixels
+    bool unpack();
+
+    // Replace 8-bit pixels by the equal complex pixels
+    void promote();
+
+    // Replace the pixels by 8-bit ones if every value is exactly a byte, returns whether it did
+    bool demote();
+
+    bool is8bit() const { return rgb8.size() != 0; }
+
+    bool isReal(int c) const { return realMask & (1 << c); }
+    bool isReal() const { return realMask == 7; }
+};
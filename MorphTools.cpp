@@ -0,0 +1,142 @@
+#include "MorphTools.h"
+#include "ThreadTools.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+
+
+template <bool dilate, typename T>
+static inline T pick(T a, T b) { return dilate ? std::max(a, b) : std::min(a, b); }
+
+
+// Extremum over windows of k positions along a line of n, every position holding lanes values at line(i)
+// The window of position x is [x - (k - 1) / 2, x + k / 2] for erosion and the reflected one for dilation,
+// so that an opening stays below the image, positions outside the line are the identity
+template <bool dilate, typename T, typename Line>
+static void vanHerk(Line line, int n, int k, int lanes, std::vector<T>& prefix, std::vector<T>& suffix, std::vector<T>& identity) {
+    int before = dilate ? k / 2 : (k - 1) / 2;
+    int padded = (n + 2 * k - 2) / k * k;     // n + k - 1 positions, in whole blocks
+    prefix.resize(static_cast<size_t>(padded) * lanes);
+    suffix.resize(static_cast<size_t>(padded) * lanes);
+    identity.assign(lanes, dilate ? std::numeric_limits<T>::lowest() : std::numeric_limits<T>::max());
+
+    auto source = [&](int i) -> const T* { return i >= before && i < before + n ? line(i - before) : identity.data(); };
+    auto at = [lanes](std::vector<T>& v, int i) { return v.data() + static_cast<size_t>(i) * lanes; };
+
+    for (int start = 0; start < padded; start += k) {
+        std::copy(source(start), source(start) + lanes, at(prefix, start));
+        for (int i = start + 1; i < start + k; i++) {
+            const T* s = source(i);
+            const T* p = at(prefix, i - 1);
+            T* o = at(prefix, i);
+            for (int j = 0; j < lanes; j++) o[j] = pick<dilate>(p[j], s[j]);
+        }
+        int end = start + k - 1;
+        std::copy(source(end), source(end) + lanes, at(suffix, end));
+        for (int i = end - 1; i >= start; i--) {
+            const T* s = source(i);
+            const T* p = at(suffix, i + 1);
+            T* o = at(suffix, i);
+            for (int j = 0; j < lanes; j++) o[j] = pick<dilate>(p[j], s[j]);
+        }
+    }
+
+    // padded window x is [x, x + k - 1]: the suffix of its first block and the prefix of the next
+    for (int x = 0; x < n; x++) {
+        const T* s = at(suffix, x);
+        const T* p = at(prefix, x + k - 1);
+        T* o = line(x);
+        for (int j = 0; j < lanes; j++) o[j] = pick<dilate>(s[j], p[j]);
+    }
+}
+
+
+// Erode or dilate a row-major plane by a width x height rectangle
+template <bool dilate, typename T>
+static void extremum(std::vector<T>& plane, int columns, int rows, int width, int height) {
+    if (width > 1) {
+        parallelBands(rows, bandRows, [&](int first, int last) {
+            std::vector<T> prefix, suffix, identity;
+            for (int y = first; y < last; y++) {
+                T* row = plane.data() + static_cast<size_t>(y) * columns;
+                vanHerk<dilate>([row](int i) { return row + i; }, columns, width, 1, prefix, suffix, identity);
+            }
+        });
+    }
+    if (height > 1) {
+        // bands of columns, each cut into stripes whose rows are the lanes
+        parallelBands(columns, stripeColumns, [&](int first, int last) {
+            std::vector<T> prefix, suffix, identity;
+            for (int x0 = first; x0 < last; x0 += stripeColumns) {
+                T* base = plane.data() + x0;
+                auto line = [base, columns](int i) { return base + static_cast<size_t>(i) * columns; };
+                vanHerk<dilate>(line, rows, height, std::min(stripeColumns, last - x0), prefix, suffix, identity);
+            }
+        });
+    }
+}
+
+
+template <typename T>
+static void morphPlane(std::vector<T>& plane, int columns, int rows, MorphOp op, int width, int height) {
+    switch (op) {
+    case MorphOp::erode:
+        extremum<false>(plane, columns, rows, width, height);
+        break;
+    case MorphOp::dilate:
+        extremum<true>(plane, columns, rows, width, height);
+        break;
+    case MorphOp::open:
+        extremum<false>(plane, columns, rows, width, height);
+        extremum<true>(plane, columns, rows, width, height);
+        break;
+    case MorphOp::close:
+        extremum<true>(plane, columns, rows, width, height);
+        extremum<false>(plane, columns, rows, width, height);
+        break;
+    case MorphOp::tophat: {
+        std::vector<T> opened = plane;
+        extremum<false>(opened, columns, rows, width, height);
+        extremum<true>(opened, columns, rows, width, height);
+        for (size_t i = 0; i < plane.size(); i++) plane[i] -= opened[i];
+        break;
+    }
+    }
+}
+
+
+void morphology(ImageData& img, const struct frame& f, MorphOp op, int width, int height) {
+    size_t size = static_cast<size_t>(f.x_size) * f.y_size;
+    width = std::min(width, 2 * f.x_size);
+    height = std::min(height, 2 * f.y_size);
+
+    // 8-bit slots stay bytes, the opening is below the image so the top-hat is a byte too
+    if (img.is8bit()) {
+        std::vector<uint8_t> plane(size);
+        for (int c = 0; c < 3; c++) {
+            for (int y = 0; y < f.y_size; y++) {
+                for (int x = 0; x < f.x_size; x++) plane[static_cast<size_t>(y) * f.x_size + x] = img.rgb8[f.y + y][f.x + x][c];
+            }
+            morphPlane(plane, f.x_size, f.y_size, op, width, height);
+            for (int y = 0; y < f.y_size; y++) {
+                for (int x = 0; x < f.x_size; x++) img.rgb8[f.y + y][f.x + x][c] = plane[static_cast<size_t>(y) * f.x_size + x];
+            }
+        }
+        return;
+    }
+
+    std::vector<double> plane(size);
+    for (int c = 0; c < 3; c++) {
+        for (int y = 0; y < f.y_size; y++) {
+            for (int x = 0; x < f.x_size; x++) plane[static_cast<size_t>(y) * f.x_size + x] = img.pixels[f.y + y][f.x + x][c].real();
+        }
+        morphPlane(plane, f.x_size, f.y_size, op, width, height);
+        for (int y = 0; y < f.y_size; y++) {
+            for (int x = 0; x < f.x_size; x++) img.pixels[f.y + y][f.x + x][c] = Complex(plane[static_cast<size_t>(y) * f.x_size + x], 0);
+        }
+    }
+    img.realMask = 7;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "Commons.h"
+#include "ImageData.h"
+
+// Morphology tools
+// Grayscale erosion and dilation by a width x height rectangle, done as a pass along rows then one
+// along columns with the van Herk - Gil-Werman algorithm: the line is cut into blocks of the window
+// length, prefix and suffix extrema inside every block give any window as the extremum of one suffix
+// and one prefix, so each pass costs 3 comparisons per pixel for any window size
+// The column pass handles a stripe of columns at once, its inner loops run along a row and vectorize
+// Rows, then stripes of columns, are split into bands filtered in parallel
+// Windows are clipped to the frame, so pixels outside it are never seen
+
+
+enum class MorphOp { erode, dilate, open, close, tophat };
+
+// Apply op with a width x height rectangle centered on each pixel to every channel of the frame, the
+// extra pixel of an even size is on the right or below for erosion, on the left or above for dilation
+// erode: minimum, dilate: maximum, open: dilate of erode, close: erode of dilate, tophat: image - open
+// 8-bit slots are worked on as bytes, other channels by their real part, imaginary parts are dropped
+void morphology(ImageData& img, const struct frame& f, MorphOp op, int width, int height);
@@ -0,0 +1,173 @@
+#include "NoiseTools.h"
+#include "RandTools.h"
+
+#include <cmath>
+
+
+static inline uint64_t rotl(uint64_t v, int k) {
+    return (v << k) | (v >> (64 - k));
+}
+
+// Double in [0, 1) from the top 53 bits of a word
+static inline double unit(uint64_t w) {
+    return static_cast<double>(w >> 11) * 0x1.0p-53;
+}
+
+
+// Marsaglia and Tsang's ziggurat: 128 layers of equal area under the normal density
+// A word picks a layer with its low bits and a signed position with its high half,
+// which is inside the layer's rectangle about 99% of the time
+struct Ziggurat {
+    double k[128];                          // largest |position| inside the rectangle of each layer
+    double w[128];                          // position to value
+    double f[128];                          // density at the edge of each layer
+
+    Ziggurat() {
+        const double m = 2147483648.0;
+        double d = 3.442619855899;
+        double t = d;
+        const double v = 9.91256303526217e-3;
+        double q = v / std::exp(-0.5 * d * d);
+
+        k[0] = (d / q) * m;
+        k[1] = 0;
+        w[0] = q / m;
+        w[127] = d / m;
+        f[0] = 1.0;
+        f[127] = std::exp(-0.5 * d * d);
+        for (int i = 126; i >= 1; i--) {
+            d = std::sqrt(-2.0 * std::log(v / d + std::exp(-0.5 * d * d)));
+            k[i + 1] = (d / t) * m;
+            t = d;
+            f[i] = std::exp(-0.5 * d * d);
+            w[i] = d / m;
+        }
+    }
+};
+
+// Standard normal value from a word, the rare misses draw more words from extra
+static double normal(uint64_t word, RandStream& extra) {
+    static const Ziggurat z;
+    const double r = 3.442619855899;
+
+    for (;;) {
+        int layer = static_cast<int>(word & 127);
+        int32_t position = static_cast<int32_t>(word >> 32);
+        double x = position * z.w[layer];
+        if (std::fabs(static_cast<double>(position)) < z.k[layer]) return x;
+
+        // base layer: the tail beyond r
+        if (layer == 0) {
+            double tx, ty;
+            do {
+                uint32_t a = extra();
+                uint32_t b = extra();
+                uint32_t c = extra();
+                uint32_t d = extra();
+                tx = -std::log(1.0 - randUnit(a, b)) / r;
+                ty = -std::log(1.0 - randUnit(c, d));
+            } while (ty + ty < tx * tx);
+            return position > 0 ? r + tx : -r - tx;
+        }
+
+        // wedge between the rectangle and the density, draws are named so their order is fixed
+        uint32_t a = extra();
+        uint32_t b = extra();
+        if (z.f[layer] + randUnit(a, b) * (z.f[layer - 1] - z.f[layer]) < std::exp(-0.5 * x * x)) return x;
+
+        uint32_t high = extra();
+        uint32_t low = extra();
+        word = (static_cast<uint64_t>(high) << 32) | low;
+    }
+}
+
+
+NoiseSource::NoiseSource(NoiseType type, double amount, uint64_t seed) : type(type), amount(amount), seed(seed) {}
+
+
+void NoiseSource::fill(int b, int y) {
+    block = b;
+    row = y;
+
+    // state word k of lane l is s[k][l], so every step is a loop over the lanes the compiler can vectorize
+    // each lane is seeded from its own Philox streams, one set per noise type
+    uint64_t s[4][4];
+    for (int l = 0; l < 4; l++) {
+        uint64_t stream = 8 * static_cast<uint64_t>(type) + 2 * l;
+        RandBlock lo = philox(seed, randCounter(b, y), stream);
+        RandBlock hi = philox(seed, randCounter(b, y), stream + 1);
+        s[0][l] = (static_cast<uint64_t>(lo[1]) << 32) | lo[0];
+        s[1][l] = (static_cast<uint64_t>(lo[3]) << 32) | lo[2];
+        s[2][l] = (static_cast<uint64_t>(hi[1]) << 32) | hi[0];
+        s[3][l] = (static_cast<uint64_t>(hi[3]) << 32) | hi[2];
+        if ((s[0][l] | s[1][l] | s[2][l] | s[3][l]) == 0) s[0][l] = 1;
+    }
+
+    // xoshiro256++, step t gives the four words of pixel t
+    uint64_t words[noiseBlock][4];
+    for (int t = 0; t < noiseBlock; t++) {
+        for (int l = 0; l < 4; l++) {
+            words[t][l] = rotl(s[0][l] + s[3][l], 23) + s[0][l];
+            uint64_t shifted = s[1][l] << 17;
+            s[2][l] ^= s[0][l];
+            s[3][l] ^= s[1][l];
+            s[1][l] ^= s[2][l];
+            s[0][l] ^= s[3][l];
+            s[2][l] ^= shifted;
+            s[3][l] = rotl(s[3][l], 45);
+        }
+    }
+
+    switch (type) {
+    case NoiseType::gauss: {
+        // ziggurat misses of the block draw from a stream of its own
+        RandStream extra(~seed, randCounter(b, y));
+        for (int t = 0; t < noiseBlock; t++) {
+            for (int c = 0; c < 3; c++) values[t][c] = amount * normal(words[t][c], extra);
+        }
+        break;
+    }
+    case NoiseType::uniform:
+        for (int t = 0; t < noiseBlock; t++) {
+            for (int c = 0; c < 3; c++) values[t][c] = amount * (2.0 * unit(words[t][c]) - 1.0);
+        }
+        break;
+    case NoiseType::salt:
+        // -1 leaves the pixel alone
+        for (int t = 0; t < noiseBlock; t++) {
+            bool hit = 100.0 * unit(words[t][0]) < amount;
+            values[t][0] = !hit ? -1.0 : (words[t][1] >> 63) ? 255.0 : 0.0;
+        }
+        break;
+    case NoiseType::phase:
+        for (int t = 0; t < noiseBlock; t++) {
+            for (int c = 0; c < 3; c++) values[t][c] = amount * M_PI / 180.0 * (2.0 * unit(words[t][c]) - 1.0);
+        }
+        break;
+    }
+}
+
+
+void NoiseSource::operator()(Triple& a, int x, int y) {
+    int b = x / noiseBlock;
+    if (b != block || y != row) fill(b, y);
+    const double* v = values[x % noiseBlock];
+
+    switch (type) {
+    case NoiseType::gauss:
+    case NoiseType::uniform:
+        a[0] += v[0];
+        a[1] += v[1];
+        a[2] += v[2];
+        break;
+    case NoiseType::salt:
+        if (v[0] < 0) break;
+        a[0] = a[1] = a[2] = Complex(v[0], 0);
+        break;
+    case NoiseType::phase:
+        a[0] *= std::polar(1.0, v[0]);
+        a[1] *= std::polar(1.0, v[1]);
+        a[2] *= std::polar(1.0, v[2]);
+        break;
+    }
+}
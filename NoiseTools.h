@@ -0,0 +1,40 @@
+#pragma once
+
+#include "Commons.h"
+
+#include <cstdint>
+#include <string>
+
+// Noise tools
+// Pixels are grouped in blocks of noiseBlock along a row, every block seeds four xoshiro256++ lanes
+// from Philox(seed, block position) and fills the noise of all its pixels in one pass over the lanes
+// The noise of a pixel is then a function of the seed and its position only, not of the call order
+
+
+enum class NoiseType { gauss, uniform, salt, phase };
+
+constexpr int noiseBlock = 64;
+
+class NoiseSource {
+public:
+    // gauss: add a normal value of standard deviation amount to each channel
+    // uniform: add a value in [-amount, amount] to each channel
+    // salt: set amount percent of the pixels to black or white
+    // phase: turn each channel by an angle in [-amount, amount] degrees
+    NoiseSource(NoiseType type, double amount, uint64_t seed);
+
+    // Add the noise of position (x, y) to a
+    void operator()(Triple& a, int x, int y);
+
+    static RealEffect effect(NoiseType type) { return type == NoiseType::phase ? RealEffect::complex : RealEffect::keep; }
+
+private:
+    void fill(int block, int y);
+
+    NoiseType type;
+    double amount;
+    uint64_t seed;
+    int block = -1;
+    int row = -1;
+    double values[noiseBlock][3];           // per pixel of the current block: deltas, angles or the salt value
+};
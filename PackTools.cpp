@@ -0,0 +1,196 @@
+#include "PackTools.h"
+#include "Utils.h"
+
+#include <algorithm>
+#include <cstring>
+
+
+
+
+// Bit pattern of one value of a pixel at the given storage width in bytes (8, 4 or 2)
+// plane p = 2 * channel + (imaginary ? 1 : 0)
+static uint64_t planeBits(const Triple& px, int p, int width) {
+    double v = (p & 1) ? px[p >> 1].imag() : px[p >> 1].real();
+
+    // saturate like round_to_precision, so a packed slot reads back as the resident one would be rounded
+    if (width == 2) return float_to_half(static_cast<float>(std::clamp(v, -65504.0, 65504.0)));
+    if (width == 4) {
+        float f = static_cast<float>(v);
+        uint32_t bits;
+        std::memcpy(&bits, &f, sizeof(bits));
+        return bits;
+    }
+    uint64_t bits;
+    std::memcpy(&bits, &v, sizeof(bits));
+    return bits;
+}
+
+static void setPlaneBits(Triple& px, int p, int width, uint64_t bits) {
+    double v;
+    if (width == 2) {
+        v = half_to_float(static_cast<uint16_t>(bits));
+    } else if (width == 4) {
+        uint32_t b = static_cast<uint32_t>(bits);
+        float f;
+        std::memcpy(&f, &b, sizeof(f));
+        v = f;
+    } else {
+        std::memcpy(&v, &bits, sizeof(v));
+    }
+    if (p & 1) px[p >> 1].imag(v);
+    else px[p >> 1].real(v);
+}
+
+
+static void putVarint(std::vector<uint8_t>& out, size_t v) {
+    while (v >= 0x80) {
+        out.push_back(static_cast<uint8_t>(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(v));
+}
+
+static bool getVarint(const std::vector<uint8_t>& in, size_t& pos, size_t& v) {
+    v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (pos >= in.size()) return false;
+        uint8_t b = in[pos++];
+        v |= static_cast<size_t>(b & 0x7F) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+
+// Byte plane as a sequence of (zero run, literal count, literals)
+// Literals only end at a run of two or more zeros, so isolated zeros do not split them
+static void rleZeros(const uint8_t* plane, size_t n, std::vector<uint8_t>& out) {
+    size_t i = 0;
+    while (i < n) {
+        size_t zeros = 0;
+        while (i + zeros < n && plane[i + zeros] == 0) zeros++;
+        i += zeros;
+
+        size_t lit = 0;
+        while (i + lit < n) {
+            if (plane[i + lit] == 0 && (i + lit + 1 >= n || plane[i + lit + 1] == 0)) break;
+            lit++;
+        }
+
+        putVarint(out, zeros);
+        putVarint(out, lit);
+        out.insert(out.end(), plane + i, plane + i + lit);
+        i += lit;
+    }
+}
+
+static bool unRleZeros(const std::vector<uint8_t>& in, size_t& pos, uint8_t* plane, size_t n) {
+    size_t i = 0;
+    while (i < n) {
+        size_t zeros, lit;
+        if (!getVarint(in, pos, zeros) || !getVarint(in, pos, lit)) return false;
+        if (zeros > n - i || lit > n - i - zeros || lit > in.size() - pos) return false;
+
+        std::memset(plane + i, 0, zeros);
+        i += zeros;
+        std::memcpy(plane + i, in.data() + pos, lit);
+        i += lit;
+        pos += lit;
+    }
+    return true;
+}
+
+
+std::vector<uint8_t> packPixels(const Triple* pixels, size_t n, Precision precision, int realMask, const std::atomic<bool>* cancel) {
+    int width = precision_bytes(precision);
+
+    // the mask is only a hint, a plane is dropped if it is all +0.0 so packing stays bit exact
+    for (int c = 0; c < 3; c++) {
+        if (!(realMask & (1 << c))) continue;
+        for (size_t i = 0; i < n; i++) {
+            if (planeBits(pixels[i], 2 * c + 1, 8) != 0) {
+                realMask &= ~(1 << c);
+                break;
+            }
+        }
+    }
+
+    std::vector<uint8_t> out = {static_cast<uint8_t>(width), static_cast<uint8_t>(realMask)};
+    std::vector<uint8_t> bytePlane(n);
+    std::vector<uint64_t> delta(n);
+
+    for (int p = 0; p < 6; p++) {
+        // real channel, only the real plane is kept
+        if ((p & 1) && (realMask & (1 << (p >> 1)))) continue;
+
+        uint64_t prev = 0;
+        for (size_t i = 0; i < n; i++) {
+            uint64_t bits = planeBits(pixels[i], p, width);
+            delta[i] = bits ^ prev;
+            prev = bits;
+        }
+
+        for (int k = 0; k < width; k++) {
+            if (cancel && cancel->load(std::memory_order_relaxed)) return {};
+
+            for (size_t i = 0; i < n; i++) {
+                bytePlane[i] = static_cast<uint8_t>(delta[i] >> (8 * k));
+            }
+            rleZeros(bytePlane.data(), n, out);
+        }
+    }
+
+    out.shrink_to_fit();
+    return out;
+}
+
+bool unpackPixels(const std::vector<uint8_t>& blob, Triple* pixels, size_t n) {
+    if (blob.size() < 2) return false;
+    int width = blob[0];
+    int realMask = blob[1];
+    if (width != 8 && width != 4 && width != 2) return false;
+
+    size_t pos = 2;
+    std::vector<uint8_t> bytePlane(n);
+    std::vector<uint64_t> delta(n);
+
+    for (int p = 0; p < 6; p++) {
+        std::fill(delta.begin(), delta.end(), 0);
+
+        if ((p & 1) && (realMask & (1 << (p >> 1)))) {
+            for (size_t i = 0; i < n; i++) {
+                setPlaneBits(pixels[i], p, width, 0);
+            }
+            continue;
+        }
+
+        for (int k = 0; k < width; k++) {
+            if (!unRleZeros(blob, pos, bytePlane.data(), n)) return false;
+            for (size_t i = 0; i < n; i++) {
+                delta[i] |= static_cast<uint64_t>(bytePlane[i]) << (8 * k);
+            }
+        }
+
+        uint64_t prev = 0;
+        for (size_t i = 0; i < n; i++) {
+            prev ^= delta[i];
+            setPlaneBits(pixels[i], p, width, prev);
+        }
+    }
+    return pos == blob.size();
+}
+
+
+std::shared_ptr<PackJob> startPack(ThreadPool& pool, const PixelBuffer& pixels, Precision precision, int realMask) {
+    std::shared_ptr<PackJob> job = std::make_shared<PackJob>();
+    job->source = pixels;
+    job->precision = precision;
+    job->realMask = realMask;
+    std::weak_ptr<PackJob> weak = job;
+    job->done = pool.submit([weak] {
+        std::shared_ptr<PackJob> held = weak.lock();
+        if (!held) return;
+        *held->blob = packPixels(held->source.raw(), held->source.size(), held->precision, held->realMask, &held->cancel);
+    });
+    return job;
+}
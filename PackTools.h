@@ -0,0 +1,43 @@
+#pragma once
+
+#include "Commons.h"
+#include "ImageData.h"
+#include "ThreadTools.h"
+
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <vector>
+
+// Pack tools
+// Lossless in-memory compression of pixel data
+
+
+// Each of the 6 planes (RGB real / imaginary) is stored at the given precision,
+// xor-delta coded against the previous pixel, split into byte planes and run-length coded,
+// so flat or zeroed areas take almost no space
+// Imaginary planes of the channels in realMask are known to be zero and are not stored
+// Lossless for values already rounded to precision
+// Returns an empty blob if cancel is raised while packing
+std::vector<uint8_t> packPixels(const Triple* pixels, size_t n, Precision precision = Precision::f64, int realMask = 0,
+                                const std::atomic<bool>* cancel = nullptr);
+
+// Decode a blob made by packPixels into n pixels, false if the blob is malformed
+bool unpackPixels(const std::vector<uint8_t>& blob, Triple* pixels, size_t n);
+
+
+// Pixels being compressed in the background, source shares the slot's buffer until the job is dropped
+struct PackJob {
+    PixelBuffer source;
+    Precision precision = Precision::f64;
+    int realMask = 0;
+    std::shared_ptr<std::vector<uint8_t>> blob = std::make_shared<std::vector<uint8_t>>();
+    std::atomic<bool> cancel{false};
+    std::shared_future<void> done;
+};
+
+// Queue the packing of pixels on pool
+// The queued task only holds the job weakly: done keeps the task alive, so a strong reference would keep
+// the job, and with it the source pixels, alive forever
+std::shared_ptr<PackJob> startPack(ThreadPool& pool, const PixelBuffer& pixels, Precision precision, int realMask);
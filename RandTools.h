@@ -0,0 +1,73 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+// Random tools
+// Philox4x32-10 is a counter-based generator: four random words are a pure function of a key
+// (the seed) and a 128-bit counter (a position and a stream), there is no state to advance
+// Any pixel, block or frame corner can draw its own numbers, in any order and on any thread,
+// and gets the same bits
+
+
+using RandBlock = std::array<uint32_t, 4>;
+
+inline RandBlock philox(uint64_t key, uint64_t counter, uint64_t stream = 0) {
+    uint32_t k0 = static_cast<uint32_t>(key);
+    uint32_t k1 = static_cast<uint32_t>(key >> 32);
+    uint32_t c0 = static_cast<uint32_t>(counter);
+    uint32_t c1 = static_cast<uint32_t>(counter >> 32);
+    uint32_t c2 = static_cast<uint32_t>(stream);
+    uint32_t c3 = static_cast<uint32_t>(stream >> 32);
+
+    for (int round = 0; round < 10; round++) {
+        uint64_t p0 = static_cast<uint64_t>(0xD2511F53u) * c0;
+        uint64_t p1 = static_cast<uint64_t>(0xCD9E8D57u) * c2;
+        c0 = static_cast<uint32_t>(p1 >> 32) ^ c1 ^ k0;
+        c1 = static_cast<uint32_t>(p1);
+        c2 = static_cast<uint32_t>(p0 >> 32) ^ c3 ^ k1;
+        c3 = static_cast<uint32_t>(p0);
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+    }
+    return {c0, c1, c2, c3};
+}
+
+// Counter of a position
+inline uint64_t randCounter(int x, int y) {
+    return (static_cast<uint64_t>(static_cast<uint32_t>(y)) << 32) | static_cast<uint32_t>(x);
+}
+
+
+// Integer in [low, high] from one word, by multiply and shift instead of a rejection loop
+inline int randInt(uint32_t r, int low, int high) {
+    uint64_t range = static_cast<uint64_t>(static_cast<int64_t>(high) - low + 1);
+    return low + static_cast<int>((r * range) >> 32);
+}
+
+// Double in [0, 1) with 53 random bits from two words
+inline double randUnit(uint32_t a, uint32_t b) {
+    uint64_t bits = (static_cast<uint64_t>(a) << 21) | (b >> 11);
+    return static_cast<double>(bits) * 0x1.0p-53;
+}
+
+
+// Sequential view of one stream of a key, for code that wants numbers one after another
+// the i-th block is philox(key, i, stream), so two streams never overlap
+struct RandStream {
+    uint64_t key = 0;
+    uint64_t stream = 0;
+    uint64_t index = 0;
+    RandBlock block{};
+    int used = 4;
+
+    RandStream(uint64_t key, uint64_t stream = 0) : key(key), stream(stream) {}
+
+    uint32_t operator()() {
+        if (used == 4) {
+            block = philox(key, index++, stream);
+            used = 0;
+        }
+        return block[used++];
+    }
+};
@@ -0,0 +1,143 @@
+#include "RankTools.h"
+#include "ThreadTools.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+
+
+// Filter columns [x0, x1) of a byte plane, out receives the value of rank (0 based) of each window
+static void rankStripe(const uint8_t* in, uint8_t* out, int width, int height, int radius, int rank, int x0, int x1) {
+    int window = 2 * radius + 1;
+    int columns = x1 - x0 + 2 * radius;       // local column c is image column x0 - radius + c
+
+    std::vector<int> source(columns);
+    for (int c = 0; c < columns; c++) source[c] = std::clamp(x0 - radius + c, 0, width - 1);
+
+    std::vector<uint16_t> fine(static_cast<size_t>(columns) * 256, 0);
+    std::vector<uint16_t> coarse(static_cast<size_t>(columns) * 16, 0);
+    auto update = [&](int y, int delta) {
+        const uint8_t* row = in + static_cast<size_t>(std::clamp(y, 0, height - 1)) * width;
+        for (int c = 0; c < columns; c++) {
+            uint8_t v = row[source[c]];
+            fine[static_cast<size_t>(c) * 256 + v] += delta;
+            coarse[static_cast<size_t>(c) * 16 + (v >> 4)] += delta;
+        }
+    };
+    for (int y = -radius; y <= radius; y++) update(y, 1);
+
+    uint32_t kernelCoarse[16];
+    uint32_t kernelFine[256];
+    int upTo[16];                             // fine segment k holds the columns before upTo[k]
+
+    for (int y = 0; y < height; y++) {
+        if (y > 0) {
+            update(y - radius - 1, -1);
+            update(y + radius, 1);
+        }
+
+        std::fill(kernelCoarse, kernelCoarse + 16, 0);
+        for (int c = 0; c < window - 1; c++) {
+            for (int k = 0; k < 16; k++) kernelCoarse[k] += coarse[static_cast<size_t>(c) * 16 + k];
+        }
+        std::fill(upTo, upTo + 16, 0);
+
+        uint8_t* o = out + static_cast<size_t>(y) * width + x0;
+        for (int x = 0; x < x1 - x0; x++) {
+            // window is local columns [x, x + window)
+            const uint16_t* add = coarse.data() + static_cast<size_t>(x + window - 1) * 16;
+            for (int k = 0; k < 16; k++) kernelCoarse[k] += add[k];
+
+            int k = 0;
+            int below = 0;
+            while (below + static_cast<int>(kernelCoarse[k]) <= rank) below += kernelCoarse[k++];
+
+            uint32_t* segment = kernelFine + 16 * k;
+            if (upTo[k] <= x) {
+                std::fill(segment, segment + 16, 0);
+                for (int c = x; c < x + window; c++) {
+                    const uint16_t* f = fine.data() + static_cast<size_t>(c) * 256 + 16 * k;
+                    for (int b = 0; b < 16; b++) segment[b] += f[b];
+                }
+            } else {
+                for (int c = upTo[k]; c < x + window; c++) {
+                    const uint16_t* f = fine.data() + static_cast<size_t>(c) * 256 + 16 * k;
+                    const uint16_t* g = fine.data() + static_cast<size_t>(c - window) * 256 + 16 * k;
+                    for (int b = 0; b < 16; b++) segment[b] += f[b] - g[b];
+                }
+            }
+            upTo[k] = x + window;
+
+            int b = 0;
+            while (below + static_cast<int>(segment[b]) <= rank) below += segment[b++];
+            o[x] = static_cast<uint8_t>(16 * k + b);
+
+            const uint16_t* remove = coarse.data() + static_cast<size_t>(x) * 16;
+            for (int j = 0; j < 16; j++) kernelCoarse[j] -= remove[j];
+        }
+    }
+}
+
+
+bool rankFilter(ImageData& img, int radius, double percent, int levels) {
+    int width = img.width;
+    int height = img.height;
+    size_t size = static_cast<size_t>(width) * height;
+    long long window = 2LL * radius + 1;
+    int rank = static_cast<int>(std::lround(std::clamp(percent, 0.0, 100.0) / 100 * (window * window - 1)));
+    levels = std::clamp(levels, 2, 256);
+    bool exact = true;
+
+    std::vector<uint8_t> in(size), out(size);
+    for (int c = 0; c < 3; c++) {
+        double low = 0, step = 1;
+        if (img.is8bit()) {
+            for (int y = 0; y < height; y++) {
+                for (int x = 0; x < width; x++) in[static_cast<size_t>(y) * width + x] = img.rgb8[y][x][c];
+            }
+        } else {
+            // integers in [0, 255] are their own level, anything else is spread over levels steps
+            low = img.pixels[0][0][c].real();
+            double high = low;
+            bool bytes = levels == 256;
+            for (int y = 0; y < height; y++) {
+                for (int x = 0; x < width; x++) {
+                    double v = img.pixels[y][x][c].real();
+                    low = std::min(low, v);
+                    high = std::max(high, v);
+                    bytes = bytes && v >= 0 && v <= 255 && v == std::floor(v);
+                }
+            }
+            if (bytes) low = 0;
+            else if (high > low) step = (high - low) / (levels - 1);
+            exact = exact && (bytes || high == low);
+            for (int y = 0; y < height; y++) {
+                for (int x = 0; x < width; x++) {
+                    double q = std::round((img.pixels[y][x][c].real() - low) / step);
+                    in[static_cast<size_t>(y) * width + x] = static_cast<uint8_t>(std::clamp(q, 0.0, levels - 1.0));
+                }
+            }
+        }
+
+        // bands of columns: each thread filters its stripes top to bottom
+        parallelBands(width, stripeColumns, [&](int first, int last) {
+            for (int x0 = first; x0 < last; x0 += stripeColumns) {
+                rankStripe(in.data(), out.data(), width, height, radius, rank, x0, std::min(x0 + stripeColumns, last));
+            }
+        });
+
+        if (img.is8bit()) {
+            for (int y = 0; y < height; y++) {
+                for (int x = 0; x < width; x++) img.rgb8[y][x][c] = out[static_cast<size_t>(y) * width + x];
+            }
+        } else {
+            for (int y = 0; y < height; y++) {
+                for (int x = 0; x < width; x++) img.pixels[y][x][c] = Complex(low + step * out[static_cast<size_t>(y) * width + x], 0);
+            }
+        }
+    }
+    if (!img.is8bit()) img.realMask = 7;
+    return exact;
+}
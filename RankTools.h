@@ -0,0 +1,21 @@
+#pragma once
+
+#include "Commons.h"
+#include "ImageData.h"
+
+// Rank tools
+// Median and percentile filters over a square window by Perreault - Hebert histogram sliding: every
+// column keeps a 256 bin histogram of its window rows, moving down a row adds and removes one value per
+// column and moving right adds and removes one column, so the cost per pixel does not depend on the radius
+// The kernel histogram is split into 16 coarse bins and 16 fine segments, a fine segment is only brought
+// up to date when the rank falls in it
+// The image is cut into vertical stripes filtered in parallel, values beyond the edges repeat them
+
+
+// Replace every channel by the value of rank percent (0 minimum, 50 median, 100 maximum) in the
+// (2 radius + 1)^2 window around each pixel
+// 8-bit slots are filtered as bytes, other channels by their real part only, imaginary parts are dropped:
+// a channel of integers in [0, 255] is filtered exactly when levels is 256, any other channel is quantized
+// to levels (2 to 256) evenly spaced values over its [min, max] range and comes back as those values
+// False if some channel was quantized
+bool rankFilter(ImageData& img, int radius, double percent, int levels = 256);
@@ -0,0 +1,455 @@
+#include "ScriptTools.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <sstream>
+
+
+
+
+namespace {
+
+enum class TokenKind { word, end, open, close };
+
+struct Token {
+    TokenKind kind;
+    std::string text;
+    int line;
+};
+
+// Split into words, statement ends (newline, ';') and block braces, '#' comments are dropped
+// ${name} stays inside its word
+std::vector<Token> tokenize(const std::string& text) {
+    std::vector<Token> tokens;
+    std::string word;
+    int line = 1;
+
+    auto flush = [&] {
+        if (!word.empty()) tokens.push_back({TokenKind::word, word, line});
+        word.clear();
+    };
+
+    for (size_t i = 0; i < text.size(); i++) {
+        char c = text[i];
+        if (c == '#') {
+            while (i + 1 < text.size() && text[i + 1] != '\n') i++;
+        } else if (c == '$' && i + 1 < text.size() && text[i + 1] == '{') {
+            size_t close = text.find('}', i);
+            if (close == std::string::npos) close = text.size() - 1;
+            word += text.substr(i, close - i + 1);
+            i = close;
+        } else if (c == '\n' || c == ';') {
+            flush();
+            tokens.push_back({TokenKind::end, "", line});
+            if (c == '\n') line++;
+        } else if (c == '{' || c == '}') {
+            flush();
+            tokens.push_back({c == '{' ? TokenKind::open : TokenKind::close, std::string(1, c), line});
+        } else if (std::isspace((unsigned char) c)) {
+            flush();
+        } else {
+            word += c;
+        }
+    }
+    flush();
+    tokens.push_back({TokenKind::end, "", line});
+    return tokens;
+}
+
+bool isIdentifier(const std::string& s) {
+    if (s.empty() || std::isdigit((unsigned char) s[0])) return false;
+    for (char c : s) {
+        if (!std::isalnum((unsigned char) c) && c != '_') return false;
+    }
+    return true;
+}
+
+// Whole string is an integer
+std::optional<long long> toCount(const std::string& s) {
+    if (s.empty()) return std::nullopt;
+    char* end = nullptr;
+    errno = 0;
+    long long value = std::strtoll(s.c_str(), &end, 10);
+    if (*end != '\0' || errno != 0) return std::nullopt;
+    return value;
+}
+
+// Whole string is a finite number
+std::optional<double> toNumber(const std::string& s) {
+    if (s.empty()) return std::nullopt;
+    char* end = nullptr;
+    double value = std::strtod(s.c_str(), &end);
+    if (*end != '\0' || !std::isfinite(value)) return std::nullopt;
+    return value;
+}
+
+// Sweeps longer than this are most likely a typo
+const long long maxSweep = 1000000;
+
+
+class Compiler {
+public:
+    Compiler(const std::string& text, const std::string& source, const CommandLookup& lookup, Program& program,
+             std::ostream& err, bool fuse)
+        : tokens(tokenize(text)), source(source), lookup(lookup), program(program), err(err), fuse(fuse) {}
+
+    // Compile statements up to the '}' closing this block (or the end of the script at depth 0)
+    bool compileBlock(int depth) {
+        while (true) {
+            std::vector<std::string> words;
+            int line = tokens[pos].line;
+            while (tokens[pos].kind == TokenKind::word) {
+                words.push_back(tokens[pos++].text);
+            }
+            const Token& terminator = tokens[pos];
+
+            if (!words.empty() && (words[0] == "repeat" || words[0] == "for")) {
+                if (terminator.kind != TokenKind::open) return fail(line, "'" + words[0] + "' needs a { block }");
+                pos++;
+
+                int loop = (int) program.code.size();
+                if (!compileLoop(words, line)) return false;
+                if (!compileBlock(depth + 1)) return false;
+
+                Instruction end;
+                end.op = Instruction::Op::end;
+                end.name = "}";
+                end.line = line;
+                end.jump = loop;
+                program.code.push_back(std::move(end));
+                program.code[loop].jump = (int) program.code.size();
+                continue;
+            }
+
+            if (terminator.kind == TokenKind::open) return fail(terminator.line, "'{' can only follow repeat or for");
+            if (!words.empty() && !compileStatement(words, line)) return false;
+
+            if (pos + 1 == tokens.size()) {
+                if (depth > 0) return fail(terminator.line, "missing '}'");
+                return true;
+            }
+            pos++;
+            if (terminator.kind == TokenKind::close) {
+                if (depth == 0) return fail(terminator.line, "unmatched '}'");
+                return true;
+            }
+        }
+    }
+
+private:
+    std::vector<Token> tokens;
+    size_t pos = 0;
+    std::string source;
+    const CommandLookup& lookup;
+    Program& program;
+    std::ostream& err;
+    bool fuse;
+
+    bool fail(int line, const std::string& message) {
+        err << source << ":" << line << ": " << message << std::endl;
+        return false;
+    }
+
+    int variable(const std::string& name, bool define) {
+        for (int i = 0; i < (int) program.variables.size(); i++) {
+            if (program.variables[i] == name) return i;
+        }
+        if (!define) return -1;
+        program.variables.push_back(name);
+        return (int) program.variables.size() - 1;
+    }
+
+    // Split a word into literal text and variables, false if a variable was never defined
+    bool parseWord(const std::string& word, int line, std::vector<WordPiece>& pieces) {
+        std::string text;
+        for (size_t i = 0; i < word.size(); i++) {
+            if (word[i] != '$') {
+                text += word[i];
+                continue;
+            }
+
+            std::string name;
+            if (i + 1 < word.size() && word[i + 1] == '{') {
+                size_t close = word.find('}', i);
+                if (close == std::string::npos) return fail(line, "missing '}' in " + word);
+                name = word.substr(i + 2, close - i - 2);
+                i = close;
+            } else {
+                while (i + 1 < word.size() && (std::isalnum((unsigned char) word[i + 1]) || word[i + 1] == '_')) {
+                    name += word[++i];
+                }
+                if (name.empty()) {
+                    text += '$';
+                    continue;
+                }
+            }
+
+            int var = variable(name, false);
+            if (var < 0) return fail(line, "undefined variable " + name);
+            if (!text.empty()) pieces.push_back({text, -1});
+            text.clear();
+            pieces.push_back({"", var});
+        }
+        if (!text.empty() || pieces.empty()) pieces.push_back({text, -1});
+        return true;
+    }
+
+    // Fill args, words holding variables get a template
+    bool setArgs(Instruction& instr, const std::vector<std::string>& words, size_t first, int line) {
+        for (size_t i = first; i < words.size(); i++) {
+            std::vector<WordPiece> pieces;
+            if (!parseWord(words[i], line, pieces)) return false;
+
+            if (pieces.size() == 1 && pieces[0].var < 0) {
+                instr.args.push_back(pieces[0].text);
+            } else {
+                instr.dynamic.push_back({(int) instr.args.size(), std::move(pieces)});
+                instr.args.emplace_back();
+            }
+        }
+        return true;
+    }
+
+    bool isDynamic(const Instruction& instr, int index) {
+        for (const WordTemplate& word : instr.dynamic) {
+            if (word.index == index) return true;
+        }
+        return false;
+    }
+
+    bool compileStatement(const std::vector<std::string>& words, int line) {
+        Instruction instr;
+        instr.name = words[0];
+        instr.line = line;
+
+        if (words[0] == "set") {
+            if (words.size() != 3 || !isIdentifier(words[1])) return fail(line, "usage: set <name> <value>");
+            instr.op = Instruction::Op::set;
+            if (!setArgs(instr, words, 2, line)) return false;
+            instr.var = variable(words[1], true);
+            program.code.push_back(std::move(instr));
+            return true;
+        }
+
+        std::optional<CommandInfo> info = lookup(words[0]);
+        if (!info) return fail(line, "unknown command " + words[0]);
+        instr.op = Instruction::Op::call;
+        instr.handler = std::move(info->handler);
+        instr.fusable = info->fusable || words[0] == "pipe";
+        if (!setArgs(instr, words, 1, line)) return false;
+
+        if (words[0] != "pipe") {
+            if (!checkFlags(instr, 0, (int) instr.args.size(), *info, line)) return false;
+        } else {
+            // every stage is checked against its own command
+            int start = 0;
+            for (int i = 0; i <= (int) instr.args.size(); i++) {
+                if (i < (int) instr.args.size() && (isDynamic(instr, i) || instr.args[i] != "|")) continue;
+
+                std::optional<CommandInfo> stage;
+                if (i > start && !isDynamic(instr, start)) stage = lookup(instr.args[start]);
+                if (!stage || !stage->fusable) return fail(line, "pipe stages must be element-wise commands");
+                if (!checkFlags(instr, start + 1, i, *stage, line)) return false;
+                start = i + 1;
+            }
+        }
+
+        // element-wise commands following each other run as one pass
+        if (fuse && instr.fusable && !program.code.empty() && program.code.back().fusable) {
+            if (std::optional<CommandInfo> pipe = lookup("pipe")) {
+                Instruction& previous = program.code.back();
+                if (previous.sources.empty()) {
+                    Instruction merged;
+                    merged.name = "pipe";
+                    merged.line = previous.line;
+                    merged.handler = std::move(pipe->handler);
+                    merged.fusable = true;
+                    appendStage(merged, previous);
+                    previous = std::move(merged);
+                }
+                previous.args.push_back("|");
+                appendStage(previous, instr);
+                return true;
+            }
+        }
+
+        program.code.push_back(std::move(instr));
+        return true;
+    }
+
+    // Flags in args [first, last) must be accepted by the command and be followed by a number
+    // Checked now so a typo does not surface after hours of looping
+    // The command's leading positional arguments (expr -v+255) are values, up to the first known flag
+    bool checkFlags(const Instruction& instr, int first, int last, const CommandInfo& info, int line) {
+        auto known = [&info](const std::string& arg) {
+            return std::find(info.flags.begin(), info.flags.end(), arg) != info.flags.end();
+        };
+
+        int values = first;
+        while (values < last && values < first + info.positional && (isDynamic(instr, values) || !known(instr.args[values]))) values++;
+
+        for (int i = values; i < last; i++) {
+            const std::string& arg = instr.args[i];
+            if (isDynamic(instr, i) || arg.size() < 2 || arg[0] != '-' || !std::isalpha((unsigned char) arg[1])) continue;
+
+            if (!known(arg)) return fail(line, instr.name + " does not accept " + arg);
+
+            i++;
+            if (i >= last || (!isDynamic(instr, i) && !toCount(instr.args[i]))) {
+                return fail(line, arg + " must be followed by a number");
+            }
+        }
+        return true;
+    }
+
+    // Append a command (or the stages of a pipe) to a merged pipe call
+    void appendStage(Instruction& pipe, const Instruction& stage) {
+        int first = (int) pipe.args.size();
+        if (stage.name != "pipe") pipe.args.push_back(stage.name);
+        int offset = (int) pipe.args.size();
+        for (const WordTemplate& word : stage.dynamic) {
+            pipe.dynamic.push_back({word.index + offset, word.pieces});
+        }
+        pipe.args.insert(pipe.args.end(), stage.args.begin(), stage.args.end());
+        pipe.sources.push_back({stage.name, stage.line, first, (int) pipe.args.size()});
+    }
+
+    // repeat <count> | for <var> in <values...> | for <var> from <a> to <b> [step <c>]
+    bool compileLoop(const std::vector<std::string>& words, int line) {
+        Instruction instr;
+        instr.op = Instruction::Op::loop;
+        instr.name = words[0];
+        instr.line = line;
+
+        if (words[0] == "repeat") {
+            if (words.size() != 2) return fail(line, "usage: repeat <count> { ... }");
+            if (!setArgs(instr, words, 1, line)) return false;
+            if (instr.dynamic.empty()) {
+                std::optional<long long> count = toCount(instr.args[0]);
+                if (!count || *count < 0) return fail(line, "repeat count must be a non negative number");
+            }
+            program.code.push_back(std::move(instr));
+            return true;
+        }
+
+        bool list = words.size() >= 4 && words[2] == "in";
+        bool range = (words.size() == 6 || (words.size() == 8 && words[6] == "step")) && words[2] == "from" && words[4] == "to";
+        if (!isIdentifier(words.size() > 1 ? words[1] : "") || (!list && !range)) {
+            return fail(line, "usage: for <name> in <values...> { ... } or for <name> from <a> to <b> [step <c>] { ... }");
+        }
+        for (size_t i = 3; i < words.size(); i++) {
+            if (words[i].find('$') != std::string::npos) return fail(line, "for values must be constants");
+        }
+
+        if (list) {
+            instr.values.assign(words.begin() + 3, words.end());
+        } else {
+            std::optional<double> from = toNumber(words[3]);
+            std::optional<double> to = toNumber(words[5]);
+            std::optional<double> step = words.size() == 8 ? toNumber(words[7]) : std::optional<double>(1.0);
+            if (!from || !to || !step) return fail(line, "for range bounds must be numbers");
+            if (*step == 0 || (*to - *from) / *step < 0) return fail(line, "for range step does not reach the end");
+
+            double steps = std::floor((*to - *from) / *step + 1e-9);
+            if (steps >= maxSweep) return fail(line, "for range has too many values");
+
+            bool integral = *from == std::floor(*from) && *step == std::floor(*step);
+            for (long long k = 0; k <= (long long) steps; k++) {
+                double value = *from + k * *step;
+                std::ostringstream text;
+                if (integral) text << (long long) value;
+                else text << value;
+                instr.values.push_back(text.str());
+            }
+        }
+
+        instr.var = variable(words[1], true);
+        program.code.push_back(std::move(instr));
+        return true;
+    }
+};
+
+}
+
+
+
+
+bool compileScript(const std::string& text, const std::string& source, const CommandLookup& lookup,
+                   Program& program, std::ostream& err, bool fuse) {
+    program = Program();
+    program.source = source;
+    Compiler compiler(text, source, lookup, program, err, fuse);
+    return compiler.compileBlock(0);
+}
+
+
+bool runProgram(const Program& program,
+                const std::function<bool(const Instruction&, const std::vector<std::string>&)>& call,
+                std::ostream& err) {
+    const std::vector<Instruction>& code = program.code;
+    std::vector<std::string> values(program.variables.size());
+    std::vector<long long> counter(code.size());
+    std::vector<long long> limit(code.size());
+    std::vector<std::string> scratch;
+
+    auto substitute = [&](const Instruction& instr) -> const std::vector<std::string>& {
+        if (instr.dynamic.empty()) return instr.args;
+        scratch = instr.args;
+        for (const WordTemplate& word : instr.dynamic) {
+            std::string& arg = scratch[word.index];
+            arg.clear();
+            for (const WordPiece& piece : word.pieces) {
+                arg += piece.var < 0 ? piece.text : values[piece.var];
+            }
+        }
+        return scratch;
+    };
+
+    size_t pc = 0;
+    while (pc < code.size()) {
+        const Instruction& instr = code[pc];
+
+        switch (instr.op) {
+        case Instruction::Op::call:
+            if (!call(instr, substitute(instr))) return false;
+            pc++;
+            break;
+
+        case Instruction::Op::set:
+            values[instr.var] = substitute(instr)[0];
+            pc++;
+            break;
+
+        case Instruction::Op::loop:
+            counter[pc] = 0;
+            if (instr.var < 0) {
+                std::optional<long long> count = toCount(substitute(instr)[0]);
+                if (!count || *count < 0) {
+                    err << program.source << ":" << instr.line << ": repeat count " << substitute(instr)[0] << " is not a number" << std::endl;
+                    return false;
+                }
+                limit[pc] = *count;
+            } else {
+                limit[pc] = (long long) instr.values.size();
+                values[instr.var] = instr.values[0];
+            }
+            pc = limit[pc] > 0 ? pc + 1 : instr.jump;
+            break;
+
+        case Instruction::Op::end: {
+            size_t loop = instr.jump;
+            if (++counter[loop] < limit[loop]) {
+                if (code[loop].var >= 0) values[code[loop].var] = code[loop].values[counter[loop]];
+                pc = loop + 1;
+            } else {
+                pc++;
+            }
+            break;
+        }
+        }
+    }
+    return true;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <functional>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Script tools
+// Scripts are compiled once into a flat list of resolved command calls,
+// running a loop then costs one handler call per command and iteration
+//
+//   # comment
+//   set q 8
+//   repeat 100 { fft d; quant -s $q; ifft d }
+//   for q in 2 4 8 { load a.bmp; quant -s $q; save out_$q.bmp }
+//   for q from 1 to 64 step 2 { ... }
+//
+// Commands are separated by newlines or ';', $name and ${name} are replaced by the variable
+// Consecutive element-wise commands are merged into one "pipe a | b | c" call unless fusing is off,
+// the call keeps each command's name, line and arguments so errors still point at the command
+
+
+using CommandHandler = std::function<bool(const std::vector<std::string>&)>;
+
+// What the compiler needs to know about a command
+struct CommandInfo {
+    CommandHandler handler;
+    std::vector<std::string> flags;         // flags it accepts, each followed by a number
+    int positional = 0;                     // leading arguments that are values even if they start with '-'
+    bool fusable = false;                   // element-wise, can be a pipe stage
+};
+
+using CommandLookup = std::function<std::optional<CommandInfo>(const std::string&)>;
+
+
+// Part of a word, either literal text or a variable
+struct WordPiece {
+    std::string text;
+    int var = -1;
+};
+
+// Word containing variables, substituted into args[index] at run time
+struct WordTemplate {
+    int index = 0;
+    std::vector<WordPiece> pieces;
+};
+
+// Command merged into a pipe call, its stages are the call's args [first, last)
+struct FusedSource {
+    std::string name;
+    int line = 0;
+    int first = 0;
+    int last = 0;
+};
+
+struct Instruction {
+    enum class Op { call, set, loop, end };
+
+    Op op = Op::call;
+    std::string name;                       // command or keyword
+    int line = 0;
+    CommandHandler handler;                 // call
+    std::vector<std::string> args;          // call arguments, set value or repeat count
+    std::vector<WordTemplate> dynamic;      // the args containing variables
+    int var = -1;                           // set / for variable
+    std::vector<std::string> values;        // for: values of the variable, empty for repeat
+    int jump = 0;                           // loop: index past its end, end: index of its loop
+    bool fusable = false;                   // call to an element-wise command or to pipe
+    std::vector<FusedSource> sources;       // call: commands merged into this pipe, empty if not merged
+};
+
+struct Program {
+    std::string source;                     // file name used in messages
+    std::vector<Instruction> code;
+    std::vector<std::string> variables;
+};
+
+
+// Compile script text, unknown commands, flags the command does not accept,
+// undefined variables and unbalanced blocks are reported as source:line errors
+// fuse = false keeps every command a call of its own, e.g. to time each one
+bool compileScript(const std::string& text, const std::string& source, const CommandLookup& lookup,
+                   Program& program, std::ostream& err, bool fuse = true);
+
+// Run a compiled program, call runs one command with its substituted arguments and returns false to stop
+// Returns false if stopped early or a repeat count is not a number
+bool runProgram(const Program& program,
+                const std::function<bool(const Instruction&, const std::vector<std::string>&)>& call,
+                std::ostream& err);
@@ -0,0 +1,104 @@
+#include "ThreadTools.h"
+
+#include <algorithm>
+#include <chrono>
+
+
+
+
+ThreadPool::ThreadPool(int threads) {
+    if (threads < 1) threads = 1;
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back([this] { workerLoop(); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    cv.notify_all();
+    for (std::thread& t : workers) {
+        t.join();
+    }
+}
+
+std::shared_future<void> ThreadPool::submit(std::function<void()> task) {
+    std::packaged_task<void()> job(std::move(task));
+    std::shared_future<void> done = job.get_future().share();
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        tasks.push(std::move(job));
+    }
+    cv.notify_one();
+    return done;
+}
+
+int ThreadPool::size() const {
+    return static_cast<int>(workers.size());
+}
+
+void ThreadPool::workerLoop() {
+    while (true) {
+        std::packaged_task<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [this] { return stopping || !tasks.empty(); });
+            // drain the queue before stopping
+            if (tasks.empty()) return;
+            job = std::move(tasks.front());
+            tasks.pop();
+        }
+        job();
+    }
+}
+
+
+bool isReady(const std::shared_future<void>& f) {
+    return f.valid() && f.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+
+// Set on the threads of the band pool and on a caller while it runs its own band
+static thread_local bool insideBand = false;
+
+void parallelBands(int rows, int minRows, const std::function<void(int, int)>& body) {
+    static const int threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    static ThreadPool pool(std::max(1, threads - 1));
+
+    int bands = insideBand ? 1 : threads;
+    bands = std::max(1, std::min(bands, rows / std::max(1, minRows)));
+    if (bands == 1) {
+        body(0, rows);
+        return;
+    }
+
+    std::vector<std::shared_future<void>> done;
+    for (int b = 1; b < bands; b++) {
+        int first = static_cast<int>(static_cast<long long>(rows) * b / bands);
+        int last = static_cast<int>(static_cast<long long>(rows) * (b + 1) / bands);
+        done.push_back(pool.submit([&body, first, last] {
+            insideBand = true;
+            body(first, last);
+        }));
+    }
+
+    // every band must end before body goes out of scope, the first exception is kept
+    std::exception_ptr error;
+    try {
+        insideBand = true;
+        body(0, rows / bands);
+    } catch (...) {
+        error = std::current_exception();
+    }
+    insideBand = false;
+    for (std::shared_future<void>& f : done) {
+        try {
+            f.get();
+        } catch (...) {
+            if (!error) error = std::current_exception();
+        }
+    }
+    if (error) std::rethrow_exception(error);
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <functional>
+#include <future>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <vector>
+#include <optional>
+
+// Thread tools
+
+
+// Fixed set of worker threads running queued tasks in FIFO order
+// A pool of one thread is an ordered background queue (used for disk I/O)
+class ThreadPool {
+public:
+    explicit ThreadPool(int threads);
+
+    // Finishes every queued task before joining the workers
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Queue a task, the returned future becomes ready once it has run
+    std::shared_future<void> submit(std::function<void()> task);
+
+    int size() const;
+
+private:
+    void workerLoop();
+
+    std::vector<std::thread> workers;
+    std::queue<std::packaged_task<void()>> tasks;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool stopping = false;
+};
+
+
+// True if the future is valid and its task has finished
+bool isReady(const std::shared_future<void>& f);
+
+
+// Run body(first, last) on bands of rows covering [0, rows), one per hardware thread,
+// bands shorter than minRows are merged and the calling thread runs the first one
+// The other bands go to one pool shared by every caller, so concurrent callers (batch workers) never
+// start more than the hardware threads between them, and a call from inside a band runs inline
+// An exception thrown by a band is rethrown on the caller once every band has finished
+void parallelBands(int rows, int minRows, const std::function<void(int, int)>& body);
+
+// Least work per band of parallelBands: rows of an image, values of a row, columns of a stripe of
+// column histograms or block buffers that should stay in cache
+constexpr int bandRows = 32;
+constexpr int bandValues = 1024;
+constexpr int stripeColumns = 256;
+
+
+// Blocking FIFO holding at most capacity items, push waits while it is full
+// After close() pushes are refused and pop drains what is left, then returns nullopt
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity > 0 ? capacity : 1) {}
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    // False if the queue was closed
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mtx);
+        notFull.wait(lock, [this] { return closed || items.size() < capacity; });
+        if (closed) return false;
+        items.push(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    std::optional<T> pop() {
+        std::unique_lock<std::mutex> lock(mtx);
+        notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+        if (items.empty()) return std::nullopt;
+        T item = std::move(items.front());
+        items.pop();
+        notFull.notify_one();
+        return item;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mtx);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+
+private:
+    size_t capacity;
+    std::queue<T> items;
+    std::mutex mtx;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    bool closed = false;
+};
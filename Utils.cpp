@@ -1,6 +1,9 @@
 #include "Utils.h"
 #include "ImageData.h"
 
+#include <algorithm>
+#include <cstring>
+
 
 // Try to parse string as int, return value if valid, otherwise std::nullopt
 std::optional<int> toInt(const std::string& s) {
@@ -47,6 +50,133 @@ Complex uchar_to_complex(unsigned char value) {
 //------------------------------------------------------------------------------------------------------------------
 
 
+// IEEE half precision bit pattern of f, round to nearest even
+uint16_t float_to_half(float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+
+    uint16_t sign = (x >> 16) & 0x8000;
+    uint32_t mant = x & 0x7FFFFF;
+    int exp = static_cast<int>((x >> 23) & 0xFF) - 127 + 15;
+
+    // NaN and infinity
+    if (((x >> 23) & 0xFF) == 0xFF) return sign | 0x7C00 | (mant ? 0x200 : 0);
+    // overflow to infinity
+    if (exp >= 31) return sign | 0x7C00;
+
+    // subnormal or zero
+    if (exp <= 0) {
+        if (exp < -10) return sign;
+        mant |= 0x800000;
+        int shift = 14 - exp;
+        uint32_t half = mant >> shift;
+        uint32_t rest = mant & ((1u << shift) - 1);
+        uint32_t mid = 1u << (shift - 1);
+        if (rest > mid || (rest == mid && (half & 1))) half++;
+        return sign | static_cast<uint16_t>(half);
+    }
+
+    uint32_t half = (static_cast<uint32_t>(exp) << 10) | (mant >> 13);
+    uint32_t rest = mant & 0x1FFF;
+    // a carry into the exponent is still the correctly rounded value
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;
+    return sign | static_cast<uint16_t>(half);
+}
+
+float half_to_float(uint16_t h) {
+    uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1F;
+    uint32_t mant = h & 0x3FF;
+    uint32_t x;
+
+    if (exp == 0x1F) {
+        x = sign | 0x7F800000 | (mant << 13);
+    } else if (exp != 0) {
+        x = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+    } else if (mant == 0) {
+        x = sign;
+    } else {
+        // subnormal, normalize
+        exp = 127 - 15 + 1;
+        while (!(mant & 0x400)) {
+            mant <<= 1;
+            exp--;
+        }
+        x = sign | (exp << 23) | ((mant & 0x3FF) << 13);
+    }
+
+    float f;
+    std::memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+// Nearest half of value through float, the bits of normal halves are rounded in place
+static inline double round_to_half(double value) {
+    // saturate instead of overflowing to infinity, keeps transformed images usable
+    float f = static_cast<float>(std::clamp(value, -65504.0, 65504.0));
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+
+    int exp = static_cast<int>((x >> 23) & 0xFF) - 127;
+    if (exp < -14 || exp > 15) return half_to_float(float_to_half(f));
+
+    // keep 10 of the 23 mantissa bits, round to nearest even, a carry into the exponent is still right
+    uint32_t rest = x & 0x1FFF;
+    x &= ~0x1FFFu;
+    if (rest > 0x1000 || (rest == 0x1000 && (x & 0x2000))) x += 0x2000;
+    std::memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+// Round to the nearest value representable at precision p
+double round_to_precision(double value, Precision p) {
+    switch (p) {
+        case Precision::f32: return static_cast<float>(value);
+        case Precision::f16: return round_to_half(value);
+        default: return value;
+    }
+}
+
+void round_to_precision(double* values, size_t count, Precision p) {
+    if (p == Precision::f32) {
+        for (size_t i = 0; i < count; i++) values[i] = static_cast<float>(values[i]);
+    } else if (p == Precision::f16) {
+        for (size_t i = 0; i < count; i++) values[i] = round_to_half(values[i]);
+    }
+}
+
+Complex round_to_precision(Complex value, Precision p) {
+    return Complex(round_to_precision(value.real(), p), round_to_precision(value.imag(), p));
+}
+
+// Bytes used to store one double at precision p
+int precision_bytes(Precision p) {
+    switch (p) {
+        case Precision::f32: return 4;
+        case Precision::f16: return 2;
+        default: return 8;
+    }
+}
+
+// Parse "f64" / "f32" / "f16"
+std::optional<Precision> toPrecision(const std::string& s) {
+    if (s == "f64") return Precision::f64;
+    if (s == "f32") return Precision::f32;
+    if (s == "f16") return Precision::f16;
+    return std::nullopt;
+}
+
+std::string precision_name(Precision p) {
+    switch (p) {
+        case Precision::f32: return "f32";
+        case Precision::f16: return "f16";
+        default: return "f64";
+    }
+}
+
+//------------------------------------------------------------------------------------------------------------------
+
+
 // Convert int vector to complex vector
 std::vector<std::complex<double>> int_to_complex(const std::vector<int>& input) {
     std::vector<std::complex<double>> result;
@@ -120,6 +250,27 @@ void levelHelper(ImageData& img, int x_s, int y_s, int x_l, int y_l){
     }
 }
 
+void levelHelper(ImageData& img, const int* pixel, int count){
+
+    Complex sum[3] = {Complex(0,0), Complex(0,0), Complex(0,0)};
+
+    for (int i = 0; i < count; i++) {
+        const Triple& a = img.pixels[pixel[i] / img.width][pixel[i] % img.width];
+        sum[0] += a[0];
+        sum[1] += a[1];
+        sum[2] += a[2];
+    }
+
+    for (int c = 0; c < 3; c++) sum[c] /= Complex(count, 0);
+
+    for (int i = 0; i < count; i++) {
+        Triple& a = img.pixels[pixel[i] / img.width][pixel[i] % img.width];
+        a[0] = sum[0];
+        a[1] = sum[1];
+        a[2] = sum[2];
+    }
+}
+
 
 // parse double pair
 bool parsePair(const std::string& str, double& a, double& b) {
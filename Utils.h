@@ -1,9 +1,13 @@
+#pragma once
+
 #include "Commons.h"
 
 #include <optional>
 #include <vector>
 #include <map>
 #include <charconv>
+#include <cstdint>
+#include <string>
 
 
 class ImageData; 
@@ -30,6 +34,30 @@ Complex uchar_to_complex(unsigned char value);
 //------------------------------------------------------------------------------------------------------------------
 
 
+// IEEE half precision bit pattern of f, round to nearest even
+uint16_t float_to_half(float f);
+
+float half_to_float(uint16_t h);
+
+// Round to the nearest value representable at precision p, f16 saturates at +-65504
+double round_to_precision(double value, Precision p);
+
+Complex round_to_precision(Complex value, Precision p);
+
+// Same on count values in place
+void round_to_precision(double* values, size_t count, Precision p);
+
+// Bytes used to store one double at precision p
+int precision_bytes(Precision p);
+
+// Parse "f64" / "f32" / "f16"
+std::optional<Precision> toPrecision(const std::string& s);
+
+std::string precision_name(Precision p);
+
+//------------------------------------------------------------------------------------------------------------------
+
+
 // Convert int vector to complex vector
 std::vector<std::complex<double>> int_to_complex(const std::vector<int>& input);
 
@@ -46,6 +74,9 @@ std::vector<double> complex_to_double(const std::vector<std::complex<double>>& i
 
 void levelHelper(ImageData& img, int x_s, int y_s, int x_l, int y_l);
 
+// same over count pixels given as y * width + x
+void levelHelper(ImageData& img, const int* pixel, int count);
+
 
 // parse pair
 bool parsePair(const std::string& str, double& a, double& b);
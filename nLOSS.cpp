@@ -6,6 +6,15 @@
 #include "FuncTools.h"
 #include "FragTools.h"
 #include "FilterTools.h"
+#include "ThreadTools.h"
+#include "PackTools.h"
+#include "ScriptTools.h"
+#include "ExprTools.h"
+#include "NoiseTools.h"
+#include "ConvTools.h"
+#include "EdgeTools.h"
+#include "RankTools.h"
+#include "MorphTools.h"
 
 
 #include <iostream>
@@ -20,178 +29,507 @@
 #include <complex>
 #include <cmath>
 #include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <iomanip>
+#include <stdexcept>
+#include <chrono>
+#include <filesystem>
+#include <optional>
+#include <thread>
 
+#include <glob.h>
 
 
 
 
-// Parse global flags
-std::map<std::string, int> parseVector(const std::vector<std::string>& args, int start, std::map<std::string, bool> allowed){
 
-    std::map<std::string, int> catches = {{"failed", 0}, {"-n", 0}, {"-s", 0}, {"-sx", 0}, {"-sy", 0}, {"-fr", 0}};
+// Flags shared by the commands, 0 when not given
+struct Flags {
+    bool failed = false;
+    int n = 0;
+    int s = 0;
+    int sx = 0;
+    int sy = 0;
+    int fr = 0;
+    int ft = 0;
+    int seed = 0;
+    int q = 0;
+};
+
+enum FlagMask { FLAG_N = 1, FLAG_S = 2, FLAG_SX = 4, FLAG_SY = 8, FLAG_FR = 16, FLAG_FT = 32, FLAG_SEED = 64, FLAG_Q = 128 };
+
+// Parse global flags, allowed is a FlagMask combination
+Flags parseFlags(const std::vector<std::string>& args, int start, int allowed, std::ostream& out = std::cout){
+
+    static const struct { const char* name; FlagMask mask; int Flags::* field; } table[] = {
+        {"-n", FLAG_N, &Flags::n}, {"-s", FLAG_S, &Flags::s}, {"-sx", FLAG_SX, &Flags::sx},
+        {"-sy", FLAG_SY, &Flags::sy}, {"-fr", FLAG_FR, &Flags::fr}, {"-ft", FLAG_FT, &Flags::ft},
+        {"-seed", FLAG_SEED, &Flags::seed}, {"-q", FLAG_Q, &Flags::q}
+    };
+
+    Flags flags;
 
     for (int i = start; i < (int) args.size(); ++i) {
-        if (args[i] == "-n" && allowed["-n"]) {
-            i++;
-            if (auto val = toInt(args[i])) {
-                if(*val < N_images) catches["-n"] = *val;
-            } else {
-                std::cout << "Error: -n must be followed by a number"<<std::endl;;
-                catches["failed"] = 1;
-                return catches;
-            }
-        }
-        else if (args[i] == "-s" && allowed["-s"]) {
-            i++;
-            if (auto val = toInt(args[i])) {
-                if(*val > 0) catches["-s"] = *val;
-            } else {
-                std::cout << "Error: -s must be followed by a number"<<std::endl;;
-                catches["failed"] = 1;
-                return catches;
-            }
-        }
-        else if (args[i] == "-sx" && allowed["-sx"]) {
-            i++;
-            if (auto val = toInt(args[i])) {
-                if(*val > 0) catches["-sx"] = *val;
-            } else {
-                std::cout << "Error: -sx must be followed by a number"<<std::endl;;
-                catches["failed"] = 1;
-                return catches;
-            }
-        }
-        else if (args[i] == "-sy" && allowed["-sy"]) {
+        bool matched = false;
+
+        for (const auto& flag : table) {
+            if (args[i] != flag.name || !(allowed & flag.mask)) continue;
+            matched = true;
+
             i++;
-            if (auto val = toInt(args[i])) {
-                if(*val > 0) catches["-sy"] = *val;
-            } else {
-                std::cout << "Error: -sy must be followed by a number"<<std::endl;;
-                catches["failed"] = 1;
-                return catches;
+            std::optional<int> val = i < (int) args.size() ? toInt(args[i]) : std::nullopt;
+            if (!val) {
+                out << "Error: " << flag.name << " must be followed by a number"<<std::endl;
+                flags.failed = true;
+                return flags;
             }
+            // -n outside the slot range and non positive sizes keep the default
+            if (flag.mask == FLAG_N ? (*val >= 0 && *val < N_images) : *val > 0) flags.*flag.field = *val;
+            break;
         }
-        else if (args[i] == "-fr" && allowed["-fr"]) {
-            i++;
-            if (auto val = toInt(args[i])) {
-                if(*val > 0) catches["-fr"] = *val;
-            } else {
-                std::cout << "Error: -fr must be followed by a number"<<std::endl;;
-                catches["failed"] = 1;
-                return catches;
-            }
-        }
-        else {
-            std::cout << "Error: argument " << args[i] <<" not allowed in this function"<<std::endl;;
-            catches["failed"] = 1;
-            return catches;
+
+        if (!matched) {
+            out << "Error: argument " << args[i] <<" not allowed in this function"<<std::endl;
+            flags.failed = true;
+            return flags;
         }
     }
 
-    return catches;
+    if (flags.ft >= FRAG_TYPES) {
+        out << "Error: -ft must be 0 (random squares), 1 (variance quadtree), 2 (edge quadtree) or 3 (voronoi)" << std::endl;
+        flags.failed = true;
+    }
+
+    return flags;
 }
 
 
+
 class CLI {
 private:
     struct Command {
-        std::function<void(const std::vector<std::string>&)> handler;
+        CommandHandler handler;
         std::string description;
         std::string usage;
         std::string flags;
+        int positional;                         // leading arguments that are values even if they start with '-'
     };
     
     std::map<std::string, Command> commands;    // Array of commands
     bool running;                               // Is running
+    std::ostream& out;                          // command output
+    std::ostream& err;                          // error messages
     ImageData currentImage[N_images];                 // Store the current loaded image
+
+    // Background disk I/O job, loads decode into image, saves encode a snapshot of the slot
+    struct IOJob {
+        std::string filename;
+        ImageData image;
+        std::ostringstream out;                 // messages, printed once the job is reaped
+        std::ostringstream err;
+        bool ok = false;
+        std::shared_future<void> done;
+    };
+
+    ThreadPool io{1};                                   // I/O thread, jobs run in submission order
+    std::shared_ptr<IOJob> pendingLoad[N_images];       // load in flight for each slot
+    std::vector<std::shared_ptr<IOJob>> pendingSaves;   // writes in flight
+    bool ioFailed = false;                              // a background load or save failed
+
+    // Memory budget, least recently used slots are spilled to disk above it
+    size_t memBudget = 0;                               // bytes, 0 = unlimited
+    long long lastUse[N_images] = {};                   // last command that used each slot
+    long long commandCount = 0;                         // slots used by the running command are pinned
+    std::string spillDir;
+
+    // Idle slots are compressed in place in the background (see PackJob) and decoded on their next use
+
+    // Precision of each slot, written slots are rounded to it after every command
+    Precision precision[N_images] = {};
+    bool dirty[N_images] = {};                          // written by the running command
+
+    int packAfter = 4;                                  // idle commands before a slot is compressed, 0 = never
+    std::shared_ptr<PackJob> pendingPack[N_images];
+    uint64_t packSkip[N_images] = {};                   // generation of pixels that did not compress, not retried
+    ThreadPool packer{1};
+
+    // Read access to slot n, waits for a background load into it and pages it back in first
+    // 8-bit slots are promoted to complex pixels unless bytes says the caller handles both
+    const ImageData& view(int n, bool bytes = false) {
+        if (pendingLoad[n]) finishLoad(n);
+        if (pendingPack[n]) cancelPack(n);
+
+        ImageData& img = currentImage[n];
+        lastUse[n] = commandCount;
+
+        if (img.spilled) {
+            makeRoom(img.spilledBytes());
+            if (!img.unspill()) {
+                throw std::runtime_error("could not page slot " + std::to_string(n) + " back in");
+            }
+        }
+        if (img.packed) {
+            makeRoom(static_cast<size_t>(img.width) * img.height * sizeof(Triple));
+            if (!img.unpack()) {
+                throw std::runtime_error("could not decompress slot " + std::to_string(n));
+            }
+        }
+        if (img.is8bit() && !bytes) {
+            makeRoom(static_cast<size_t>(img.width) * img.height * sizeof(Triple));
+            img.promote();
+        }
+        return img;
+    }
+
+    // Read-only complex pixels of slot n, an 8-bit slot is promoted into scratch and itself stays 8-bit
+    const ImageData& viewComplex(int n, ImageData& scratch) {
+        const ImageData& img = view(n, true);
+        if (!img.is8bit()) return img;
+        makeRoom(static_cast<size_t>(img.width) * img.height * sizeof(Triple));
+        scratch = img;
+        scratch.promote();
+        return scratch;
+    }
+
+    // Write access to slot n, pixels shared with other slots are copied first
+    ImageData& slot(int n, bool bytes = false) {
+        view(n, bytes);
+        currentImage[n].pixels.detach();
+        currentImage[n].rgb8.detach();
+        currentImage[n].pixels.touch();
+        dirty[n] = true;
+        return currentImage[n];
+    }
+
+    // Replace slot n with img
+    void store(int n, ImageData img) {
+        finishLoad(n);
+        cancelPack(n);
+        lastUse[n] = commandCount;
+        dirty[n] = true;
+        currentImage[n] = std::move(img);
+    }
+
+    // RAM held by all slots, pixels shared between slots are counted once
+    size_t residentBytes() const {
+        size_t total = 0;
+        for (int n = 0; n < N_images; n++) {
+            bool counted = false;
+            for (int k = 0; k < n; k++) {
+                counted |= currentImage[n].pixels.raw() && currentImage[k].pixels.raw() == currentImage[n].pixels.raw();
+                counted |= currentImage[n].rgb8.raw() && currentImage[k].rgb8.raw() == currentImage[n].rgb8.raw();
+            }
+            if (!counted) total += currentImage[n].bytes();
+        }
+        return total;
+    }
+
+    // Spill least recently used slots until needed more bytes fit in the budget
+    // Slots used by the running command are never spilled
+    void makeRoom(size_t needed) {
+        if (memBudget == 0) return;
+
+        size_t total = residentBytes();
+        while (total + needed > memBudget) {
+            int victim = -1;
+            for (int n = 0; n < N_images; n++) {
+                if (lastUse[n] == commandCount || currentImage[n].bytes() == 0) continue;
+                if (victim == -1 || lastUse[n] < lastUse[victim]) victim = n;
+            }
+            if (victim == -1) return;
+
+            cancelPack(victim);
+            if (!currentImage[victim].spill(spillDir)) {
+                err << "Warning: could not spill slot " << victim << " to " << spillDir << std::endl;
+                return;
+            }
+            // spilling one holder of shared pixels frees nothing until the last one goes
+            total = residentBytes();
+        }
+    }
+
+    // Stop compressing slot n, the slot keeps its pixels
+    void cancelPack(int n) {
+        std::shared_ptr<PackJob> job = std::move(pendingPack[n]);
+        if (!job) return;
+        job->cancel = true;
+        job->done.wait();
+    }
+
+    // Swap finished blobs in for the pixels they were made from
+    void reapPacks() {
+        for (int n = 0; n < N_images; n++) {
+            if (!pendingPack[n] || !isReady(pendingPack[n]->done)) continue;
+
+            std::shared_ptr<PackJob> job = std::move(pendingPack[n]);
+            ImageData& img = currentImage[n];
+            size_t raw = job->source.size() * sizeof(Triple);
+
+            // only worth it if smaller, and only if the slot still holds the same pixels
+            if (job->blob->empty() || img.pixels.generation() != job->source.generation()) continue;
+
+            if (job->blob->size() < raw) {
+                img.pack(job->blob);
+            } else {
+                packSkip[n] = img.pixels.generation();
+            }
+        }
+    }
+
+    // Start compressing slots that have been idle for packAfter commands
+    void startPacks() {
+        if (packAfter == 0) return;
+
+        for (int n = 0; n < N_images; n++) {
+            ImageData& img = currentImage[n];
+            if (pendingLoad[n] || pendingPack[n] || !img.isLoaded || img.pixels.size() == 0) continue;
+            if (commandCount - lastUse[n] < packAfter || img.pixels.generation() == packSkip[n]) continue;
+
+            pendingPack[n] = startPack(packer, img.pixels, precision[n], img.realMask);
+        }
+    }
+
+    // Round the slots written by the last command to their precision
+    // Pixels shared with another slot are only copied once a value actually changes
+    void roundDirty() {
+        for (int n = 0; n < N_images; n++) {
+            if (!dirty[n]) continue;
+            dirty[n] = false;
+
+            // a pending load marks its slot dirty again once it lands
+            if (precision[n] == Precision::f64 || pendingLoad[n] || !currentImage[n].isLoaded) continue;
+
+            // packed and spilled slots are brought back in, 8-bit ones are exact at any precision
+            view(n, true);
+            ImageData& img = currentImage[n];
+            if (img.pixels.size() == 0) continue;
+
+            // a triple is 6 doubles: real and imaginary part of 3 channels
+            size_t count = img.pixels.size() * 6;
+            const double* values = reinterpret_cast<const double*>(img.pixels.raw());
+            if (img.pixels.shared()) {
+                size_t i = 0;
+                while (i < count && round_to_precision(values[i], precision[n]) == values[i]) i++;
+                if (i == count) continue;
+                img.pixels.detach();
+            }
+            round_to_precision(reinterpret_cast<double*>(img.pixels.raw()), count, precision[n]);
+            img.pixels.touch();
+        }
+    }
+
+    // Wait for the load into slot n and move the decoded image in
+    void finishLoad(int n) {
+        std::shared_ptr<IOJob> job = std::move(pendingLoad[n]);
+        if (!job) return;
+
+        job->done.wait();
+        out << job->out.str();
+        err << job->err.str();
+
+        if (job->ok) {
+            currentImage[n] = std::move(job->image);
+            dirty[n] = true;
+        } else {
+            err << "Failed to load BMP image: " << job->filename << std::endl;
+            ioFailed = true;
+        }
+    }
+
+    // Report finished writes, blocking on the unfinished ones if wait is set
+    void finishSaves(bool wait) {
+        std::vector<std::shared_ptr<IOJob>> running;
+
+        for (std::shared_ptr<IOJob>& job : pendingSaves) {
+            if (!wait && !isReady(job->done)) {
+                running.push_back(job);
+                continue;
+            }
+            job->done.wait();
+            out << job->out.str();
+            err << job->err.str();
+            if (!job->ok) {
+                err << "Failed to save BMP image: " << job->filename << std::endl;
+                ioFailed = true;
+            }
+        }
+
+        pendingSaves = std::move(running);
+    }
+
+    // Pick up finished background jobs without blocking
+    void reapIO() {
+        for (int n = 0; n < N_images; n++) {
+            if (pendingLoad[n] && isReady(pendingLoad[n]->done)) finishLoad(n);
+        }
+        finishSaves(false);
+    }
+
+    // Wait for all background jobs
+    void syncIO() {
+        for (int n = 0; n < N_images; n++) {
+            finishLoad(n);
+        }
+        finishSaves(true);
+    }
+
+    // Back to an empty state, used between the images of a batch
+    void reset() {
+        syncIO();
+        for (int n = 0; n < N_images; n++) {
+            cancelPack(n);
+            currentImage[n].clear();
+            precision[n] = Precision::f64;
+            dirty[n] = false;
+            packSkip[n] = 0;
+        }
+        running = true;
+        ioFailed = false;
+    }
+
+    // Whole script file, nullopt (and a message) if it cannot be read
+    std::optional<std::string> readScript(const std::string& filename) {
+        std::ifstream file(filename);
+        if (!file) {
+            err << "Error: Cannot open script " << filename << std::endl;
+            return std::nullopt;
+        }
+        std::ostringstream text;
+        text << file.rdbuf();
+        return text.str();
+    }
     
     // Command handlers
 
     // Handles loading .bmp files
-    void handleLoad(const std::vector<std::string>& args) {
+    bool handleLoad(const std::vector<std::string>& args) {
         if (args.empty()) {
-            std::cerr << "Error: Please specify a filename to load" << std::endl;
-            std::cout << "Usage: load <filename.bmp>" << std::endl;
-            return;
+            err << "Error: Please specify a filename to load" << std::endl;
+            out << "Usage: load <filename.bmp>" << std::endl;
+            return false;
         }
         
         std::string filename = args[0];
-        std::map<std::string, bool> allowed = {{"-n", true}, {"-s", false}, {"-sx", false}, {"-sy", false}, {"-fr", false}};
-        std::map<std::string, int> catches = parseVector(args, 1, allowed);
-        if (catches["failed"]) return;
-        ImageData& img = currentImage[catches["-n"]];
-        
-        // Clear any existing image
-        img.clear();
+        Flags flags = parseFlags(args, 1, FLAG_N, out);
+        if (flags.failed) return false;
+        int n = flags.n;
         
-        // Try to load the image
-        if (!loadBMP(filename, img)) {
-            std::cerr << "Failed to load BMP image: " << filename << std::endl;
-        }
+        // Clear any existing image, the slot stays pending until the load is joined
+        finishLoad(n);
+        cancelPack(n);
+        currentImage[n].clear();
+
+        std::shared_ptr<IOJob> job = std::make_shared<IOJob>();
+        job->filename = filename;
+        job->done = io.submit([job] {
+            job->ok = loadBMP(job->filename, job->image, job->out, job->err);
+        });
+        pendingLoad[n] = job;
+        return true;
     }
     
     // handles saving .bmp files
-    void handleSave(const std::vector<std::string>& args) {
+    bool handleSave(const std::vector<std::string>& args) {
         if (args.empty()) {
-            std::cerr << "Error: Please specify a filename to save" << std::endl;
-            std::cout << "Usage: save <filename.bmp>" << std::endl;
-            return;
+            err << "Error: Please specify a filename to save" << std::endl;
+            out << "Usage: save <filename.bmp>" << std::endl;
+            return false;
         }
         
         std::string filename = args[0];
-        std::map<std::string, bool> allowed = {{"-n", true}, {"-s", false}, {"-sx", false}, {"-sy", false}, {"-fr", false}};
-        std::map<std::string, int> catches = parseVector(args, 1, allowed);
-        if (catches["failed"]) return;
-        ImageData& img = currentImage[catches["-n"]];
+        Flags flags = parseFlags(args, 1, FLAG_N, out);
+        if (flags.failed) return false;
+        const ImageData& img = view(flags.n, true);
+
+        if (!img.isLoaded) {
+            err << "Error: No image loaded to save" << std::endl;
+            return false;
+        }
         
-        if (!saveBMP(filename, img)) {
-            std::cerr << "Failed to save BMP image: " << filename << std::endl;
+        // Encode and write a snapshot on the I/O thread
+        std::shared_ptr<IOJob> job = std::make_shared<IOJob>();
+        job->filename = filename;
+        job->image = img;
+        job->done = io.submit([job] {
+            job->ok = saveBMP(job->filename, job->image, job->out, job->err);
+            // release the snapshot so the slot is no longer shared
+            job->image.clear();
+        });
+        pendingSaves.push_back(job);
+        return true;
+    }
+
+    // Wait for background loads and saves
+    bool handleSync(const std::vector<std::string>& args) {
+        if (!args.empty()){
+            out << "No arguments allowed for this function" << std::endl;
+            return false;
         }
+        syncIO();
+        return true;
     }
     
     // Exit the Program
-    void handleExit(const std::vector<std::string>& args) {
+    bool handleExit(const std::vector<std::string>& args) {
         if (!args.empty()){
-            std::cout << "No arguments allowed for this function" << std::endl;
-            return;
+            out << "No arguments allowed for this function" << std::endl;
+            return false;
         }
-        std::cout << "Goodbye!" << std::endl;
+        syncIO();
+        out << "Goodbye!" << std::endl;
         running = false;
+        return true;
     }
     
     // average each block
-    void handleResize(const std::vector<std::string>& args) {
-        std::map<std::string, bool> allowed = {{"-n", true}, {"-s", false}, {"-sx", false}, {"-sy", false}, {"-fr", false}};
-        std::map<std::string, int> catches = parseVector(args, 1, allowed);
-        if (catches["failed"]) return;
-        ImageData& img = currentImage[catches["-n"]];
+    bool handleResize(const std::vector<std::string>& args) {
+        Flags flags = parseFlags(args, 1, FLAG_N, out);
+        if (flags.failed) return false;
+        const ImageData& img = view(flags.n, true);
 
         if (!img.isLoaded) {
-            std::cerr << "Error: No image loaded" << std::endl;
-            return;
+            err << "Error: No image loaded" << std::endl;
+            return false;
         }
 
         
         int newHeight, newWidth;
 
         if (args.size() < 1 || !parseDoubleInt(args[0], newHeight, newWidth)) {
-            std::cerr << "Error: please input integers (h,w)" << std::endl;
-            return;
+            err << "Error: please input integers (h,w)" << std::endl;
+            return false;
         }
 
         if ( newHeight <= 0 || newWidth <= 0) {
-            std::cerr << "Error: please input positive integers (h,w)" << std::endl;
-            return;
+            err << "Error: please input positive integers (h,w)" << std::endl;
+            return false;
         }
 
         int oldWidth  = img.width;
         int oldHeight = img.height;
 
-        if (oldWidth == newWidth && oldHeight == newHeight) return;
+        if (oldWidth == newWidth && oldHeight == newHeight) return true;
 
+        // nearest neighbour, 8-bit slots stay 8-bit
         ImageData newImg;
-        newImg.allocate(newWidth, newHeight);
+        if (img.is8bit()) {
+            newImg.allocate8(newWidth, newHeight);
+            resample(img.rgb8, oldWidth, oldHeight, newImg.rgb8, newWidth, newHeight);
+        } else {
+            newImg.allocate(newWidth, newHeight);
+            resample(img.pixels, oldWidth, oldHeight, newImg.pixels, newWidth, newHeight);
+        }
+
+        newImg.realMask = img.realMask;
+        store(flags.n, std::move(newImg));
 
+        out << "Image Resized" << std::endl;
+        return true;
+    }
+
+    template <typename Buffer>
+    static void resample(const Buffer& src, int oldWidth, int oldHeight, Buffer& dst, int newWidth, int newHeight) {
         float scaleX = static_cast<float>(oldWidth)  / newWidth;
         float scaleY = static_cast<float>(oldHeight) / newHeight;
 
@@ -199,52 +537,45 @@ private:
             int srcY = std::min(static_cast<int>(y * scaleY), oldHeight - 1);
             for (int x = 0; x < newWidth; ++x) {
                 int srcX = std::min(static_cast<int>(x * scaleX), oldWidth - 1);
-                
-                for (int c = 0; c < 3; ++c) {
-                    newImg.pixels[y][x][c] = img.pixels[srcY][srcX][c];
-                }
+                dst[y][x] = src[srcY][srcX];
             }
         }
-
-        img = std::move(newImg);
-
-        std::cout << "Image Resized" << std::endl;
     }
 
     // Usage guide 
-    void handleHelp(const std::vector<std::string>& args) {
+    bool handleHelp(const std::vector<std::string>& args) {
         if (!args.empty()){
-            std::cout << "No arguments allowed for this function" << std::endl;
-            return;
+            out << "No arguments allowed for this function" << std::endl;
+            return false;
         }
 
-        std::cout << "Available commands:" << std::endl;
+        out << "Available commands:" << std::endl;
         for (const auto& [name, cmd] : commands) {
-            std::cout << "  " << name << " - " << cmd.description << std::endl;
+            out << "  " << name << " - " << cmd.description << std::endl;
             if (!cmd.usage.empty()) {
-                std::cout << "    Usage: " << cmd.usage << std::endl;
-                std::cout << "    Flags: " << cmd.flags << std::endl;
-                std::cout << std::endl;
+                out << "    Usage: " << cmd.usage << std::endl;
+                out << "    Flags: " << cmd.flags << std::endl;
+                out << std::endl;
             }
         }
-        std::cout << "\nFlag guide:" << std::endl;
-        std::cout << "-n :: choose one of 16 (0 - 15) image slots for command (default = 0)" << std::endl;
-        std::cout << "-s :: input mandatory size parameter for command (no default)" << std::endl;
-        std::cout << "-sx :: input x-size parameter for command (default = img.width)" << std::endl;
-        std::cout << "-sy :: input y-size parameter for command (default = img.height)" << std::endl;
+        out << "\nFlag guide:" << std::endl;
+        out << "-n :: choose one of 16 (0 - 15) image slots for command (default = 0)" << std::endl;
+        out << "-s :: input mandatory size parameter for command (no default)" << std::endl;
+        out << "-sx :: input x-size parameter for command (default = img.width)" << std::endl;
+        out << "-sy :: input y-size parameter for command (default = img.height)" << std::endl;
 
-        std::cout << "\nSupported format: 24-bit uncompressed BMP files" << std::endl;
-        std::cout << "Image is lept as complex matrix, automatically cast into 8 bit integers when saving" << std::endl;
+        out << "\nSupported format: 24-bit uncompressed BMP files" << std::endl;
+        out << "Image is lept as complex matrix, automatically cast into 8 bit integers when saving" << std::endl;
+        return true;
     }
     
     // Image info
-    void handleInfo(const std::vector<std::string>& args) {
-        std::map<std::string, bool> allowed = {{"-n", true}, {"-s", false}, {"-sx", false}, {"-sy", false}, {"-fr", false}};
-        std::map<std::string, int> catches = parseVector(args, 0, allowed);
-        if (catches["failed"]) return;
-        ImageData& img = currentImage[catches["-n"]];
+    bool handleInfo(const std::vector<std::string>& args) {
+        Flags flags = parseFlags(args, 0, FLAG_N, out);
+        if (flags.failed) return false;
+        const ImageData& img = view(flags.n, true);
 
-        img.printInfo();
+        img.printInfo(out);
         if (img.isLoaded) {
             // Calculate some basic statistics
             long long totalR = 0, totalG = 0, totalB = 0;
@@ -252,13 +583,19 @@ private:
             
             for (int y = 0; y < img.height; y++) {
                 for (int x = 0; x < img.width; x++) {
+                    if (img.is8bit()) {
+                        totalR += img.rgb8[y][x][0];
+                        totalG += img.rgb8[y][x][1];
+                        totalB += img.rgb8[y][x][2];
+                        continue;
+                    }
                     totalR += img.pixels[y][x][0].real();
                     totalG += img.pixels[y][x][1].real();
                     totalB += img.pixels[y][x][2].real();
                 }
             }
             
-            std::cout << "Average RGB values: (" 
+            out << "Average RGB values: (" 
                      << totalR / totalPixels << ", "
                      << totalG / totalPixels << ", "
                      << totalB / totalPixels << ")" << std::endl;
@@ -269,24 +606,93 @@ private:
             int imageDataSize = rowSize * img.height;
             int totalFileSize = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + imageDataSize;
             
-            std::cout << "BMP format details:" << std::endl;
-            std::cout << "  Row padding: " << padding << " bytes" << std::endl;
-            std::cout << "  Row size: " << rowSize << " bytes" << std::endl;
-            std::cout << "  Image data size: " << imageDataSize << " bytes" << std::endl;
-            std::cout << "  Total file size: " << totalFileSize << " bytes" << std::endl;
+            out << "BMP format details:" << std::endl;
+            out << "  Row padding: " << padding << " bytes" << std::endl;
+            out << "  Row size: " << rowSize << " bytes" << std::endl;
+            out << "  Image data size: " << imageDataSize << " bytes" << std::endl;
+            out << "  Total file size: " << totalFileSize << " bytes" << std::endl;
+            out << "Precision: " << precision_name(precision[flags.n]) << std::endl;
+            out << "Real channels:" << (img.isReal(0) ? " R" : "") << (img.isReal(1) ? " G" : "")
+                      << (img.isReal(2) ? " B" : "") << (img.realMask ? "" : " none") << std::endl;
+            out << "Storage: " << (img.is8bit() ? "8-bit" : "complex") << std::endl;
+            out << "Memory usage: " << img.bytes() << " bytes"
+                      << (img.pixels.shared() || img.rgb8.shared() ? " (shared with another slot)" : "") << std::endl;
+        }
+        return true;
+    }
+
+    // Per-slot memory usage, 'mem <MB>' sets the budget and 'mem off' removes it
+    bool handleMem(const std::vector<std::string>& args) {
+        if (args.size() > 1) {
+            err << "Error: usage mem [budget MB | off]" << std::endl;
+            return false;
         }
+
+        if (args.size() == 1) {
+            if (args[0] == "off") {
+                memBudget = 0;
+            } else if (auto val = toInt(args[0]); val && *val > 0) {
+                memBudget = static_cast<size_t>(*val) << 20;
+            } else {
+                err << "Error: budget must be a positive number of MB or 'off'" << std::endl;
+                return false;
+            }
+            makeRoom(0);
+        }
+
+        auto mb = [](size_t bytes) {
+            std::ostringstream oss;
+            oss << std::fixed << std::setprecision(1) << bytes / 1048576.0 << " MB";
+            return oss.str();
+        };
+
+        size_t spilledTotal = 0;
+
+        out << "Slot  Size           Prec  State      Memory" << std::endl;
+        for (int n = 0; n < N_images; n++) {
+            const ImageData& img = currentImage[n];
+            std::string size = std::to_string(img.width) + "x" + std::to_string(img.height);
+
+            if (pendingLoad[n]) {
+                out << std::left << std::setw(6) << n << std::setw(15) << "?" << std::setw(6) << precision_name(precision[n]) << std::setw(11) << "loading" << "-" << std::endl;
+            } else if (img.isLoaded && img.spilled) {
+                spilledTotal += img.spilledBytes();
+                out << std::left << std::setw(6) << n << std::setw(15) << size << std::setw(6) << precision_name(precision[n]) << std::setw(11) << "spilled" << mb(img.spilledBytes()) << " on disk" << std::endl;
+            } else if (img.isLoaded && img.packed) {
+                std::ostringstream ratio;
+                ratio << std::fixed << std::setprecision(1)
+                      << 100.0 * img.bytes() / (static_cast<double>(img.width) * img.height * sizeof(Triple)) << "%";
+                out << std::left << std::setw(6) << n << std::setw(15) << size << std::setw(6) << precision_name(precision[n]) << std::setw(11) << "packed" << mb(img.bytes())
+                          << " (" << ratio.str() << ")" << std::endl;
+            } else if (img.isLoaded) {
+                out << std::left << std::setw(6) << n << std::setw(15) << size << std::setw(6) << precision_name(precision[n]) << std::setw(11) << (img.is8bit() ? "8-bit" : "resident") << mb(img.bytes())
+                          << (img.pixels.shared() || img.rgb8.shared() ? " (shared)" : "") << std::endl;
+            }
+        }
+        out << std::right;
+
+        out << "Resident: " << mb(residentBytes()) << ", spilled: " << mb(spilledTotal)
+                  << ", budget: " << (memBudget ? mb(memBudget) : "unlimited") << std::endl;
+        return true;
+    }
+
+    // Voronoi regions overlap as rectangles, commands that need whole frames refuse them
+    bool rectangular(const Flags& flags) {
+        if (flags.ft != FRAG_VORONOI) return true;
+        err << "Error: -ft 3 only works with level, filter, clamp, sort and noise" << std::endl;
+        return false;
     }
 
     // Flip
-    void handleFlip(const std::vector<std::string>& args) {
-        std::map<std::string, bool> allowed = {{"-n", true}, {"-s", false}, {"-sx", true}, {"-sy", true}, {"-fr", true}};
-        std::map<std::string, int> catches = parseVector(args, 1, allowed);
-        if (catches["failed"]) return;
-        ImageData& img = currentImage[catches["-n"]];
+    bool handleFlip(const std::vector<std::string>& args) {
+        Flags flags = parseFlags(args, 1, FLAG_N | FLAG_SX | FLAG_SY | FLAG_FR | FLAG_FT, out);
+        if (flags.failed) return false;
+        if (!rectangular(flags)) return false;
+        ImageData& img = slot(flags.n, true);
 
         if (!img.isLoaded) {
-            std::cerr << "Error: No image loaded" << std::endl;
-            return;
+            err << "Error: No image loaded" << std::endl;
+            return false;
         }
         
         std::string direction = "h";
@@ -294,254 +700,846 @@ private:
             direction = args[0];
         }
 
-        int sx = catches["-sx"] ? catches["-sx"] : img.width;
-        int sy = catches["-sy"] ? catches["-sy"] : img.height;
-        int fr = catches["-fr"];
+        int sx = flags.sx ? flags.sx : img.width;
+        int sy = flags.sy ? flags.sy : img.height;
+        int fr = flags.fr;
 
-        std::vector<struct frame> frames;
-        if (fr == 0) {
-            frames = GridFrag(img.height, img.width, sx, sy);
-        }
-        else {
-            frames = nuFrag(img.height, img.width, fr, 0);
-        }
+        std::shared_ptr<const FragPlan> plan = fragPlan(img, sx, sy, fr, flags.ft);
+        const std::vector<struct frame>& frames = plan->frames;
 
 
         
+        if (direction != "h" && direction != "v") {
+            err << "Error: Invalid direction. Use 'h' for 'horizontal' or 'v' for 'vertical'" << std::endl;
+            return false;
+        }
+
+        // 8-bit slots are flipped as bytes
+        if (img.is8bit()) {
+            flipFrames(img.rgb8, frames, direction == "h");
+        } else {
+            flipFrames(img.pixels, frames, direction == "h");
+        }
+
         if (direction == "h") {
+            out << "Image flipped horizontally" << std::endl;
+        } else {
+            out << "Image flipped vertically" << std::endl;
+        }
+        return true;
+    }
+
+    // Mirror every frame, for complex or 8-bit pixels
+    template <typename Buffer>
+    static void flipFrames(Buffer& pixels, const std::vector<struct frame>& frames, bool horizontal) {
+        if (horizontal) {
 
             for (struct frame f : frames){
                 for (int y = 0; y < f.y_size; y++) {
                     for (int x = 0; x < f.x_size / 2; x++) {
                         
-                        std::swap(img.pixels[f.y + y][f.x+ x], img.pixels[f.y + y][f.x + f.x_size - 1 - x]);
+                        std::swap(pixels[f.y + y][f.x+ x], pixels[f.y + y][f.x + f.x_size - 1 - x]);
                     }
                 }
             }
-            
-            std::cout << "Image flipped horizontally" << std::endl;
-        } else if (direction == "v") {
+        } else {
             
             for (struct frame f : frames){
                 for (int x = 0; x < f.x_size; x++) {
                     for (int y = 0; y < f.y_size / 2; y++) {
                         
-                        std::swap(img.pixels[f.y + y][f.x + x], img.pixels[f.y + f.y_size - 1 - y][f.x + x]);
+                        std::swap(pixels[f.y + y][f.x + x], pixels[f.y + f.y_size - 1 - y][f.x + x]);
                     }
                 }
             }
+        }
+    }
 
-            std::cout << "Image flipped vertically" << std::endl;
-        } else {
-            std::cerr << "Error: Invalid direction. Use 'h' for 'horizontal' or 'v' for 'vertical'" << std::endl;
+    // Element-wise commands are built as stages so several can run in one fused pass (see pipe)
+    // Factories only look at the slot, which is promoted from 8-bit when the pass needs it
+    // apply works on count pixels of row y from column x, real says every channel is real before the stage
+    // apply8, when set, does the same on an 8-bit slot whose results are still bytes
+    struct Stage {
+        int n = 0;
+        std::string message;                    // printed once applied, as the command does
+        RealEffect effect = RealEffect::complex;
+        std::function<void(Triple* px, int x, int y, int count, bool real)> apply;
+        std::function<void(RGB8* px, int count)> apply8;
+        bool lutSafe = false;                   // each channel is the same function of its own value, anywhere
+        bool bytesOut = false;                  // every value is a byte afterwards (fit)
+    };
+
+    using StageFactory = std::function<bool(const std::vector<std::string>&, Stage&)>;
+
+    std::map<std::string, StageFactory> stageFactories;
+
+    // Pixels of a row span go through every stage while they are in cache
+    static constexpr int stageTile = 256;
+
+    // Run stages, consecutive ones on the same slot share a single pass over it
+    bool applyStages(const std::vector<Stage>& stages) {
+        size_t first = 0;
+        while (first < stages.size()) {
+            size_t last = first;
+            while (last < stages.size() && stages[last].n == stages[first].n) last++;
+
+            int n = stages[first].n;
+
+            // 8-bit slots stay so if every stage of the pass keeps them bytes,
+            // channel-wise passes on them are mapped through a table
+            bool bytes = view(n, true).is8bit();
+            bool lut = bytes;
+            for (size_t k = first; k < last; k++) {
+                bytes = bytes && stages[k].apply8;
+                lut = lut && stages[k].lutSafe;
+            }
+
+            if (!bytes && lut) {
+                applyLut(stages, first, last);
+                for (size_t k = first; k < last; k++) {
+                    out << stages[k].message << std::endl;
+                }
+                first = last;
+                continue;
+            }
+
+            if (bytes) {
+                ImageData& img = slot(n, true);
+                for (int y = 0; y < img.height; y++) {
+                    RGB8* row = img.rgb8[y];
+                    for (int x = 0; x < img.width; x += stageTile) {
+                        int count = std::min(stageTile, img.width - x);
+                        for (size_t k = first; k < last; k++) stages[k].apply8(row + x, count);
+                    }
+                }
+                for (size_t k = first; k < last; k++) {
+                    out << stages[k].message << std::endl;
+                }
+                first = last;
+                continue;
+            }
+
+            ImageData& img = slot(n);
+
+            // the real-channel state before each stage is known up front
+            std::vector<char> real;
+            int mask = img.realMask;
+            for (size_t k = first; k < last; k++) {
+                real.push_back(mask == 7);
+                mask = realMaskAfter(stages[k].effect, mask);
+            }
+
+            // reduced precision slots are rounded after every stage, as if each ran as its own command
+            Precision p = precision[n];
+
+            for (int y = 0; y < img.height; y++) {
+                Triple* row = img.pixels[y];
+                for (int x = 0; x < img.width; x += stageTile) {
+                    int count = std::min(stageTile, img.width - x);
+                    for (size_t k = first; k < last; k++) {
+                        stages[k].apply(row + x, x, y, count, real[k - first]);
+                        if (p != Precision::f64) round_to_precision(reinterpret_cast<double*>(row + x), 6 * static_cast<size_t>(count), p);
+                    }
+                }
+            }
+            img.realMask = mask;
+
+            // values fitted to bytes go back to 8-bit storage
+            if (stages[last - 1].bytesOut) img.demote();
+
+            for (size_t k = first; k < last; k++) {
+                out << stages[k].message << std::endl;
+            }
+            first = last;
         }
+        return true;
+    }
+
+    // Run the stages [first, last) on an 8-bit slot through a table per channel
+    // The pass is a function of each byte value, so it only runs on the 256 of them
+    void applyLut(const std::vector<Stage>& stages, size_t first, size_t last) {
+        int n = stages[first].n;
+
+        std::vector<Triple> table(256);
+        for (int v = 0; v < 256; v++) {
+            table[v] = {uchar_to_complex(v), uchar_to_complex(v), uchar_to_complex(v)};
+        }
+
+        int mask = 7;
+        for (size_t k = first; k < last; k++) {
+            stages[k].apply(table.data(), 0, 0, 256, mask == 7);
+            mask = realMaskAfter(stages[k].effect, mask);
+            if (precision[n] != Precision::f64) round_to_precision(reinterpret_cast<double*>(table.data()), 6 * table.size(), precision[n]);
+        }
+
+        // results that are bytes keep the slot 8-bit
+        ImageData results;
+        results.allocate(256, 1);
+        std::copy(table.begin(), table.end(), results.pixels.raw());
+        if (results.demote()) {
+            const RGB8* map = results.rgb8.raw();
+            ImageData& img = slot(n, true);
+            RGB8* px = img.rgb8.raw();
+            for (size_t i = 0; i < img.rgb8.size(); i++) {
+                px[i] = {map[px[i][0]][0], map[px[i][1]][1], map[px[i][2]][2]};
+            }
+            return;
+        }
+
+        const ImageData& src = view(n, true);
+        makeRoom(static_cast<size_t>(src.width) * src.height * sizeof(Triple));
+
+        ImageData img;
+        img.allocate(src.width, src.height);
+        const RGB8* in = src.rgb8.raw();
+        Triple* px = img.pixels.raw();
+        for (size_t i = 0; i < src.rgb8.size(); i++) {
+            px[i] = {table[in[i][0]][0], table[in[i][1]][1], table[in[i][2]][2]};
+        }
+        img.realMask = mask;
+        store(n, std::move(img));
+    }
+
+    // Command running a single stage
+    bool handleStage(const std::vector<std::string>& args, const StageFactory& factory) {
+        Stage stage;
+        if (!factory(args, stage)) return false;
+        return applyStages({stage});
     }
 
     // Quantize
-    void handleQuantize(const std::vector<std::string>& args) {
-        std::map<std::string, bool> allowed = {{"-n", true}, {"-s", true}, {"-sx", false}, {"-sy", false}, {"-fr", false}};
-        std::map<std::string, int> catches = parseVector(args, 0, allowed);
-        if (catches["failed"]) return;
-        ImageData& img = currentImage[catches["-n"]];
-        int s = catches["-s"];
+    bool stageQuantize(const std::vector<std::string>& args, Stage& stage) {
+        Flags flags = parseFlags(args, 0, FLAG_N | FLAG_S, out);
+        if (flags.failed) return false;
+        const ImageData& img = view(flags.n, true);
+        int s = flags.s;
 
         if (!img.isLoaded) {
-            std::cerr << "Error: No image loaded" << std::endl;
-            return;
+            err << "Error: No image loaded" << std::endl;
+            return false;
         }
 
         if(s == 0) {
-            std::cerr << "Error: Size not given" << std::endl;
-            return;
-        }
-        
-        for (int y = 0; y < img.height; y++) {
-            for (int x = 0; x < img.width; x++) {
-                img.pixels[y][x][0] = Quantize(img.pixels[y][x][0], s);
-                img.pixels[y][x][1] = Quantize(img.pixels[y][x][1], s);
-                img.pixels[y][x][2] = Quantize(img.pixels[y][x][2], s);
-            }
+            err << "Error: Size not given" << std::endl;
+            return false;
         }
-        
-        std::cout << "Quantized" << std::endl;
+
+        stage.n = flags.n;
+        stage.message = "Quantized";
+        setPixelStage(stage, PF_Quantize{s});
+        return true;
     }
 
     // Apply Cutoff
-    void handleCutoff(const std::vector<std::string>& args) {
-        std::map<std::string, bool> allowed = {{"-n", true}, {"-s", true}, {"-sx", false}, {"-sy", false}, {"-fr", false}};
-        std::map<std::string, int> catches = parseVector(args, 0, allowed);
-        if (catches["failed"]) return;
-        ImageData& img = currentImage[catches["-n"]];
-        int s = catches["-s"];
+    bool stageCutoff(const std::vector<std::string>& args, Stage& stage) {
+        Flags flags = parseFlags(args, 0, FLAG_N | FLAG_S, out);
+        if (flags.failed) return false;
+        const ImageData& img = view(flags.n, true);
+        int s = flags.s;
 
         if (!img.isLoaded) {
-            std::cerr << "Error: No image loaded" << std::endl;
-            return;
+            err << "Error: No image loaded" << std::endl;
+            return false;
         }
 
         if(s == 0) {
-            std::cerr << "Error: Size not given" << std::endl;
-            return;
+            err << "Error: Size not given" << std::endl;
+            return false;
         }
-        
-        for (int y = 0; y < img.height; y++) {
-            for (int x = 0; x < img.width; x++) {
-                img.pixels[y][x][0] = Cutoff(img.pixels[y][x][0], s);
-                img.pixels[y][x][1] = Cutoff(img.pixels[y][x][1], s);
-                img.pixels[y][x][2] = Cutoff(img.pixels[y][x][2], s);
-            }
-        }
-        
-        std::cout << "Cutoff Applied" << std::endl;
+
+        stage.n = flags.n;
+        stage.message = "Cutoff Applied";
+        setPixelStage(stage, PF_Cutoff{s});
+        return true;
     }
 
     // Apply Multiplicative filter
-    void handleFilter(const std::vector<std::string>& args) {
-        std::map<std::string, bool> allowed = {{"-n", true}, {"-s", false}, {"-sx", true}, {"-sy", true}, {"-fr", true}};
-        std::map<std::string, int> catches = parseVector(args, 1, allowed);
-        if (catches["failed"]) return;
-        ImageData& img = currentImage[catches["-n"]];
+    bool stageFilter(const std::vector<std::string>& args, Stage& stage) {
+        Flags flags = parseFlags(args, 1, FLAG_N | FLAG_SX | FLAG_SY | FLAG_FR | FLAG_FT | FLAG_SEED, out);
+        if (flags.failed) return false;
+        const ImageData& img = view(flags.n, true);
 
         if (!img.isLoaded) {
-            std::cerr << "Error: No image loaded" << std::endl;
-            return;
+            err << "Error: No image loaded" << std::endl;
+            return false;
         }
 
         if (args.size() < 1) {
-            std::cerr << "Error: please input filter name" << std::endl;
-            return;
+            err << "Error: please input filter name" << std::endl;
+            return false;
         }
 
 
         if (!hasFilter(args[0])) {
-            std::cerr << "Error: please input valid filter name" << std::endl;
-            return;
+            err << "Error: please input valid filter name" << std::endl;
+            return false;
         }
 
-        FilterFunc filter = getFilter(args[0]);
 
+        int width = img.width;
+        int sx = flags.sx ? flags.sx : img.width;
+        int sy = flags.sy ? flags.sy : img.height;
+        int fr = flags.fr;
+
+        // grid frames need no plan, see FrameCursor
+        std::shared_ptr<const FragPlan> plan;
+        if (fr != 0 || flags.ft != FRAG_RANDOM) plan = fragPlan(img, sx, sy, fr, flags.ft, flags.seed);
+        int height = img.height;
+
+        stage.n = flags.n;
+        stage.message = "Filter Applied";
+        stage.effect = isRealFilter(args[0]) ? RealEffect::keep : RealEffect::complex;
+        visitFilter(args[0], [&](auto filter) {
+            stage.apply = [=](Triple* px, int x0, int y, int count, bool real) {
+                FrameCursor cursor(plan.get(), width, height, sx, sy, x0, y);
 
-        int sx = catches["-sx"] ? catches["-sx"] : img.width;
-        int sy = catches["-sy"] ? catches["-sy"] : img.height;
-        int fr = catches["-fr"];
+                for (int i = 0; i < count; i++) {
+                    int x = x0 + i;
+                    struct frame f;
+                    if (!cursor.at(x, f)) continue;
+
+                    Complex v = filter(((double)(x - f.x)) / f.x_size, ((double)(y - f.y)) / f.y_size);
+
+                    // real filter value on real channels, skip the imaginary work
+                    if (v.imag() == 0 && real) {
+                        px[i][0].real(px[i][0].real() * v.real());
+                        px[i][1].real(px[i][1].real() * v.real());
+                        px[i][2].real(px[i][2].real() * v.real());
+                        continue;
+                    }
+                    px[i][0] = px[i][0] * v;
+                    px[i][1] = px[i][1] * v;
+                    px[i][2] = px[i][2] * v;
+                }
+            };
+        });
+        return true;
+    }
 
-        std::vector<struct frame> frames;
-        if (fr == 0) {
-            frames = GridFrag(img.height, img.width, sx, sy);
+    // Pixel functor stage, the row loop is instantiated for F
+    template <typename F>
+    static void setPixelStage(Stage& stage, F func) {
+        stage.effect = F::effect;
+        stage.lutSafe = F::perChannel;
+        stage.apply = [func](Triple* px, int, int, int count, bool real) {
+            applyPixels(func, px, count, real);
+        };
+        if constexpr (F::hasBytes) {
+            stage.apply8 = [func](RGB8* px, int count) {
+                applyBytes(func, px, count);
+            };
         }
-        else {
-            frames = nuFrag(img.height, img.width, fr, 0);
+    }
+
+    // pixel functions
+    template <typename F>
+    bool stageFunc(const std::vector<std::string>& args, Stage& stage, F func) {
+        Flags flags = parseFlags(args, 0, FLAG_N, out);
+        if (flags.failed) return false;
+        const ImageData& img = view(flags.n, true);
+
+        if (!img.isLoaded) {
+            err << "Error: No image loaded" << std::endl;
+            return false;
         }
 
-        
-        for(struct frame f : frames){
-            for (int y = 0; y < f.y_size; y++) {
-                for (int x = 0; x < f.x_size; x++) {
-                    img.pixels[f.y + y][f.x + x][0] = img.pixels[f.y + y][f.x + x][0] * filter(((double)x) / f.x_size, ((double)y) / f.y_size);
-                    img.pixels[f.y + y][f.x + x][1] = img.pixels[f.y + y][f.x + x][1] * filter(((double)x) / f.x_size, ((double)y) / f.y_size);
-                    img.pixels[f.y + y][f.x + x][2] = img.pixels[f.y + y][f.x + x][2] * filter(((double)x) / f.x_size, ((double)y) / f.y_size);
-                }
+        stage.n = flags.n;
+        stage.message = "Applied pixel function";
+        setPixelStage(stage, func);
+        return true;
+    }
+
+    // pixel functions with a complex constant
+    template <typename F>
+    bool stageFuncComplex(const std::vector<std::string>& args, Stage& stage, F func) {
+        Flags flags = parseFlags(args, 1, FLAG_N, out);
+        if (flags.failed) return false;
+        const ImageData& img = view(flags.n, true);
+
+
+        if (!img.isLoaded) {
+            err << "Error: No image loaded" << std::endl;
+            return false;
+        }
+
+        double a1, a2;
+
+        if (args.size() < 1 || !parsePair(args[0], a1, a2)){
+            err << "Error: please input two doubles (a,b)" << std::endl;
+            return false;
+        }
+
+        Complex c = Complex(a1,a2);
+
+        stage.n = flags.n;
+        stage.message = "Applied pixel function";
+        // a real constant keeps real channels real
+        stage.effect = a2 == 0 ? RealEffect::keep : RealEffect::complex;
+        stage.lutSafe = true;
+        stage.apply = [func, c](Triple* px, int, int, int count, bool) {
+            for (int i = 0; i < count; i++) {
+                func(px[i], c);
             }
+        };
+        return true;
+    }
+
+    // Add noise of strength s drawn from the absolute pixel position, frames only pick the pixels that get it
+    bool stageNoise(const std::vector<std::string>& args, Stage& stage, NoiseType type) {
+        Flags flags = parseFlags(args, 0, FLAG_N | FLAG_S | FLAG_SEED | FLAG_SX | FLAG_SY | FLAG_FR | FLAG_FT, out);
+        if (flags.failed) return false;
+        const ImageData& img = view(flags.n, true);
+
+        if (!img.isLoaded) {
+            err << "Error: No image loaded" << std::endl;
+            return false;
         }
-        
-        std::cout << "Filter Applied" << std::endl;
+
+        if (flags.s == 0) {
+            err << "Error: Size not given" << std::endl;
+            return false;
+        }
+
+        int width = img.width;
+        int height = img.height;
+        int sx = flags.sx ? flags.sx : img.width;
+        int sy = flags.sy ? flags.sy : img.height;
+
+        std::shared_ptr<const FragPlan> plan;
+        if (flags.fr != 0 || flags.ft != FRAG_RANDOM) plan = fragPlan(img, sx, sy, flags.fr, flags.ft, flags.seed);
+
+        // the source keeps the block it last filled, a stage runs on one thread at a time
+        std::shared_ptr<NoiseSource> source = std::make_shared<NoiseSource>(type, flags.s, flags.seed);
+
+        stage.n = flags.n;
+        stage.message = "Noise added";
+        stage.effect = NoiseSource::effect(type);
+        stage.apply = [=](Triple* px, int x0, int y, int count, bool) {
+            FrameCursor cursor(plan.get(), width, height, sx, sy, x0, y);
+
+            for (int i = 0; i < count; i++) {
+                struct frame f;
+                if (!cursor.at(x0 + i, f)) continue;
+                (*source)(px[i], x0 + i, y);
+            }
+        };
+        return true;
     }
 
-    // handle pixel functions
-    void handleFunc(const std::vector<std::string>& args, PixelFunc func) {
-        std::map<std::string, bool> allowed = {{"-n", true}, {"-s", false}, {"-sx", false}, {"-sy", false}, {"-fr", false}};
-        std::map<std::string, int> catches = parseVector(args, 0, allowed);
-        if (catches["failed"]) return;
-        ImageData& img = currentImage[catches["-n"]];
+    // Per-pixel formula, compiled once and run block by block
+    bool stageExpr(const std::vector<std::string>& args, Stage& stage) {
+        Flags flags = parseFlags(args, 1, FLAG_N, out);
+        if (flags.failed) return false;
+        const ImageData& img = view(flags.n, true);
 
         if (!img.isLoaded) {
-            std::cerr << "Error: No image loaded" << std::endl;
-            return;
+            err << "Error: No image loaded" << std::endl;
+            return false;
         }
-        
-        for (int y = 0; y < img.height; y++) {
-            for (int x = 0; x < img.width; x++) {
-                Triple a;
-                a[0] = img.pixels[y][x][0];
-                a[1] = img.pixels[y][x][1];
-                a[2] = img.pixels[y][x][2];
-                a = func(a);
-                img.pixels[y][x][0] = a[0];
-                img.pixels[y][x][1] = a[1];
-                img.pixels[y][x][2] = a[2];
-                
+
+        if (args.size() < 1) {
+            err << "Error: please input a formula" << std::endl;
+            return false;
+        }
+
+        std::shared_ptr<ExprProgram> program = std::make_shared<ExprProgram>();
+        if (!compileExpr(args[0], *program, err)) return false;
+
+        int width = img.width;
+        int height = img.height;
+
+        stage.n = flags.n;
+        stage.message = "Applied expression";
+        stage.effect = program->effect;
+        stage.lutSafe = program->channelWise;
+        stage.apply = [program, width, height](Triple* px, int x, int y, int count, bool real) {
+            runExpr(*program, px, x, y, count, width, height, real);
+        };
+        return true;
+    }
+
+    // Run element-wise commands separated by '|' in one pass, e.g. pipe invert | grayscale | fit
+    bool handlePipe(const std::vector<std::string>& args) {
+        std::vector<Stage> stages;
+        if (!buildStages(args, stages)) return false;
+        return applyStages(stages);
+    }
+
+    // Build the stages of '|' separated element-wise commands, appended to stages
+    bool buildStages(const std::vector<std::string>& args, std::vector<Stage>& stages) {
+        std::vector<std::string> stageArgs;
+
+        for (size_t i = 0; i <= args.size(); i++) {
+            if (i < args.size() && args[i] != "|") {
+                stageArgs.push_back(args[i]);
+                continue;
             }
+            if (stageArgs.empty()) {
+                err << "Error: empty pipe stage" << std::endl;
+                out << "Usage: pipe <command> [args] | <command> [args] | ..." << std::endl;
+                return false;
+            }
+
+            auto it = stageFactories.find(stageArgs[0]);
+            if (it == stageFactories.end()) {
+                err << "Error: " << stageArgs[0] << " is not an element-wise command and cannot be piped" << std::endl;
+                return false;
+            }
+            Stage stage;
+            if (!it->second(std::vector<std::string>(stageArgs.begin() + 1, stageArgs.end()), stage)) return false;
+            stages.push_back(std::move(stage));
+            stageArgs.clear();
         }
-        
-        std::cout << "Applied pixel function" << std::endl;
+        return true;
+    }
+
+    // Run a pipe the compiler merged from several commands as if they ran one after the other:
+    // the commands before one with bad arguments still run, failed is set to the index of the command at fault
+    bool runFused(const Instruction& instr, const std::vector<std::string>& args, int& failed) {
+        std::vector<Stage> stages;
+        for (int k = 0; k < (int) instr.sources.size(); k++) {
+            const FusedSource& source = instr.sources[k];
+            std::vector<Stage> built;
+            if (!buildStages(std::vector<std::string>(args.begin() + source.first, args.begin() + source.last), built)) {
+                failed = k;
+                break;
+            }
+            for (Stage& stage : built) stages.push_back(std::move(stage));
+        }
+
+        if (!stages.empty() && !applyStages(stages)) {
+            failed = 0;
+            return false;
+        }
+        return failed < 0;
     }
 
     // average each block
-    void handleLevel(const std::vector<std::string>& args) {
-        std::map<std::string, bool> allowed = {{"-n", true}, {"-s", false}, {"-sx", true}, {"-sy", true}, {"-fr", true}};
-        std::map<std::string, int> catches = parseVector(args, 0, allowed);
-        if (catches["failed"]) return;
-        ImageData& img = currentImage[catches["-n"]];
+    bool handleLevel(const std::vector<std::string>& args) {
+        Flags flags = parseFlags(args, 0, FLAG_N | FLAG_SX | FLAG_SY | FLAG_FR | FLAG_FT | FLAG_SEED, out);
+        if (flags.failed) return false;
+        ImageData& img = slot(flags.n);
 
         if (!img.isLoaded) {
-            std::cerr << "Error: No image loaded" << std::endl;
-            return;
+            err << "Error: No image loaded" << std::endl;
+            return false;
         }
 
-        int sx = catches["-sx"] ? catches["-sx"] : img.width;
-        int sy = catches["-sy"] ? catches["-sy"] : img.height;
-        int fr = catches["-fr"];
+        int sx = flags.sx ? flags.sx : img.width;
+        int sy = flags.sy ? flags.sy : img.height;
+        int fr = flags.fr;
 
-        std::vector<struct frame> frames;
-        if (fr == 0) {
-            frames = GridFrag(img.height, img.width, sx, sy);
+        std::shared_ptr<const FragPlan> plan = fragPlan(img, sx, sy, fr, flags.ft, flags.seed);
+        const std::vector<struct frame>& frames = plan->frames;
+
+        if (plan->hasRegions()) {
+            const FragRegions& regions = plan->regions;
+            for (int r = 0; r < regions.count(); r++) {
+                levelHelper(img, regions.pixel.data() + regions.start[r], regions.start[r + 1] - regions.start[r]);
+            }
+        } else {
+            for(struct frame f : frames){
+                levelHelper(img, f.x, f.y, f.x_size, f.y_size);
+            }
         }
-        else {
-            frames = nuFrag(img.height, img.width, fr, 0);
+
+        out << "Image Levelled" << std::endl;
+        return true;
+    }
+
+    // Convolve with a named kernel of size s, or with the image of another slot
+    bool handleConv(const std::vector<std::string>& args) {
+        Flags flags = parseFlags(args, 1, FLAG_N | FLAG_S, out);
+        if (flags.failed) return false;
+
+        if (args.size() < 1) {
+            err << "Error: please input a kernel name or slot" << std::endl;
+            return false;
         }
 
-        for(struct frame f : frames){
-            levelHelper(img, f.x, f.y, f.x_size, f.y_size);
+        // the kernel is copied out before the slot is written
+        Kernel kernel;
+        if (auto k = toInt(args[0])) {
+            if (*k < 0 || *k >= N_images || !view(*k, true).isLoaded) {
+                err << "Error: no image loaded in kernel slot " << args[0] << std::endl;
+                return false;
+            }
+            kernel = imageKernel(view(*k, true));
+        } else if (!namedKernel(args[0], flags.s ? flags.s : 3, kernel)) {
+            err << "Error: unknown kernel, use box, gauss, motion, sharpen, laplace, emboss or a slot number" << std::endl;
+            return false;
+        }
+
+        ImageData& img = slot(flags.n);
+
+        if (!img.isLoaded) {
+            err << "Error: No image loaded" << std::endl;
+            return false;
+        }
+
+        ConvPlan plan = planConvolution(img.width, img.height, kernel);
+        convolve(img, kernel, plan);
+
+        out << "Convolved with " << kernel.name << " " << kernel.width << "x" << kernel.height
+            << " (" << describe(plan) << ")" << std::endl;
+        return true;
+    }
+
+    // Gaussian blur of standard deviation s inside each frame
+    bool handleBlur(const std::vector<std::string>& args) {
+        Flags flags = parseFlags(args, 0, FLAG_N | FLAG_S | FLAG_SX | FLAG_SY | FLAG_FR | FLAG_FT, out);
+        if (flags.failed) return false;
+        if (!rectangular(flags)) return false;
+        ImageData& img = slot(flags.n);
+
+        if (!img.isLoaded) {
+            err << "Error: No image loaded" << std::endl;
+            return false;
+        }
+
+        if (flags.s == 0) {
+            err << "Error: Size not given" << std::endl;
+            return false;
+        }
+
+        int sx = flags.sx ? flags.sx : img.width;
+        int sy = flags.sy ? flags.sy : img.height;
+
+        std::shared_ptr<const FragPlan> plan = fragPlan(img, sx, sy, flags.fr, flags.ft);
+        for (const struct frame& f : plan->frames) {
+            recursiveGauss(img, f, flags.s);
+        }
+
+        out << "Image blurred" << std::endl;
+        return true;
+    }
+
+    // Edge-preserving blur of spatial sigma s, pixels whose luminance differs by much more than range are not mixed
+    bool handleBilateral(const std::vector<std::string>& args) {
+        int start = !args.empty() && args[0][0] != '-' ? 1 : 0;
+        Flags flags = parseFlags(args, start, FLAG_N | FLAG_S, out);
+        if (flags.failed) return false;
+
+        double range = 30;
+        if (start) {
+            std::optional<int> val = toInt(args[0]);
+            if (!val || *val <= 0) {
+                err << "Error: range must be a positive integer" << std::endl;
+                return false;
+            }
+            range = *val;
+        }
+
+        ImageData& img = slot(flags.n);
+
+        if (!img.isLoaded) {
+            err << "Error: No image loaded" << std::endl;
+            return false;
+        }
+
+        bilateral(img, flags.s ? flags.s : 16, range);
+        out << "Image smoothed" << std::endl;
+        return true;
+    }
+
+    // Gradient gx + i gy of every channel
+    bool handleGradient(const std::vector<std::string>& args) {
+        int start = !args.empty() && args[0][0] != '-' ? 1 : 0;
+        Flags flags = parseFlags(args, start, FLAG_N, out);
+        if (flags.failed) return false;
+        ImageData& img = slot(flags.n);
+
+        if (!img.isLoaded) {
+            err << "Error: No image loaded" << std::endl;
+            return false;
+        }
+
+        std::string name = start ? args[0] : "sobel";
+        if (name != "sobel" && name != "scharr") {
+            err << "Error: Invalid kernel. Use 'sobel' or 'scharr'" << std::endl;
+            return false;
+        }
+
+        gradient(img, name == "sobel" ? GradientKernel::sobel : GradientKernel::scharr);
+        out << "Gradient computed" << std::endl;
+        return true;
+    }
+
+    // Canny edge map, thresholds on the gradient of the luminance smoothed with sigma s
+    bool handleCanny(const std::vector<std::string>& args) {
+        int start = 0;
+        while (start < (int) args.size() && start < 2 && args[start][0] != '-') start++;
+        Flags flags = parseFlags(args, start, FLAG_N | FLAG_S, out);
+        if (flags.failed) return false;
+
+        double thresholds[2] = {10, 30};
+        for (int i = 0; i < start; i++) {
+            std::optional<int> val = toInt(args[i]);
+            if (!val || *val < 0) {
+                err << "Error: thresholds must be non negative integers" << std::endl;
+                return false;
+            }
+            thresholds[i] = *val;
+        }
+        if (start == 1) thresholds[1] = std::max(thresholds[1], 3 * thresholds[0]);
+        if (thresholds[0] > thresholds[1]) {
+            err << "Error: low threshold above high threshold" << std::endl;
+            return false;
+        }
+
+        // 8-bit slots are read and written as bytes
+        ImageData& img = slot(flags.n, true);
+
+        if (!img.isLoaded) {
+            err << "Error: No image loaded" << std::endl;
+            return false;
+        }
+
+        long long edges = canny(img, flags.s ? flags.s : 1.4, thresholds[0], thresholds[1]);
+        out << "Canny edges: " << edges << " pixels" << std::endl;
+        return true;
+    }
+
+    // Median (rank 50) or rank percent of the window of radius s around each pixel
+    bool handleRank(const std::vector<std::string>& args, bool median) {
+        int start = median ? 0 : 1;
+        if (!median && (args.empty() || args[0][0] == '-')) {
+            err << "Error: Rank not given" << std::endl;
+            return false;
+        }
+        Flags flags = parseFlags(args, start, FLAG_N | FLAG_S | FLAG_Q, out);
+        if (flags.failed) return false;
+
+        double percent = 50;
+        if (!median) {
+            std::optional<int> val = toInt(args[0]);
+            if (!val || *val < 0 || *val > 100) {
+                err << "Error: rank must be a percent between 0 and 100" << std::endl;
+                return false;
+            }
+            percent = *val;
+        }
+
+        if (flags.s == 0) {
+            err << "Error: Size not given" << std::endl;
+            return false;
+        }
+
+        int levels = flags.q ? flags.q : 256;
+        if (levels < 2 || levels > 256) {
+            err << "Error: -q must be between 2 and 256 levels" << std::endl;
+            return false;
+        }
+
+        // 8-bit slots are filtered as bytes
+        ImageData& img = slot(flags.n, true);
+
+        if (!img.isLoaded) {
+            err << "Error: No image loaded" << std::endl;
+            return false;
+        }
+
+        bool complex = !img.is8bit() && !img.isReal();
+        bool exact = rankFilter(img, flags.s, percent, levels);
+        out << "Image filtered";
+        if (!exact) out << ", values quantized to " << levels << " levels";
+        if (complex) out << ", imaginary parts dropped";
+        out << std::endl;
+        return true;
+    }
+
+    // Erode, dilate, open, close or top-hat by a w x h rectangle inside each frame
+    bool handleMorph(const std::vector<std::string>& args, MorphOp op) {
+        int start = 0;
+        while (start < (int) args.size() && start < 2 && args[start][0] != '-') start++;
+        Flags flags = parseFlags(args, start, FLAG_N | FLAG_SX | FLAG_SY | FLAG_FR | FLAG_FT, out);
+        if (flags.failed) return false;
+        if (!rectangular(flags)) return false;
+
+        if (start == 0) {
+            err << "Error: Size not given" << std::endl;
+            return false;
+        }
+        int size[2];
+        for (int i = 0; i < start; i++) {
+            std::optional<int> val = toInt(args[i]);
+            if (!val || *val <= 0) {
+                err << "Error: sizes must be positive integers" << std::endl;
+                return false;
+            }
+            size[i] = *val;
+        }
+        if (start == 1) size[1] = size[0];
+
+        // 8-bit slots are worked on as bytes
+        ImageData& img = slot(flags.n, true);
+
+        if (!img.isLoaded) {
+            err << "Error: No image loaded" << std::endl;
+            return false;
+        }
+
+        int sx = flags.sx ? flags.sx : img.width;
+        int sy = flags.sy ? flags.sy : img.height;
+
+        bool complex = !img.is8bit() && !img.isReal();
+        std::shared_ptr<const FragPlan> plan = fragPlan(img, sx, sy, flags.fr, flags.ft);
+        for (const struct frame& f : plan->frames) {
+            morphology(img, f, op, size[0], size[1]);
         }
 
-        std::cout << "Image Levelled" << std::endl;
+        out << "Morphology done with a " << size[0] << "x" << size[1] << " rectangle";
+        if (complex) out << ", imaginary parts dropped";
+        out << std::endl;
+        return true;
     }
 
     // Apply transform
-    void handleTransform(const std::vector<std::string>& args, TransformFunc func) {
-        std::map<std::string, bool> allowed = {{"-n", true}, {"-s", false}, {"-sx", true}, {"-sy", true}, {"-fr", true}};
-        std::map<std::string, int> catches = parseVector(args, 1, allowed);
-        if (catches["failed"]) return;
-        ImageData& img = currentImage[catches["-n"]];
+    bool handleTransform(const std::vector<std::string>& args, TransformFunc func, RealEffect effect) {
+        Flags flags = parseFlags(args, 1, FLAG_N | FLAG_SX | FLAG_SY | FLAG_FR | FLAG_FT, out);
+        if (flags.failed) return false;
+        if (!rectangular(flags)) return false;
+        ImageData& img = slot(flags.n);
 
         if (!img.isLoaded) {
-            std::cerr << "Error: No image loaded" << std::endl;
-            return;
+            err << "Error: No image loaded" << std::endl;
+            return false;
         }
 
         std::string direction = "horizontal";
         if (!args.empty()) {
             direction = args[0];
         }
-        
-        int sx = catches["-sx"] ? catches["-sx"] : img.width;
-        int sy = catches["-sy"] ? catches["-sy"] : img.height;
-        int fr = catches["-fr"];
 
-        std::vector<struct frame> frames;
-        if (fr == 0) {
-            frames = GridFrag(img.height, img.width, sx, sy);
-        }
-        else {
-            frames = nuFrag(img.height, img.width, fr, 0);
+        if (direction != "h" && direction != "v" && direction != "d") {
+            err << "Error: Invalid direction. Use 'd', 'h' or 'v'" << std::endl;
+            return false;
         }
+        
+        int sx = flags.sx ? flags.sx : img.width;
+        int sy = flags.sy ? flags.sy : img.height;
+        int fr = flags.fr;
+
+        std::shared_ptr<const FragPlan> plan = fragPlan(img, sx, sy, fr, flags.ft);
+        const std::vector<struct frame>& frames = plan->frames;
+
+        transformFrames(img, frames, direction, func);
+        img.realMask = realMaskAfter(effect, img.realMask);
+
+        if (direction == "v")
+            out << "Image transformed along vertical axis" << std::endl;
+        if (direction == "h")
+            out << "Image transformed along horizontal axis" << std::endl;
+        if (direction == "d")
+            out << "Image transformed along both axes" << std::endl;
+        return true;
+    }
 
-        bool flag = false;
-
+    // Transform every strip of each frame
+    void transformFrames(ImageData& img, const std::vector<struct frame>& frames, const std::string& direction, TransformFunc& func) {
         for(struct frame f : frames){
 
             if (direction == "h" || direction == "d") {
-                flag = true;
 
                 for (int x0 = f.x ; x0 < f.x + f.x_size; x0++){
                     
@@ -555,7 +1553,6 @@ private:
             }
 
             if (direction == "v" || direction == "d") {
-                flag = true;
 
                 for (int y0 = f.y ; y0 < f.y + f.y_size; y0++){
 
@@ -568,126 +1565,158 @@ private:
                 }
             }
         }
-
-        if (!flag) {
-            std::cerr << "Error: Invalid direction. Use 'd', 'h' or 'v'" << std::endl;
-        } else {
-            if (direction == "v")
-                std::cout << "Image transformed along vertical axis" << std::endl;
-            if (direction == "h")
-                std::cout << "Image transformed along horizontal axis" << std::endl;
-            if (direction == "d")
-                std::cout << "Image transformed along both axes" << std::endl;
-        }
     }
 
     // Apply clamp
-    void handleClamp(const std::vector<std::string>& args) {
-        std::map<std::string, bool> allowed = {{"-n", true}, {"-s", false}, {"-sx", true}, {"-sy", true}, {"-fr", true}};
-        std::map<std::string, int> catches = parseVector(args, 0, allowed);
-        if (catches["failed"]) return;
-        ImageData& img = currentImage[catches["-n"]];
+    bool handleClamp(const std::vector<std::string>& args) {
+        Flags flags = parseFlags(args, 0, FLAG_N | FLAG_SX | FLAG_SY | FLAG_FR | FLAG_FT | FLAG_SEED, out);
+        if (flags.failed) return false;
+        ImageData& img = slot(flags.n);
 
         if (!img.isLoaded) {
-            std::cerr << "Error: No image loaded" << std::endl;
-            return;
+            err << "Error: No image loaded" << std::endl;
+            return false;
         }
 
-        int sx = catches["-sx"] ? catches["-sx"] : img.width;
-        int sy = catches["-sy"] ? catches["-sy"] : img.height;
-        int fr = catches["-fr"];
+        int sx = flags.sx ? flags.sx : img.width;
+        int sy = flags.sy ? flags.sy : img.height;
+        int fr = flags.fr;
 
-        std::vector<struct frame> frames;
-        if (fr == 0) {
-            frames = GridFrag(img.height, img.width, sx, sy);
+        std::shared_ptr<const FragPlan> plan = fragPlan(img, sx, sy, fr, flags.ft, flags.seed);
+        const std::vector<struct frame>& frames = plan->frames;
+        
+        bool real = img.isReal();
+        if (plan->hasRegions()) {
+            const FragRegions& regions = plan->regions;
+            for (int r = 0; r < regions.count(); r++) {
+                clampRegion(real, [&](auto fn) {
+                    for (int i = regions.start[r]; i < regions.start[r + 1]; i++) {
+                        fn(img.pixels[regions.pixel[i] / img.width][regions.pixel[i] % img.width]);
+                    }
+                });
+            }
+        } else {
+            for(struct frame f : frames){
+                clampRegion(real, [&](auto fn) {
+                    for (int y = f.y; y < f.y + f.y_size; y++) {
+                        for (int x = f.x; x < f.x + f.x_size; x++) fn(img.pixels[y][x]);
+                    }
+                });
+            }
         }
-        else {
-            frames = nuFrag(img.height, img.width, fr, 0);
+
+        out << "Image clamped" << std::endl;
+        return true;
+    }
+
+    // Scale each channel of a frame or region so its largest magnitude is at most 255
+    // forEach(fn) calls fn on every pixel, real channels need no complex magnitude
+    template <typename ForEach>
+    static void clampRegion(bool real, ForEach forEach) {
+        double maxAbs[3] = {255.0, 255.0, 255.0};
+
+        if (real) {
+            forEach([&](Triple& a) {
+                for (int c = 0; c < 3; c++) maxAbs[c] = std::max(maxAbs[c], std::fabs(a[c].real()));
+            });
+            forEach([&](Triple& a) {
+                for (int c = 0; c < 3; c++) a[c].real(a[c].real() / maxAbs[c] * 255.0);
+            });
+            return;
         }
-        
-        for(struct frame f : frames){
 
-            double maxAbs[3] = {255.0, 255.0, 255.0};
+        forEach([&](Triple& a) {
+            for (int c = 0; c < 3; c++) maxAbs[c] = std::max(maxAbs[c], std::abs(a[c]));
+        });
+        forEach([&](Triple& a) {
+            for (int c = 0; c < 3; c++) {
+                if (maxAbs[c] != 0.0) a[c] = a[c] / maxAbs[c] * 255.0;
+            }
+        });
+    }
+
+    // Sort every channel along each run of pixels sharing a column (or a row), order lists the pixels as y * width + x
+    static void sortRuns(ImageData& img, const std::vector<int>& order, bool columns, SortFunc func) {
+        auto line = [&img, columns](int p) { return columns ? p % img.width : p / img.width; };
+        std::vector<Complex> strip;
 
-                for (int y = f.y; y < f.y + f.y_size; y++) {
-                    for (int x = f.x; x < f.x + f.x_size; x++) {
-                        for (int c = 0; c < 3; c++) {
-                            maxAbs[c] = std::max(maxAbs[c], std::abs(img.pixels[y][x][c]));
-                        }
-                    }
-                }
+        for (size_t begin = 0, end = 0; begin < order.size(); begin = end) {
+            while (end < order.size() && line(order[end]) == line(order[begin])) end++;
 
-                for (int y = f.y; y < f.y + f.y_size; y++) {
-                    for (int x = f.x; x < f.x + f.x_size; x++) {
-                        for (int c = 0; c < 3; c++) {
-                            if (maxAbs[c] != 0.0) {
-                                img.pixels[y][x][c] =
-                                    img.pixels[y][x][c] / maxAbs[c] * 255.0;
-                            }
-                        }
-                    }
-                }
+            for (int color = 0; color < 3; color++) {
+                strip.clear();
+                for (size_t i = begin; i < end; i++) strip.push_back(img.pixels[order[i] / img.width][order[i] % img.width][color]);
+                std::sort(strip.begin(), strip.end(), func);
+                for (size_t i = begin; i < end; i++) img.pixels[order[i] / img.width][order[i] % img.width][color] = strip[i - begin];
+            }
         }
-
-        std::cout << "Image clamped" << std::endl;
     }
 
     // Apply sort (breaks up pixels)
-    void handleSortDisjoint(const std::vector<std::string>& args, SortFunc func) {
-        std::map<std::string, bool> allowed = {{"-n", true}, {"-s", false}, {"-sx", true}, {"-sy", true}, {"-fr", true}};
-        std::map<std::string, int> catches = parseVector(args, 1, allowed);
-        if (catches["failed"]) return;
-        ImageData& img = currentImage[catches["-n"]];
+    bool handleSortDisjoint(const std::vector<std::string>& args, SortFunc func) {
+        Flags flags = parseFlags(args, 1, FLAG_N | FLAG_SX | FLAG_SY | FLAG_FR | FLAG_FT | FLAG_SEED, out);
+        if (flags.failed) return false;
+        ImageData& img = slot(flags.n);
 
         if (!img.isLoaded) {
-            std::cerr << "Error: No image loaded" << std::endl;
-            return;
+            err << "Error: No image loaded" << std::endl;
+            return false;
         }
 
         std::string direction = "horizontal";
         if (!args.empty()) {
             direction = args[0];
         }
-        int sx = catches["-sx"] ? catches["-sx"] : img.width;
-        int sy = catches["-sy"] ? catches["-sy"] : img.height;
-        int fr = catches["-fr"];
+        int sx = flags.sx ? flags.sx : img.width;
+        int sy = flags.sy ? flags.sy : img.height;
+        int fr = flags.fr;
 
-        std::vector<struct frame> frames;
-        if (fr == 0) {
-            frames = GridFrag(img.height, img.width, sx, sy);
-        }
-        else {
-            frames = nuFrag(img.height, img.width, fr, 0);
-        }
+        std::shared_ptr<const FragPlan> plan = fragPlan(img, sx, sy, fr, flags.ft, flags.seed);
+        const std::vector<struct frame>& frames = plan->frames;
 
         bool flag = false;
 
-        for(struct frame f : frames){
+        if (plan->hasRegions()) {
+            flag = direction == "h" || direction == "v" || direction == "d";
+            const FragRegions& regions = plan->regions;
+            for (int r = 0; r < regions.count(); r++) {
+                // the region's pixels in reading order are already grouped by row
+                std::vector<int> rows(regions.pixel.begin() + regions.start[r], regions.pixel.begin() + regions.start[r + 1]);
+                if (direction == "h" || direction == "d") {
+                    std::vector<int> columns = rows;
+                    std::stable_sort(columns.begin(), columns.end(), [&img](int a, int b) { return a % img.width < b % img.width; });
+                    sortRuns(img, columns, true, func);
+                }
+                if (direction == "v" || direction == "d") sortRuns(img, rows, false, func);
+            }
+        } else {
+            for(struct frame f : frames){
 
-            if (direction == "h" || direction == "d") {
-                flag = true;
+                if (direction == "h" || direction == "d") {
+                    flag = true;
 
-                for (int x0 = f.x ; x0 < f.x + f.x_size; x0++){
+                    for (int x0 = f.x ; x0 < f.x + f.x_size; x0++){
                     
-                    for (int color = 0; color < 3; color++){
-                        std::vector<Complex> strip(f.y_size);
-                        for (int i = 0; i < f.y_size; i++) strip[i] = img.pixels[f.y + i][x0][color];
-                        std::sort(strip.begin(), strip.end(), func);
-                        for (int i = 0; i < f.y_size; i++) img.pixels[f.y + i][x0][color] = strip[i];
+                        for (int color = 0; color < 3; color++){
+                            std::vector<Complex> strip(f.y_size);
+                            for (int i = 0; i < f.y_size; i++) strip[i] = img.pixels[f.y + i][x0][color];
+                            std::sort(strip.begin(), strip.end(), func);
+                            for (int i = 0; i < f.y_size; i++) img.pixels[f.y + i][x0][color] = strip[i];
+                        }
                     }
                 }
-            }
 
-            if (direction == "v" || direction == "d") {
-                flag = true;
+                if (direction == "v" || direction == "d") {
+                    flag = true;
 
-                for (int y0 = f.y ; y0 < f.y + f.y_size; y0++){
+                    for (int y0 = f.y ; y0 < f.y + f.y_size; y0++){
 
-                    for (int color = 0; color < 3; color++){
-                        std::vector<Complex> strip(f.x_size);
-                        for (int i = 0; i < f.x_size; i++) strip[i] = img.pixels[y0][f.x + i][color];
-                        std::sort(strip.begin(), strip.end(), func);
-                        for (int i = 0; i < f.x_size; i++) img.pixels[y0][f.x + i][color] = strip[i];
+                        for (int color = 0; color < 3; color++){
+                            std::vector<Complex> strip(f.x_size);
+                            for (int i = 0; i < f.x_size; i++) strip[i] = img.pixels[y0][f.x + i][color];
+                            std::sort(strip.begin(), strip.end(), func);
+                            for (int i = 0; i < f.x_size; i++) img.pixels[y0][f.x + i][color] = strip[i];
+                        }
                     }
                 }
             }
@@ -695,46 +1724,42 @@ private:
 
         
         if (!flag) {
-            std::cerr << "Error: Invalid direction. Use 'd', 'h' or 'v'" << std::endl;
+            err << "Error: Invalid direction. Use 'd', 'h' or 'v'" << std::endl;
+            return false;
         }
         else {
-            if ( direction == "v") std::cout << "Image sorted along vertical axis" << std::endl;
-            if ( direction == "h") std::cout << "Image sorted along horizontal axis" << std::endl;
-            if ( direction == "d") std::cout << "Image sorted along both axes" << std::endl;
+            if ( direction == "v") out << "Image sorted along vertical axis" << std::endl;
+            if ( direction == "h") out << "Image sorted along horizontal axis" << std::endl;
+            if ( direction == "d") out << "Image sorted along both axes" << std::endl;
         }
+        return true;
     }
     
     // Apply warp
-    void handleWarp(const std::vector<std::string>& args, WarpFunc invFunc) {
-        std::map<std::string, bool> allowed = {{"-n", true}, {"-s", true}, {"-sx", true}, {"-sy", true}, {"-fr", true}};
-        std::map<std::string, int> catches = parseVector(args, 0, allowed);
-        if (catches["failed"]) return;
-        ImageData& img = currentImage[catches["-n"]];
+    template <typename Warp>
+    bool handleWarp(const std::vector<std::string>& args, Warp invFunc) {
+        Flags flags = parseFlags(args, 0, FLAG_N | FLAG_S | FLAG_SX | FLAG_SY | FLAG_FR | FLAG_FT, out);
+        if (flags.failed) return false;
+        if (!rectangular(flags)) return false;
+        ImageData& img = slot(flags.n);
 
         if (!img.isLoaded) {
-            std::cerr << "Error: No image loaded" << std::endl;
-            return;
+            err << "Error: No image loaded" << std::endl;
+            return false;
         }
 
-        int sx = catches["-sx"] ? catches["-sx"] : img.width;
-        int sy = catches["-sy"] ? catches["-sy"] : img.height;
-        int s = catches["-s"] ? catches["-s"] : 0;
-        int fr = catches["-fr"];
+        int sx = flags.sx ? flags.sx : img.width;
+        int sy = flags.sy ? flags.sy : img.height;
+        int s = flags.s ? flags.s : 0;
+        int fr = flags.fr;
 
-        std::vector<struct frame> frames;
-        if (fr == 0) {
-            frames = GridFrag(img.height, img.width, sx, sy);
-        }
-        else {
-            frames = nuFrag(img.height, img.width, fr, 0);
-        }
+        std::shared_ptr<const FragPlan> plan = fragPlan(img, sx, sy, fr, flags.ft);
+        const std::vector<struct frame>& frames = plan->frames;
 
         int fx, fy, fx1, fy1;
         double nx, ny, rx, ry;
-        std::vector<std::vector<std::array<Complex,3>>> newPixels(
-            img.height,
-            std::vector<std::array<Complex,3>>(img.width)
-        );
+        PixelBuffer newPixels;
+        newPixels.allocate(img.width, img.height);
         
         for(struct frame f : frames){
 
@@ -785,100 +1810,59 @@ private:
             }
         }
 
-        for (int y = 0; y < img.height; y++) {
-            for (int x = 0; x < img.width; x++) {
-                
-                img.pixels[y][x][0] = newPixels[y][x][0];
-                img.pixels[y][x][1] = newPixels[y][x][1];
-                img.pixels[y][x][2] = newPixels[y][x][2];
-            }
-        }
+        img.pixels = std::move(newPixels);
         
-        std::cout << "Applied warp function" << std::endl;
+        out << "Applied warp function" << std::endl;
+        return true;
     }
     
-    // Apply func with complex input
-    void handleFuncComplex(const std::vector<std::string>& args, PixelFuncComplex func) {
-        std::map<std::string, bool> allowed = {{"-n", true}, {"-s", false}, {"-sx", false}, {"-sy", false}, {"-fr", false}};
-        std::map<std::string, int> catches = parseVector(args, 1, allowed);
-        if (catches["failed"]) return;
-        ImageData& img = currentImage[catches["-n"]];
-
-
-        if (!img.isLoaded) {
-            std::cerr << "Error: No image loaded" << std::endl;
-            return;
-        }
-
-        double a1, a2;
-
-        if (args.size() < 1 || !parsePair(args[0], a1, a2)){
-            std::cerr << "Error: please input two doubles (a,b)" << std::endl;
-            return;
-        }
-
-        Complex c = Complex(a1,a2);
-        
-        for (int y = 0; y < img.height; y++) {
-            for (int x = 0; x < img.width; x++) {
-                Triple a;
-                a[0] = img.pixels[y][x][0];
-                a[1] = img.pixels[y][x][1];
-                a[2] = img.pixels[y][x][2];
-                a = func(a,c);
-                img.pixels[y][x][0] = a[0];
-                img.pixels[y][x][1] = a[1];
-                img.pixels[y][x][2] = a[2];
-                
-            }
-        }
-        
-        std::cout << "Applied pixel function" << std::endl;
-    }
-
     // Apply descartian function
-    void handleDescartian(const std::vector<std::string>& args, TwoPixelFunc func) {
-        std::map<std::string, bool> allowed = {{"-n", false}, {"-s", false}, {"-sx", false}, {"-sy", false}, {"-fr", false}};
-        std::map<std::string, int> catches = parseVector(args, 1, allowed);
-        if (catches["failed"]) return;
+    template <typename F>
+    bool handleDescartian(const std::vector<std::string>& args, F func) {
+        Flags flags = parseFlags(args, 1, 0, out);
+        if (flags.failed) return false;
 
 
 
         int n1, n2, n3;
 
         if (args.size() < 1 || !parseTripleInt(args[0], n1, n2, n3)) {
-            std::cerr << "Error: please input integers (n1,n2,n3)" << std::endl;
-            return;
+            err << "Error: please input integers (n1,n2,n3)" << std::endl;
+            return false;
         }
 
         if (n1 >= N_images || n2 >= N_images || n3 >= N_images) {
-            std::cerr << "Error: each of (n1,n2,n3) must be less than 16" << std::endl;
-            return;
+            err << "Error: each of (n1,n2,n3) must be less than 16" << std::endl;
+            return false;
         }
 
         if (n1 < 0 || n2 < 0 || n3 < 0) {
-            std::cerr << "Error: each of (n1,n2,n3) must be more than 0" << std::endl;
-            return;
+            err << "Error: each of (n1,n2,n3) must be more than 0" << std::endl;
+            return false;
         }
+
+        ImageData wide1, wide2;
+        const ImageData& img1 = viewComplex(n1, wide1);
+        const ImageData& img2 = viewComplex(n2, wide2);
         
 
-        if (!currentImage[n1].isLoaded) {
-            std::cerr << "Error: No image loaded for n1" << std::endl;
-            return;
+        if (!img1.isLoaded) {
+            err << "Error: No image loaded for n1" << std::endl;
+            return false;
         }
 
-        if (!currentImage[n2].isLoaded) {
-            std::cerr << "Error: No image loaded for n2" << std::endl;
-            return;
+        if (!img2.isLoaded) {
+            err << "Error: No image loaded for n2" << std::endl;
+            return false;
         }
 
-        if (currentImage[n1].height != currentImage[n2].height || currentImage[n1].width != currentImage[n2].width) {
-            std::cerr << "Error: sizes for n1 and n2 do not match" << std::endl;
-            return;
+        if (img1.height != img2.height || img1.width != img2.width) {
+            err << "Error: sizes for n1 and n2 do not match" << std::endl;
+            return false;
         }
 
-        int width = currentImage[n1].width;
-        int height = currentImage[n1].height;
+        int width = img1.width;
+        int height = img1.height;
 
         ImageData img;
 
@@ -886,74 +1870,67 @@ private:
 
         
         for (int y = 0; y < height; y++) {
+            const Triple* row1 = img1.pixels[y];
+            const Triple* row2 = img2.pixels[y];
+            Triple* row3 = img.pixels[y];
             for (int x = 0; x < width; x++) {
-                Triple a1, a2, a3;
-                
-                a1[0] = currentImage[n1].pixels[y][x][0];
-                a1[1] = currentImage[n1].pixels[y][x][1];
-                a1[2] = currentImage[n1].pixels[y][x][2];
-                
-                a2[0] = currentImage[n2].pixels[y][x][0];
-                a2[1] = currentImage[n2].pixels[y][x][1];
-                a2[2] = currentImage[n2].pixels[y][x][2];
-
-                a3 = func(a1, a2);
-
-                img.pixels[y][x][0] = a3[0];
-                img.pixels[y][x][1] = a3[1];
-                img.pixels[y][x][2] = a3[2];
-                
+                row3[x] = func(row1[x], row2[x]);
             }
         }
 
-        currentImage[n3] = img;
+        img.realMask = img1.realMask & img2.realMask;
+        store(n3, std::move(img));
         
-        std::cout << "Applied descartian function" << std::endl;
+        out << "Applied descartian function" << std::endl;
+        return true;
     }
 
     // Apply matrix multiplication
-    void handleMatMul(const std::vector<std::string>& args) {
-        std::map<std::string, bool> allowed = {{"-n", false}, {"-s", false}, {"-sx", false}, {"-sy", false}, {"-fr", false}};
-        std::map<std::string, int> catches = parseVector(args, 1, allowed);
-        if (catches["failed"]) return;
+    bool handleMatMul(const std::vector<std::string>& args) {
+        Flags flags = parseFlags(args, 1, 0, out);
+        if (flags.failed) return false;
 
 
 
         int n1, n2, n3;
 
         if (args.size() < 1 || !parseTripleInt(args[0], n1, n2, n3)) {
-            std::cerr << "Error: please input integers (n1,n2,n3)" << std::endl;
-            return;
+            err << "Error: please input integers (n1,n2,n3)" << std::endl;
+            return false;
         }
 
         if (n1 >= N_images || n2 >= N_images || n3 >= N_images) {
-            std::cerr << "Error: each of (n1,n2,n3) must be less than 16" << std::endl;
-            return;
+            err << "Error: each of (n1,n2,n3) must be less than 16" << std::endl;
+            return false;
         }
 
         if (n1 < 0 || n2 < 0 || n3 < 0) {
-            std::cerr << "Error: each of (n1,n2,n3) must be more than 0" << std::endl;
-            return;
+            err << "Error: each of (n1,n2,n3) must be more than 0" << std::endl;
+            return false;
         }
+
+        ImageData wide1, wide2;
+        const ImageData& img1 = viewComplex(n1, wide1);
+        const ImageData& img2 = viewComplex(n2, wide2);
         
 
-        if (!currentImage[n1].isLoaded) {
-            std::cerr << "Error: No image loaded for n1" << std::endl;
-            return;
+        if (!img1.isLoaded) {
+            err << "Error: No image loaded for n1" << std::endl;
+            return false;
         }
 
-        if (!currentImage[n2].isLoaded) {
-            std::cerr << "Error: No image loaded for n2" << std::endl;
-            return;
+        if (!img2.isLoaded) {
+            err << "Error: No image loaded for n2" << std::endl;
+            return false;
         }
 
-        if (currentImage[n2].height != currentImage[n1].width) {
-            std::cerr << "Error: width of [n1] and height of [n2] do not match for matrix multiplication" << std::endl;
-            return;
+        if (img2.height != img1.width) {
+            err << "Error: width of [n1] and height of [n2] do not match for matrix multiplication" << std::endl;
+            return false;
         }
 
-        int width = currentImage[n2].width;
-        int height = currentImage[n1].height;
+        int width = img2.width;
+        int height = img1.height;
 
         ImageData img;
 
@@ -965,17 +1942,346 @@ private:
             for (int j = 0; j < width; ++j) {
                 for (int c = 0; c < 3; ++c) {
                     Complex sum = 0.0;
-                    for (int k = 0; k < currentImage[n1].width; ++k) {
-                        sum += currentImage[n1].pixels[i][k][c] * currentImage[n2].pixels[k][j][c];
+                    for (int k = 0; k < img1.width; ++k) {
+                        sum += img1.pixels[i][k][c] * img2.pixels[k][j][c];
                     }
                     img.pixels[i][j][c] = sum;
                 }
             }
         }
 
-        currentImage[n3] = img;
+        img.realMask = img1.realMask & img2.realMask;
+        store(n3, std::move(img));
         
-        std::cout << "Applied Matrix Multiplication function" << std::endl;
+        out << "Applied Matrix Multiplication function" << std::endl;
+        return true;
+    }
+    
+    // Set the precision that one slot (-n) or all of them are rounded to
+    bool handlePrecision(const std::vector<std::string>& args) {
+        Flags flags = parseFlags(args, 1, FLAG_N, out);
+        if (flags.failed) return false;
+
+        if (args.empty()) {
+            for (int n = 0; n < N_images; n++) {
+                out << "  " << n << ": " << precision_name(precision[n]) << std::endl;
+            }
+            return true;
+        }
+
+        std::optional<Precision> p = toPrecision(args[0]);
+        if (!p) {
+            err << "Error: precision must be f64, f32 or f16" << std::endl;
+            return false;
+        }
+
+        bool single = std::find(args.begin(), args.end(), "-n") != args.end();
+        for (int n = 0; n < N_images; n++) {
+            if (single && n != flags.n) continue;
+            precision[n] = *p;
+            // existing pixels are rounded after the command
+            dirty[n] = currentImage[n].isLoaded;
+        }
+
+        if (single) {
+            out << "Slot " << flags.n << " rounded to " << args[0] << std::endl;
+        } else {
+            out << "All slots rounded to " << args[0] << std::endl;
+        }
+        return true;
+    }
+
+    // Set how many idle commands pass before a slot is compressed in the background
+    bool handleCompress(const std::vector<std::string>& args) {
+        if (args.size() > 1) {
+            err << "Error: usage compress [idle commands | off]" << std::endl;
+            return false;
+        }
+
+        if (args.size() == 1) {
+            if (args[0] == "off") {
+                packAfter = 0;
+            } else if (auto val = toInt(args[0]); val && *val > 0) {
+                packAfter = *val;
+            } else {
+                err << "Error: please input a positive number of commands or 'off'" << std::endl;
+                return false;
+            }
+        }
+
+        if (packAfter == 0) {
+            out << "Idle slot compression is off" << std::endl;
+        } else {
+            out << "Slots idle for " << packAfter << " commands are compressed" << std::endl;
+        }
+        return true;
+    }
+
+    // Duplicate a slot, the pixels are shared until one of the two is modified
+    bool handleDup(const std::vector<std::string>& args) {
+        Flags flags = parseFlags(args, 1, 0, out);
+        if (flags.failed) return false;
+
+        int n1, n2;
+
+        if (args.size() < 1 || !parseDoubleInt(args[0], n1, n2)) {
+            err << "Error: please input integers (n1,n2)" << std::endl;
+            return false;
+        }
+
+        if (n1 < 0 || n2 < 0 || n1 >= N_images || n2 >= N_images) {
+            err << "Error: each of (n1,n2) must be between 0 and 15" << std::endl;
+            return false;
+        }
+
+        if (!view(n1, true).isLoaded) {
+            err << "Error: No image loaded for n1" << std::endl;
+            return false;
+        }
+
+        if (n1 != n2) store(n2, view(n1, true));
+
+        out << "Duplicated image" << std::endl;
+        return true;
+    }
+
+    // One image travelling through the batch pipeline
+    struct BatchItem {
+        std::string input;
+        std::string output;
+        ImageData image;
+        bool ok = false;
+        std::string messages;                   // output of the stage that failed
+        std::chrono::steady_clock::time_point start;
+        double readMs = 0;
+        double processMs = 0;
+        double writeMs = 0;
+        double totalMs = 0;
+    };
+
+    // Run a program on img in slot 0 of a fresh state, slot 0 holds the result
+    bool processImage(const Program& program, ImageData& img) {
+        reset();
+        store(0, std::move(img));
+
+        bool ok = runProgram(program);
+        syncIO();
+        if (ioFailed) ok = false;
+        if (ok) img = view(0, true);
+        return ok;
+    }
+
+    // Compile a script file and run it on the current slots
+    bool handleRun(const std::vector<std::string>& args) {
+        if (args.size() != 1) {
+            err << "Error: Please specify a script to run" << std::endl;
+            out << "Usage: run <script.nl>" << std::endl;
+            return false;
+        }
+
+        std::optional<std::string> script = readScript(args[0]);
+        Program program;
+        if (!script || !compile(*script, args[0], program)) return false;
+        return runProgram(program);
+    }
+
+    // Stream every file matching the pattern through load -> script -> save
+    // Each stage runs on its own threads with bounded queues in between, so at most
+    // about three images per worker are held in memory whatever the number of files
+    bool handleBatch(const std::vector<std::string>& args) {
+        if (args.size() < 3 || args.size() > 4) {
+            err << "Error: batch takes a pattern, a script and an output directory" << std::endl;
+            out << "Usage: batch <pattern> <script.nl> <outdir> [workers]" << std::endl;
+            return false;
+        }
+
+        int workers = std::max(1u, std::thread::hardware_concurrency());
+        if (args.size() == 4) {
+            std::optional<int> val = toInt(args[3]);
+            if (!val || *val < 1) {
+                err << "Error: workers must be a positive number" << std::endl;
+                return false;
+            }
+            workers = *val;
+        }
+
+        std::optional<std::string> script = readScript(args[1]);
+        Program program;
+        if (!script || !compile(*script, args[1], program)) return false;
+
+        std::error_code ec;
+        if (!std::filesystem::is_directory(args[2], ec)) {
+            err << "Error: Output directory " << args[2] << " does not exist" << std::endl;
+            return false;
+        }
+
+        glob_t matches;
+        if (glob(args[0].c_str(), 0, nullptr, &matches) != 0) {
+            globfree(&matches);
+            err << "Error: No files match " << args[0] << std::endl;
+            return false;
+        }
+        std::vector<std::string> files(matches.gl_pathv, matches.gl_pathv + matches.gl_pathc);
+        globfree(&matches);
+
+        // outputs keep the input names, two inputs with the same name would overwrite each other
+        std::vector<std::string> outputs;
+        std::map<std::string, std::string> sources;
+        for (const std::string& file : files) {
+            std::string output = (std::filesystem::path(args[2]) / std::filesystem::path(file).filename()).string();
+            auto [it, added] = sources.emplace(output, file);
+            if (!added) {
+                err << "Error: " << it->second << " and " << file << " would both be saved as " << output << std::endl;
+                return false;
+            }
+            outputs.push_back(output);
+        }
+
+        using Clock = std::chrono::steady_clock;
+        auto msSince = [](Clock::time_point t) {
+            return std::chrono::duration<double, std::milli>(Clock::now() - t).count();
+        };
+
+        BoundedQueue<std::shared_ptr<BatchItem>> loaded(workers);
+        BoundedQueue<std::shared_ptr<BatchItem>> processed(workers);
+        std::atomic<int> activeWorkers{workers};
+        std::vector<std::shared_ptr<BatchItem>> done;
+
+        Clock::time_point start = Clock::now();
+        {
+            ThreadPool pool(workers + 2);
+
+            // every stage closes its queue even if it throws, so the next stages and the pool never wait forever
+            pool.submit([&] {
+                try {
+                    for (size_t i = 0; i < files.size(); i++) {
+                        std::shared_ptr<BatchItem> item = std::make_shared<BatchItem>();
+                        item->input = files[i];
+                        item->output = outputs[i];
+                        item->start = Clock::now();
+
+                        try {
+                            std::ostringstream loadOut;
+                            std::ostringstream loadErr;
+                            item->ok = loadBMP(files[i], item->image, loadOut, loadErr);
+                            if (!item->ok) item->messages = loadErr.str();
+                        } catch (const std::exception& e) {
+                            item->image.clear();
+                            item->ok = false;
+                            item->messages = std::string("Error: ") + e.what() + "\n";
+                        }
+                        item->readMs = msSince(item->start);
+                        loaded.push(std::move(item));
+                    }
+                } catch (...) {
+                }
+                loaded.close();
+            });
+
+            for (int w = 0; w < workers; w++) {
+                pool.submit([&] {
+                    // each worker keeps a quiet CLI with the script compiled against its own commands
+                    std::ostringstream scriptOut;
+                    std::ostringstream scriptErr;
+                    std::unique_ptr<CLI> worker;
+                    Program workerProgram;
+                    std::string failure;
+                    try {
+                        worker = std::make_unique<CLI>(scriptOut, scriptErr);
+                        worker->packAfter = 0;
+                        if (!worker->compile(*script, args[1], workerProgram)) failure = scriptErr.str();
+                    } catch (const std::exception& e) {
+                        failure = std::string("Error: ") + e.what() + "\n";
+                    }
+
+                    // a worker that cannot run the script still drains its share of the images
+                    while (std::optional<std::shared_ptr<BatchItem>> next = loaded.pop()) {
+                        std::shared_ptr<BatchItem> item = std::move(*next);
+                        if (item->ok && !failure.empty()) {
+                            item->ok = false;
+                            item->messages = failure;
+                        } else if (item->ok) {
+                            Clock::time_point t = Clock::now();
+                            scriptOut.str("");
+                            scriptErr.str("");
+                            try {
+                                item->ok = worker->processImage(workerProgram, item->image);
+                                if (!item->ok) item->messages = scriptOut.str() + scriptErr.str();
+                            } catch (const std::exception& e) {
+                                item->ok = false;
+                                item->messages = std::string("Error: ") + e.what() + "\n";
+                            }
+                            item->processMs = msSince(t);
+                        }
+                        if (!item->ok) item->image.clear();
+                        processed.push(std::move(item));
+                    }
+                    if (--activeWorkers == 0) processed.close();
+                });
+            }
+
+            pool.submit([&] {
+                while (std::optional<std::shared_ptr<BatchItem>> next = processed.pop()) {
+                    std::shared_ptr<BatchItem> item = std::move(*next);
+                    if (item->ok) {
+                        Clock::time_point t = Clock::now();
+                        try {
+                            std::ostringstream saveOut;
+                            std::ostringstream saveErr;
+                            item->ok = saveBMP(item->output, item->image, saveOut, saveErr);
+                            if (!item->ok) item->messages = saveErr.str();
+                        } catch (const std::exception& e) {
+                            item->ok = false;
+                            item->messages = std::string("Error: ") + e.what() + "\n";
+                        }
+                        item->writeMs = msSince(t);
+                    }
+                    item->image.clear();
+                    item->totalMs = msSince(item->start);
+                    done.push_back(std::move(item));
+                }
+            });
+        }
+        double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+        // Report
+        int failed = 0;
+        for (const std::shared_ptr<BatchItem>& item : done) {
+            if (item->ok) continue;
+            failed++;
+            err << "Failed: " << item->input << std::endl << item->messages;
+        }
+
+        auto stage = [&](const char* name, double BatchItem::* field) {
+            double sum = 0;
+            double worst = 0;
+            int count = 0;
+            for (const std::shared_ptr<BatchItem>& item : done) {
+                double ms = (*item).*field;
+                if (ms <= 0) continue;
+                sum += ms;
+                worst = std::max(worst, ms);
+                count++;
+            }
+            std::ostringstream row;
+            row << std::fixed << std::setprecision(2) << "  " << std::left << std::setw(8) << name
+                << " avg " << std::right << std::setw(9) << (count ? sum / count : 0.0) << " ms"
+                << "   max " << std::setw(9) << worst << " ms";
+            out << row.str() << std::endl;
+        };
+
+        std::ostringstream summary;
+        summary << std::fixed << std::setprecision(2) << done.size() - failed << "/" << done.size()
+                << " images processed in " << elapsed << " s (" << (elapsed > 0 ? done.size() / elapsed : 0.0)
+                << " images/s, " << workers << " workers)";
+        out << summary.str() << std::endl;
+        out << "Stage latency:" << std::endl;
+        stage("read", &BatchItem::readMs);
+        stage("process", &BatchItem::processMs);
+        stage("write", &BatchItem::writeMs);
+        stage("total", &BatchItem::totalMs);
+
+        return failed == 0;
     }
     
     // Parse command line into command and arguments
@@ -995,7 +2301,11 @@ private:
     }
     
 public:
-    CLI() : running(true) {
+    CLI(std::ostream& out = std::cout, std::ostream& err = std::cerr) : running(true), out(out), err(err) {
+
+        // spilled slots go to TMPDIR
+        const char* tmp = std::getenv("TMPDIR");
+        spillDir = (tmp && *tmp) ? tmp : "/tmp";
 
         // initialize filters
 
@@ -1004,302 +2314,507 @@ public:
         // Register commands
 
         registerCommand("load", 
-            [this](const std::vector<std::string>& args) { handleLoad(args); },
-            "Load image from BMP file into 3D RGB array",
+            [this](const std::vector<std::string>& args) { return handleLoad(args); },
+            "Load image from BMP file into 3D RGB array (decoded in the background)",
             "load <filename.bmp>",
             "-n"
         );
         
         registerCommand("save", 
-            [this](const std::vector<std::string>& args) { handleSave(args); },
-            "Save current image to BMP file",
+            [this](const std::vector<std::string>& args) { return handleSave(args); },
+            "Save current image to BMP file (written in the background)",
             "save <filename.bmp>",
             "-n"
         );
         
+        registerCommand("sync", 
+            [this](const std::vector<std::string>& args) { return handleSync(args); },
+            "Wait for background loads and saves to finish",
+            "sync",
+            "NONE"
+        );
+        
         registerCommand("info", 
-            [this](const std::vector<std::string>& args) { handleInfo(args); },
+            [this](const std::vector<std::string>& args) { return handleInfo(args); },
             "Show information about currently loaded image",
             "info",
             "-n"
         );
         
+        registerCommand("mem", 
+            [this](const std::vector<std::string>& args) { return handleMem(args); },
+            "Show memory used by each slot, optionally set a budget above which idle slots are spilled to disk",
+            "mem [budget MB | off]",
+            "NONE"
+        );
+        
+        registerCommand("precision", 
+            [this](const std::vector<std::string>& args) { return handlePrecision(args); },
+            "Round a slot (-n) or all slots to f32 or f16 after each command and piped stage to emulate that precision, computation and resident pixels stay f64 so it is not faster, only compressed idle slots keep 4/2 bytes per value",
+            "precision [f64 | f32 | f16]",
+            "-n"
+        );
+
+        registerCommand("compress", 
+            [this](const std::vector<std::string>& args) { return handleCompress(args); },
+            "Losslessly compress slots left idle for a number of commands (default 4), decoded on next use",
+            "compress [idle commands | off]",
+            "NONE"
+        );
+        
         registerCommand("exit", 
-            [this](const std::vector<std::string>& args) { handleExit(args); },
+            [this](const std::vector<std::string>& args) { return handleExit(args); },
             "Exit the program",
             "exit",
             "NONE"
         );
         
         registerCommand("quit", 
-            [this](const std::vector<std::string>& args) { handleExit(args); },
+            [this](const std::vector<std::string>& args) { return handleExit(args); },
             "Exit the program",
             "quit",
             "NONE"
         );
         
         registerCommand("help", 
-            [this](const std::vector<std::string>& args) { handleHelp(args); },
+            [this](const std::vector<std::string>& args) { return handleHelp(args); },
             "Show available commands",
             "help",
             "NONE"
         );
 
-        registerCommand("invert", 
-            [this](const std::vector<std::string>& args) { handleFunc(args, PF_invert); },
+        registerStage("invert", 
+            [this](const std::vector<std::string>& args, Stage& stage) { return stageFunc(args, stage, PF_Invert()); },
             "Invert colors of the current image",
             "invert",
             "-n"
         );
         
-        registerCommand("grayscale", 
-            [this](const std::vector<std::string>& args) { handleFunc(args, PF_grayscale); },
+        registerStage("grayscale", 
+            [this](const std::vector<std::string>& args, Stage& stage) { return stageFunc(args, stage, PF_Grayscale()); },
             "Convert current image to grayscale",
             "grayscale",
             "-n"
         );
         
         registerCommand("flip", 
-            [this](const std::vector<std::string>& args) { handleFlip(args); },
+            [this](const std::vector<std::string>& args) { return handleFlip(args); },
             "Flip image horizontally or vertically",
             "flip [horizontal | vertical]",
-            "-n -fr"
+            "-n -fr -ft"
         );
 
-        registerCommand("abs", 
-            [this](const std::vector<std::string>& args) { handleFunc(args, PF_absolute); },
+        registerStage("abs", 
+            [this](const std::vector<std::string>& args, Stage& stage) { return stageFunc(args, stage, PF_Absolute()); },
             "Replaces each pixel with absolute value",
             "abs",
             "-n"
         );
 
-        registerCommand("quant", 
-            [this](const std::vector<std::string>& args) { handleQuantize(args); },
+        registerStage("quant", 
+            [this](const std::vector<std::string>& args, Stage& stage) { return stageQuantize(args, stage); },
             "Replaces each pixel with absolute value",
             "quant -s [int]",
             "-n -s"
         );
 
+        registerCommand("conv", 
+            [this](const std::vector<std::string>& args) { return handleConv(args); },
+            "Convolves with a kernel (box, gauss, motion, sharpen, laplace, emboss) of size s, or with the image in slot k, edges repeat",
+            "conv [name | k] -s [int]",
+            "-n -s"
+        );
+
+        registerCommand("blur", 
+            [this](const std::vector<std::string>& args) { return handleBlur(args); },
+            "Gaussian blur of standard deviation s in each square, at the same cost for any s",
+            "blur -s [int] -sx [int] -sy [int]",
+            "-n -s -sx -sy -fr -ft"
+        );
+
+        registerCommand("bilateral", 
+            [this](const std::vector<std::string>& args) { return handleBilateral(args); },
+            "Edge-preserving blur of spatial sigma s (default 16) and luminance sigma range (default 30), at the same cost for any s >= 2 (s = 1 and grids over 512 MB use a direct sum over radius 3 s)",
+            "bilateral [range] -s [int]",
+            "-n -s",
+            1
+        );
+
+        registerCommand("gradient", 
+            [this](const std::vector<std::string>& args) { return handleGradient(args); },
+            "Replaces each channel by its gradient gx + i gy (Sobel or Scharr), abs and arg give magnitude and angle",
+            "gradient [sobel | scharr]",
+            "-n"
+        );
+
+        registerCommand("canny", 
+            [this](const std::vector<std::string>& args) { return handleCanny(args); },
+            "Canny edge map of the luminance smoothed with sigma s (default 1.4), thresholds on the gradient per pixel (default 10 30)",
+            "canny [low] [high] -s [int]",
+            "-n -s"
+        );
+
+        registerCommand("median", 
+            [this](const std::vector<std::string>& args) { return handleRank(args, true); },
+            "Median of the window of radius s around each pixel, at the same cost for any s (real parts only, values other than integers in [0, 255] are quantized to -q levels, default 256)",
+            "median -s [int] -q [int]",
+            "-n -s -q"
+        );
+
+        registerCommand("rank", 
+            [this](const std::vector<std::string>& args) { return handleRank(args, false); },
+            "Value of rank p percent (0 minimum, 100 maximum) in the window of radius s around each pixel (real parts only, values other than integers in [0, 255] are quantized to -q levels, default 256)",
+            "rank [p] -s [int] -q [int]",
+            "-n -s -q",
+            1
+        );
+
+        registerCommand("erode", 
+            [this](const std::vector<std::string>& args) { return handleMorph(args, MorphOp::erode); },
+            "Minimum of the w x h rectangle (h defaults to w) around each pixel in each square",
+            "erode [w] [h] -sx [int] -sy [int]",
+            "-n -sx -sy -fr -ft"
+        );
+
+        registerCommand("dilate", 
+            [this](const std::vector<std::string>& args) { return handleMorph(args, MorphOp::dilate); },
+            "Maximum of the w x h rectangle (h defaults to w) around each pixel in each square",
+            "dilate [w] [h] -sx [int] -sy [int]",
+            "-n -sx -sy -fr -ft"
+        );
+
+        registerCommand("open", 
+            [this](const std::vector<std::string>& args) { return handleMorph(args, MorphOp::open); },
+            "Dilate of the erode by a w x h rectangle in each square, removes bright details smaller than it",
+            "open [w] [h] -sx [int] -sy [int]",
+            "-n -sx -sy -fr -ft"
+        );
+
+        registerCommand("close", 
+            [this](const std::vector<std::string>& args) { return handleMorph(args, MorphOp::close); },
+            "Erode of the dilate by a w x h rectangle in each square, fills dark details smaller than it",
+            "close [w] [h] -sx [int] -sy [int]",
+            "-n -sx -sy -fr -ft"
+        );
+
+        registerCommand("tophat", 
+            [this](const std::vector<std::string>& args) { return handleMorph(args, MorphOp::tophat); },
+            "Image minus its open by a w x h rectangle in each square, keeps bright details smaller than it",
+            "tophat [w] [h] -sx [int] -sy [int]",
+            "-n -sx -sy -fr -ft"
+        );
+
         registerCommand("level", 
-            [this](const std::vector<std::string>& args) { handleLevel(args); },
+            [this](const std::vector<std::string>& args) { return handleLevel(args); },
             "Averages each square",
             "level -sx [int] -sy [int]",
-            "-n -sx -sy -fr"
+            "-n -sx -sy -fr -ft -seed"
         );
 
-        registerCommand("cutoff", 
-            [this](const std::vector<std::string>& args) { handleCutoff(args); },
+        registerStage("cutoff", 
+            [this](const std::vector<std::string>& args, Stage& stage) { return stageCutoff(args, stage); },
             "Replaces value with 0 if absolute value is less than s",
             "cutoff -s [int]",
             "-n -s"
         );
 
         registerCommand("fft", 
-            [this](const std::vector<std::string>& args) { handleTransform(args, fft); },
+            [this](const std::vector<std::string>& args) { return handleTransform(args, fft, RealEffect::complex); },
             "Fourier Transforms image horizontally or vertically",
             "fft [h | v | d]",
-            "-n -sx -sy -fr"
+            "-n -sx -sy -fr -ft"
         );
 
         registerCommand("ifft", 
-            [this](const std::vector<std::string>& args) { handleTransform(args, ifft); },
+            [this](const std::vector<std::string>& args) { return handleTransform(args, ifft, RealEffect::complex); },
             "Inverse Fourier Transforms image horizontally or vertically",
             "ifft [h | v | d]",
-            "-n -sx -sy -fr"
+            "-n -sx -sy -fr -ft"
         );
 
         registerCommand("dft", 
-            [this](const std::vector<std::string>& args) { handleTransform(args, dft); },
+            [this](const std::vector<std::string>& args) { return handleTransform(args, dft, RealEffect::complex); },
             "Fourier Transforms image horizontally or vertically",
             "dft [h | v | d]",
-            "-n -sx -sy -fr"
+            "-n -sx -sy -fr -ft"
         );
 
         registerCommand("idft", 
-            [this](const std::vector<std::string>& args) { handleTransform(args, idft); },
+            [this](const std::vector<std::string>& args) { return handleTransform(args, idft, RealEffect::complex); },
             "Inverse Fourier Transforms image horizontally or vertically",
             "idft [h | v | d]",
-            "-n -sx -sy -fr"
+            "-n -sx -sy -fr -ft"
         );
 
         registerCommand("dct", 
-            [this](const std::vector<std::string>& args) { handleTransform(args, dct2); },
+            [this](const std::vector<std::string>& args) { return handleTransform(args, dct2, RealEffect::real); },
             "Cosine Transforms real part of image horizontally or vertically",
             "dct [h | v | d]",
-            "-n -sx -sy -fr"
+            "-n -sx -sy -fr -ft"
         );
 
         registerCommand("idct", 
-            [this](const std::vector<std::string>& args) { handleTransform(args, idct2); },
+            [this](const std::vector<std::string>& args) { return handleTransform(args, idct2, RealEffect::real); },
             "Inverse Cosine Transforms real part of image horizontally or vertically",
             "idct [h | v | d]",
-            "-n -sx -sy -fr"
+            "-n -sx -sy -fr -ft"
         );
 
         registerCommand("dst", 
-            [this](const std::vector<std::string>& args) { handleTransform(args, dst2); },
+            [this](const std::vector<std::string>& args) { return handleTransform(args, dst2, RealEffect::real); },
             "Sine Transforms real part of image horizontally or vertically",
             "dst [h | v | d]",
-            "-n -sx -sy -fr"
+            "-n -sx -sy -fr -ft"
         );
 
         registerCommand("idst", 
-            [this](const std::vector<std::string>& args) { handleTransform(args, idst2); },
+            [this](const std::vector<std::string>& args) { return handleTransform(args, idst2, RealEffect::real); },
             "Inverse Sine Transforms real part of image horizontally or vertically",
             "idst [h | v | d]",
-            "-n -sx -sy -fr"
+            "-n -sx -sy -fr -ft"
         );
 
         registerCommand("wht", 
-            [this](const std::vector<std::string>& args) { handleTransform(args, wht); },
+            [this](const std::vector<std::string>& args) { return handleTransform(args, wht, RealEffect::keep); },
             "Walsh-Hadamard Transforms image horizontally or vertically",
             "wht [h | v | d]",
-            "-n -sx -sy -fr"
+            "-n -sx -sy -fr -ft"
         );
 
         registerCommand("iwht", 
-            [this](const std::vector<std::string>& args) { handleTransform(args, iwht); },
+            [this](const std::vector<std::string>& args) { return handleTransform(args, iwht, RealEffect::keep); },
             "Inverse Walsh-Hadamard Transforms image horizontally or vertically",
             "iwht [h | v | d]",
-            "-n -sx -sy -fr"
+            "-n -sx -sy -fr -ft"
         );
 
         registerCommand("sort", 
-            [this](const std::vector<std::string>& args) { handleSortDisjoint(args, sort_v1); },
+            [this](const std::vector<std::string>& args) { return handleSortDisjoint(args, sort_v1); },
             "Sort colors image horizontally or vertically",
             "sort [h | v | d]",
-            "-n -sx -sy -fr"
+            "-n -sx -sy -fr -ft -seed"
         );
 
-        registerCommand("fit", 
-            [this](const std::vector<std::string>& args) { handleFunc(args, PF_fit); },
+        registerStage("fit", 
+            [this](const std::vector<std::string>& args, Stage& stage) {
+                stage.bytesOut = true;
+                return stageFunc(args, stage, PF_Fit());
+            },
             "fit each pixel to [0,255]",
             "fit",
             "-n"
         );
 
-        registerCommand("real", 
-            [this](const std::vector<std::string>& args) { handleFunc(args, PF_real); },
+        registerStage("real", 
+            [this](const std::vector<std::string>& args, Stage& stage) { return stageFunc(args, stage, PF_Real()); },
             "keep only real part of image",
             "real",
             "-n"
         );
 
-        registerCommand("im", 
-            [this](const std::vector<std::string>& args) { handleFunc(args, PF_im); },
+        registerStage("im", 
+            [this](const std::vector<std::string>& args, Stage& stage) { return stageFunc(args, stage, PF_Im()); },
             "keep only imaginary part of image",
             "im",
             "-n"
         );
 
         registerCommand("warp-sqrt", 
-            [this](const std::vector<std::string>& args) { handleWarp(args, warp_square); },
+            [this](const std::vector<std::string>& args) { return handleWarp(args, Warp_Square()); },
             "takes (x,y) -> (sqrt(x),sqrt(y)), -s 1 determines blending",
             "warp-sqrt",
-            "-n -s -sx -sy -fr"
+            "-n -s -sx -sy -fr -ft"
         );
 
         registerCommand("warp-square", 
-            [this](const std::vector<std::string>& args) { handleWarp(args, warp_sqrt); },
+            [this](const std::vector<std::string>& args) { return handleWarp(args, Warp_Sqrt()); },
             "takes (x,y) -> (x^2,y^2), -s 1 determines blending",
             "warp-square",
-            "-n -s -sx -sy -fr"
+            "-n -s -sx -sy -fr -ft"
         );
 
-        registerCommand("pixel-square", 
-            [this](const std::vector<std::string>& args) { handleFunc(args, PF_square); },
+        registerStage("pixel-square", 
+            [this](const std::vector<std::string>& args, Stage& stage) { return stageFunc(args, stage, PF_Square()); },
             "takes [r,g,b] -> [r^2,g^2,b^2]",
             "pixel-square",
             "-n"
         );
 
-        registerCommand("pixel-mult", 
-            [this](const std::vector<std::string>& args) { handleFuncComplex(args, PFC_mult); },
+        registerStage("pixel-mult", 
+            [this](const std::vector<std::string>& args, Stage& stage) { return stageFuncComplex(args, stage, PFC_Mult()); },
             "multiplies by a complex constant a+bi",
             "pixel-mult(a,b)",
             "-n"
         );
 
-        registerCommand("pixel-div", 
-            [this](const std::vector<std::string>& args) { handleFuncComplex(args, PFC_div); },
+        registerStage("pixel-div", 
+            [this](const std::vector<std::string>& args, Stage& stage) { return stageFuncComplex(args, stage, PFC_Div()); },
             "divides by a complex constant a+bi",
             "pixel-div (a,b)",
             "-n"
         );
 
-        registerCommand("pixel-add", 
-            [this](const std::vector<std::string>& args) { handleFuncComplex(args, PFC_add); },
+        registerStage("pixel-add", 
+            [this](const std::vector<std::string>& args, Stage& stage) { return stageFuncComplex(args, stage, PFC_Add()); },
             "adds a complex constant a+bi",
             "pixel-add (a,b)",
             "-n"
         );
 
+        registerStage("expr", 
+            [this](const std::vector<std::string>& args, Stage& stage) { return stageExpr(args, stage); },
+            "sets each channel to a formula of v (the channel), r, g, b, x, y in [0,1), w, h, with + - * / ^, numbers like 2 or 0.5i, i, pi, e and pow log exp sqrt abs arg conj re im sin cos, write the formula without spaces",
+            "expr <formula>",
+            "-n",
+            1
+        );
+
         registerCommand("desc-add", 
-            [this](const std::vector<std::string>& args) { handleDescartian(args, D_add); },
+            [this](const std::vector<std::string>& args) { return handleDescartian(args, D_Add()); },
             "adds img[n1] + img[n2] -> img[n3]",
             "desc-add (n1,n2,n3)",
             "NONE"
         );
 
         registerCommand("desc-mult", 
-            [this](const std::vector<std::string>& args) { handleDescartian(args, D_mult); },
+            [this](const std::vector<std::string>& args) { return handleDescartian(args, D_Mult()); },
             "adds img[n1] * img[n2] -> img[n3]",
             "desc-mult (n1,n2,n3)",
             "NONE"
         );
 
         registerCommand("desc-div", 
-            [this](const std::vector<std::string>& args) { handleDescartian(args, D_div); },
+            [this](const std::vector<std::string>& args) { return handleDescartian(args, D_Div()); },
             "adds img[n1] / img[n2] -> img[n3]",
             "desc-div (n1,n2,n3)",
             "NONE"
         );
 
         registerCommand("matmul", 
-            [this](const std::vector<std::string>& args) { handleMatMul(args); },
+            [this](const std::vector<std::string>& args) { return handleMatMul(args); },
             "adds img[n1] @ img[n2] -> img[n3]",
             "matmul (n1,n2,n3)",
             "NONE"
         );
 
+        registerCommand("dup", 
+            [this](const std::vector<std::string>& args) { return handleDup(args); },
+            "copies img[n1] -> img[n2], pixels are shared until either is modified",
+            "dup (n1,n2)",
+            "NONE"
+        );
+
+        registerCommand("pipe", 
+            [this](const std::vector<std::string>& args) { return handlePipe(args); },
+            "runs element-wise commands (pixel functions, pixel-mult/div/add, quant, cutoff, filter, expr) in a single pass over the image, consecutive ones in scripts are piped automatically",
+            "pipe <command> [args] | <command> [args] | ...",
+            "flags of each command"
+        );
+
+        registerCommand("run", 
+            [this](const std::vector<std::string>& args) { return handleRun(args); },
+            "runs a script on the current images, scripts support set <name> <value>, repeat <count> { ... }, for <name> in <values> { ... } and for <name> from <a> to <b> [step <c>] { ... }",
+            "run <script.nl>",
+            "NONE"
+        );
+
+        registerCommand("batch", 
+            [this](const std::vector<std::string>& args) { return handleBatch(args); },
+            "runs a script on every BMP matching the pattern and saves the results to outdir, images are pipelined through load, process and save stages",
+            "batch <pattern> <script.nl> <outdir> [workers]",
+            "NONE"
+        );
+
         registerCommand("clamp", 
-            [this](const std::vector<std::string>& args) { handleClamp(args); },
+            [this](const std::vector<std::string>& args) { return handleClamp(args); },
             "clamps each frame within max values",
             "clamp",
-            "-n -sx, -sy -fr"
+            "-n -sx, -sy -fr -ft -seed"
         );
 
         registerCommand("resize", 
-            [this](const std::vector<std::string>& args) { handleResize(args); },
+            [this](const std::vector<std::string>& args) { return handleResize(args); },
             "resizes image to w x h",
             "resize (w,h)",
             "-n"
         );
 
-        registerCommand("filter", 
-            [this](const std::vector<std::string>& args) { handleFilter(args); },
+        registerStage("noise-gauss", 
+            [this](const std::vector<std::string>& args, Stage& stage) { return stageNoise(args, stage, NoiseType::gauss); },
+            "Adds gaussian noise of standard deviation s to each channel",
+            "noise-gauss -s [int] -seed [int]",
+            "-n -s -seed -sx -sy -fr -ft"
+        );
+
+        registerStage("noise-uniform", 
+            [this](const std::vector<std::string>& args, Stage& stage) { return stageNoise(args, stage, NoiseType::uniform); },
+            "Adds uniform noise in [-s, s] to each channel",
+            "noise-uniform -s [int] -seed [int]",
+            "-n -s -seed -sx -sy -fr -ft"
+        );
+
+        registerStage("noise-salt", 
+            [this](const std::vector<std::string>& args, Stage& stage) { return stageNoise(args, stage, NoiseType::salt); },
+            "Sets s percent of the pixels to black or white",
+            "noise-salt -s [int] -seed [int]",
+            "-n -s -seed -sx -sy -fr -ft"
+        );
+
+        registerStage("noise-phase", 
+            [this](const std::vector<std::string>& args, Stage& stage) { return stageNoise(args, stage, NoiseType::phase); },
+            "Turns the phase of each channel by a random angle in [-s, s] degrees",
+            "noise-phase -s [int] -seed [int]",
+            "-n -s -seed -sx -sy -fr -ft"
+        );
+
+        registerStage("filter", 
+            [this](const std::vector<std::string>& args, Stage& stage) { return stageFilter(args, stage); },
             "filters according to name",
             "filter [name]",
-            "-n -sx, -sy -fr"
+            "-n -sx, -sy -fr -ft -seed"
         );
     }
     
+    // Background writes are finished before the program ends
+    ~CLI() {
+        syncIO();
+        for (int n = 0; n < N_images; n++) {
+            cancelPack(n);
+        }
+    }
+    
+    // Register an element-wise command, it can also be a pipe stage
+    void registerStage(const std::string& name,
+                        StageFactory factory,
+                        const std::string& description = "",
+                        const std::string& usage = "",
+                        const std::string& flags = "",
+                        int positional = 0) {
+        stageFactories[name] = factory;
+        registerCommand(name,
+            [this, factory](const std::vector<std::string>& args) { return handleStage(args, factory); },
+            description, usage, flags, positional);
+    }
+
     // Method to register new commands (for scalability)
     void registerCommand(const std::string& name, 
-                        std::function<void(const std::vector<std::string>&)> handler,
+                        CommandHandler handler,
                         const std::string& description = "",
                         const std::string& usage = "",
-                        const std::string& flags = "" ) {
-        commands[name] = {handler, description, usage, flags};
+                        const std::string& flags = "",
+                        int positional = 0) {
+        commands[name] = {handler, description, usage, flags, positional};
     }
     
+    bool timeCommands = false;                  // report wall time of each command on stderr
+
     // Main CLI loop
     void run() {
-        std::cout << "nLoss++ Started. Type 'help' for available commands." << std::endl;
-        std::cout << "Supported format: 24-bit uncompressed BMP files" << std::endl;
+        out << "nLoss++ Started. Type 'help' for available commands." << std::endl;
+        out << "Supported format: 24-bit uncompressed BMP files" << std::endl;
         
         while (running) {
-            std::cout << "> ";
+            out << "> ";
             std::string input;
             if (! std::getline(std::cin, input)) running = false;
             
@@ -1312,24 +2827,162 @@ public:
             executeCommand(command, args);
         }
     }
+
+    // Compile script text against the registered commands, errors go to err
+    bool compile(const std::string& text, const std::string& source, Program& program) {
+        CommandLookup lookup = [this](const std::string& name) -> std::optional<CommandInfo> {
+            auto it = commands.find(name);
+            if (it == commands.end()) return std::nullopt;
+
+            CommandInfo info;
+            info.handler = it->second.handler;
+            info.fusable = stageFactories.count(name) > 0;
+            info.positional = it->second.positional;
+            std::istringstream flags(it->second.flags);
+            std::string flag;
+            while (flags >> flag) {
+                if (flag.back() == ',') flag.pop_back();
+                if (flag.size() > 1 && flag[0] == '-') info.flags.push_back(flag);
+            }
+            return info;
+        };
+        // timing needs every command on its own
+        return compileScript(text, source, lookup, program, err, !timeCommands);
+    }
+
+    // Run a compiled program, stops at the first failing command or at exit
+    bool runProgram(const Program& program) {
+        bool failed = false;
+        bool completed = ::runProgram(program, [&](const Instruction& instr, const std::vector<std::string>& args) {
+            if (instr.sources.empty()) {
+                if (!runCommand(instr.name, instr.handler, args)) {
+                    err << program.source << ":" << instr.line << ": '" << instr.name << "' failed, stopping" << std::endl;
+                    failed = true;
+                    return false;
+                }
+                return running;
+            }
+
+            // merged pipe, report the command at fault, the first one if they failed together
+            int stage = -1;
+            std::string names;
+            for (const FusedSource& source : instr.sources) names += (names.empty() ? "" : " | ") + source.name;
+            CommandHandler fused = [&](const std::vector<std::string>& stageArgs) { return runFused(instr, stageArgs, stage); };
+            if (!runCommand(names, fused, args)) {
+                const FusedSource& source = instr.sources[std::max(stage, 0)];
+                err << program.source << ":" << source.line << ": '" << source.name << "' failed, stopping" << std::endl;
+                failed = true;
+                return false;
+            }
+            return running;
+        }, err);
+        return completed || (!failed && !running);
+    }
+
+    // Batch mode, no banner or prompt, the whole script is compiled before anything runs
+    // Returns the process exit code
+    int runBatch(std::istream& in, const std::string& source) {
+        std::ostringstream text;
+        text << in.rdbuf();
+
+        Program program;
+        if (!compile(text.str(), source, program)) return 1;
+
+        bool ok = runProgram(program);
+
+        // pending writes count as part of the last command
+        syncIO();
+        if (ok && ioFailed) {
+            err << source << ": background I/O failed" << std::endl;
+            ok = false;
+        }
+        return ok ? 0 : 1;
+    }
     
-    // Execute a command
-    void executeCommand(const std::string& command, const std::vector<std::string>& args) {
+    // Execute a command by name, returns false if it is unknown, throws, fails or its I/O fails
+    bool executeCommand(const std::string& command, const std::vector<std::string>& args) {
         auto it = commands.find(command);
-        if (it != commands.end()) {
-            try {
-                it->second.handler(args);
-            } catch (const std::exception& e) {
-                std::cerr << "Error executing command '" << command << "': " << e.what() << std::endl;
-            }
-        } else {
-            std::cout << "Unknown command: " << command << ". Type 'help' for available commands." << std::endl;
+        if (it == commands.end()) {
+            out << "Unknown command: " << command << ". Type 'help' for available commands." << std::endl;
+            return false;
         }
+        return runCommand(command, it->second.handler, args);
+    }
+
+    // Execute a resolved command
+    bool runCommand(const std::string& command, const CommandHandler& handler, const std::vector<std::string>& args) {
+        auto start = std::chrono::steady_clock::now();
+        ioFailed = false;
+        reapIO();
+        reapPacks();
+        commandCount++;
+        bool ok = false;
+        try {
+            ok = handler(args);
+            roundDirty();
+            // keep idle slots within the budget, the ones just used stay in RAM
+            makeRoom(0);
+            startPacks();
+        } catch (const std::exception& e) {
+            err << "Error executing command '" << command << "': " << e.what() << std::endl;
+            ok = false;
+        }
+
+        if (timeCommands) {
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            std::ostringstream line;
+            line << "time " << command << ": " << std::fixed << std::setprecision(3) << elapsed.count() << " ms";
+            err << line.str() << std::endl;
+        }
+        return ok && !ioFailed;
     }
 };
 
-int main() {
+static void printUsage(const char* name) {
+    std::cerr << "Usage: " << name << " [--time] [-f script.nl | -c \"cmd; cmd; ...\"]" << std::endl;
+    std::cerr << "  no script      interactive prompt on stdin" << std::endl;
+    std::cerr << "  -f <file>      run commands from file ('-' = stdin), stop at the first error" << std::endl;
+    std::cerr << "  -c <commands>  run ';' separated commands, stop at the first error" << std::endl;
+    std::cerr << "  --time         report wall time of each command on stderr" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    std::string script;
+    std::string commands;
+    bool haveScript = false;
+    bool haveCommands = false;
+    bool timed = false;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--time") {
+            timed = true;
+        } else if ((arg == "-f" || arg == "-c") && i + 1 < argc && !haveScript && !haveCommands) {
+            (arg == "-f" ? haveScript : haveCommands) = true;
+            (arg == "-f" ? script : commands) = argv[++i];
+        } else {
+            printUsage(argv[0]);
+            return 2;
+        }
+    }
+
     CLI cli;
+    cli.timeCommands = timed;
+
+    if (haveCommands) {
+        std::istringstream in(commands);
+        return cli.runBatch(in, "-c");
+    }
+    if (haveScript) {
+        if (script == "-") return cli.runBatch(std::cin, "stdin");
+        std::ifstream in(script);
+        if (!in) {
+            std::cerr << "Error: Cannot open script " << script << std::endl;
+            return 2;
+        }
+        return cli.runBatch(in, script);
+    }
+
     cli.run();
     return 0;
-}
\ No newline at end of file
+}
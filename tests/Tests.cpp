@@ -0,0 +1,386 @@
+#include "../ConvTools.h"
+#include "../FragTools.h"
+#include "../MorphTools.h"
+#include "../NoiseTools.h"
+#include "../PackTools.h"
+#include "../RandTools.h"
+#include "../RankTools.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <vector>
+
+// Checks of the algorithms whose results can be compared to a known answer or a brute force version
+// Run with make test, every check prints ok or FAIL and the exit status counts the failures
+
+
+
+static std::mt19937 rng(1);
+
+static ImageData randomImage(int width, int height, bool real, int levels = 0) {
+    ImageData img;
+    img.allocate(width, height);
+    img.isLoaded = true;
+    img.realMask = real ? 7 : 0;
+    std::uniform_real_distribution<double> u(-1, 1);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            for (int c = 0; c < 3; c++) {
+                double re = levels ? static_cast<double>(rng() % levels) : u(rng);
+                img.pixels[y][x][c] = Complex(re, real ? 0 : u(rng));
+            }
+        }
+    }
+    return img;
+}
+
+static ImageData copyOf(const ImageData& img) {
+    ImageData copy = img;
+    copy.pixels.detach();
+    return copy;
+}
+
+
+// Philox4x32-10 known answers from the Random123 distribution
+static bool philoxAnswers() {
+    RandBlock zero = philox(0, 0, 0);
+    RandBlock pi = philox(0x299f31d0a4093822ull, 0x85a308d3243f6a88ull, 0x0370734413198a2eull);
+    return zero == RandBlock{0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8}
+        && pi == RandBlock{0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1};
+}
+
+
+// Moments and tail of the ziggurat normal draws
+static bool gaussMoments() {
+    NoiseSource noise(NoiseType::gauss, 1.0, 42);
+    double s1 = 0, s2 = 0, s4 = 0;
+    long long n = 0, tail = 0;
+    for (int y = 0; y < 1000; y++) {
+        for (int x = 0; x < 1000; x++) {
+            Triple a{};
+            noise(a, x, y);
+            for (int c = 0; c < 3; c++) {
+                double v = a[c].real();
+                s1 += v;
+                s2 += v * v;
+                s4 += v * v * v * v;
+                n++;
+                if (std::fabs(v) > 3) tail++;
+            }
+        }
+    }
+    double mean = s1 / n;
+    double variance = s2 / n - mean * mean;
+    double kurtosis = s4 / n / (variance * variance);
+    double expected = std::erfc(3 / std::sqrt(2.0));
+    return std::fabs(mean) < 0.005 && std::fabs(variance - 1) < 0.01 && std::fabs(kurtosis - 3) < 0.05
+        && std::fabs(static_cast<double>(tail) / n / expected - 1) < 0.05;
+}
+
+
+// Jump flooding labels against the nearest seed, the distance must match even when the seed differs on ties
+// Jump flooding is not exact, a few pixels in ten thousand may keep a seed that is not the nearest
+static bool voronoiNearest() {
+    long long pixels = 0, wrong = 0;
+    for (int width : {1, 7, 100, 257}) {
+        for (int height : {1, 40, 129}) {
+            for (int count : {1, 5, 64, 300}) {
+                for (int seed : {0, 9}) {
+                    FragRegions regions = voronoiFrag(height, width, count, seed);
+                    int size = width * height;
+                    int n = std::min(count, size);
+                    if (regions.count() != n || static_cast<int>(regions.pixel.size()) != size) return false;
+
+                    uint64_t key = static_cast<uint64_t>(seed) << 32 | static_cast<uint32_t>(n);
+                    std::vector<int> sx, sy;
+                    std::vector<bool> used(size, false);
+                    for (int k = 0; k < n; k++) {
+                        RandStream stream(key, k);
+                        int p;
+                        do {
+                            p = randInt(stream(), 0, size - 1);
+                        } while (used[p]);
+                        used[p] = true;
+                        sx.push_back(p % width);
+                        sy.push_back(p / width);
+                    }
+
+                    auto dist = [&](int s, int p) {
+                        long long dx = sx[s] - p % width;
+                        long long dy = sy[s] - p / width;
+                        return dx * dx + dy * dy;
+                    };
+                    pixels += size;
+                    for (int p = 0; p < size; p++) {
+                        long long best = dist(0, p);
+                        for (int s = 1; s < n; s++) best = std::min(best, dist(s, p));
+                        if (dist(regions.label[p], p) != best) wrong++;
+                    }
+                }
+            }
+        }
+    }
+    return wrong * 10000 <= pixels;
+}
+
+
+// Perreault - Hebert histograms against sorting every window
+static bool rankBruteForce() {
+    for (int t = 0; t < 10; t++) {
+        int width = 1 + rng() % 600;
+        int height = 1 + rng() % 40;
+        int radius = rng() % 9;
+        double percent = rng() % 101;
+        ImageData img = randomImage(width, height, true, 256);
+        ImageData ref = copyOf(img);
+        rankFilter(img, radius, percent);
+
+        long long window = (2LL * radius + 1) * (2 * radius + 1);
+        int rank = static_cast<int>(std::lround(percent / 100 * (window - 1)));
+        std::vector<double> values;
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                for (int c = 0; c < 3; c++) {
+                    values.clear();
+                    for (int dy = -radius; dy <= radius; dy++) {
+                        for (int dx = -radius; dx <= radius; dx++) {
+                            values.push_back(ref.pixels[std::clamp(y + dy, 0, height - 1)][std::clamp(x + dx, 0, width - 1)][c].real());
+                        }
+                    }
+                    std::nth_element(values.begin(), values.begin() + rank, values.end());
+                    if (values[rank] != img.pixels[y][x][c].real()) return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+
+// van Herk - Gil-Werman against the extremum of every window, on bytes and doubles, inside random frames
+static bool morphBruteForce() {
+    for (int t = 0; t < 30; t++) {
+        int width = 1 + rng() % 200;
+        int height = 1 + rng() % 200;
+        bool bytes = t % 2;
+        struct frame f;
+        f.x = rng() % width;
+        f.y = rng() % height;
+        f.x_size = 1 + rng() % (width - f.x);
+        f.y_size = 1 + rng() % (height - f.y);
+        int w = 1 + rng() % 15;
+        int h = 1 + rng() % 15;
+        if (t % 7 == 0) w = 1 + rng() % 500;
+        MorphOp op = static_cast<MorphOp>(rng() % 5);
+
+        ImageData img;
+        if (bytes) img.allocate8(width, height);
+        else img.allocate(width, height);
+        img.isLoaded = true;
+        std::vector<double> ref(static_cast<size_t>(width) * height * 3);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                for (int c = 0; c < 3; c++) {
+                    int v = rng() % 256;
+                    ref[(static_cast<size_t>(y) * width + x) * 3 + c] = v;
+                    if (bytes) img.rgb8[y][x][c] = static_cast<uint8_t>(v);
+                    else img.pixels[y][x][c] = Complex(v, 0);
+                }
+            }
+        }
+        morphology(img, f, op, w, h);
+
+        auto at = [width](int x, int y, int c) { return (static_cast<size_t>(y) * width + x) * 3 + c; };
+        auto extremum = [&](const std::vector<double>& in, bool dilate) {
+            std::vector<double> out = in;
+            int ax = dilate ? w / 2 : (w - 1) / 2;
+            int ay = dilate ? h / 2 : (h - 1) / 2;
+            for (int y = f.y; y < f.y + f.y_size; y++) {
+                for (int x = f.x; x < f.x + f.x_size; x++) {
+                    for (int c = 0; c < 3; c++) {
+                        double m = dilate ? -1 : 256;
+                        for (int yy = std::max(f.y, y - ay); yy < std::min(f.y + f.y_size, y - ay + h); yy++) {
+                            for (int xx = std::max(f.x, x - ax); xx < std::min(f.x + f.x_size, x - ax + w); xx++) {
+                                m = dilate ? std::max(m, in[at(xx, yy, c)]) : std::min(m, in[at(xx, yy, c)]);
+                            }
+                        }
+                        out[at(x, y, c)] = m;
+                    }
+                }
+            }
+            return out;
+        };
+
+        std::vector<double> expected;
+        switch (op) {
+        case MorphOp::erode: expected = extremum(ref, false); break;
+        case MorphOp::dilate: expected = extremum(ref, true); break;
+        case MorphOp::open: expected = extremum(extremum(ref, false), true); break;
+        case MorphOp::close: expected = extremum(extremum(ref, true), false); break;
+        case MorphOp::tophat: {
+            std::vector<double> opened = extremum(extremum(ref, false), true);
+            expected = ref;
+            for (int y = f.y; y < f.y + f.y_size; y++) {
+                for (int x = f.x; x < f.x + f.x_size; x++) {
+                    for (int c = 0; c < 3; c++) expected[at(x, y, c)] -= opened[at(x, y, c)];
+                }
+            }
+            break;
+        }
+        }
+
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                for (int c = 0; c < 3; c++) {
+                    double v = bytes ? img.rgb8[y][x][c] : img.pixels[y][x][c].real();
+                    if (v != expected[at(x, y, c)]) return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+
+// Every convolution method against direct sums
+static bool convMethodsAgree() {
+    double worst = 0;
+    auto compare = [&](const ImageData& a, const ImageData& b) {
+        for (int y = 0; y < a.height; y++) {
+            for (int x = 0; x < a.width; x++) {
+                for (int c = 0; c < 3; c++) worst = std::max(worst, std::abs(a.pixels[y][x][c] - b.pixels[y][x][c]));
+            }
+        }
+    };
+    auto power = [](int n) { int p = 1; while (p < n) p *= 2; return p; };
+
+    for (int t = 0; t < 12; t++) {
+        int width = 17 + t * 13;
+        int height = 9 + t * 7;
+        ImageData img = randomImage(width, height, t % 2);
+        Kernel kernel = imageKernel(randomImage(1 + t % 7, 2 + t % 5, t % 3 == 0));
+
+        ImageData direct = copyOf(img);
+        ConvPlan plan;
+        plan.method = ConvMethod::direct;
+        convolve(direct, kernel, plan);
+
+        ImageData tiled = copyOf(img);
+        plan.method = ConvMethod::tiled;
+        plan.tileWidth = std::max(16, power(2 * kernel.width));
+        plan.tileHeight = std::max(32, power(2 * kernel.height));
+        convolve(tiled, kernel, plan);
+        compare(tiled, direct);
+
+        ImageData whole = copyOf(img);
+        plan.method = ConvMethod::whole;
+        plan.tileWidth = power(width + kernel.width - 1);
+        plan.tileHeight = power(height + kernel.height - 1);
+        convolve(whole, kernel, plan);
+        compare(whole, direct);
+    }
+
+    ImageData img = randomImage(50, 40, true);
+    Kernel gauss;
+    namedKernel("gauss", 9, gauss);
+    ImageData direct = copyOf(img);
+    ImageData separable = copyOf(img);
+    ConvPlan plan;
+    plan.method = ConvMethod::direct;
+    convolve(direct, gauss, plan);
+    plan.method = ConvMethod::separable;
+    convolve(separable, gauss, plan);
+    compare(separable, direct);
+
+    return worst < 1e-9;
+}
+
+
+// Bilateral grid (sigmaSpace 6) and the small sigma direct path (1.5) against the direct bilateral sum
+// on a noisy step, within a fraction of the noise removed
+static bool bilateralBruteForce(double sigmaSpace) {
+    int width = 120;
+    int height = 90;
+    double sigmaRange = 25;
+    ImageData img;
+    img.allocate(width, height);
+    img.isLoaded = true;
+    img.realMask = 7;
+    std::normal_distribution<double> noise(0, 8);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            double base = (x > 50 ? 200 : 50) + (y > 45 ? 30 : 0);
+            for (int c = 0; c < 3; c++) img.pixels[y][x][c] = Complex(base + noise(rng), 0);
+        }
+    }
+    ImageData ref = copyOf(img);
+    bilateral(img, sigmaSpace, sigmaRange);
+
+    auto luma = [&](int x, int y) {
+        const Triple& p = ref.pixels[y][x];
+        return 0.299 * p[0].real() + 0.587 * p[1].real() + 0.114 * p[2].real();
+    };
+    int reach = static_cast<int>(std::ceil(3 * sigmaSpace));
+    double error = 0;
+    double removed = 0;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            double center = luma(x, y);
+            double sum = 0, weight = 0;
+            for (int yy = std::max(0, y - reach); yy <= std::min(height - 1, y + reach); yy++) {
+                for (int xx = std::max(0, x - reach); xx <= std::min(width - 1, x + reach); xx++) {
+                    double d2 = (yy - y) * (yy - y) + (xx - x) * (xx - x);
+                    double dl = luma(xx, yy) - center;
+                    double w = std::exp(-d2 / (2 * sigmaSpace * sigmaSpace) - dl * dl / (2 * sigmaRange * sigmaRange));
+                    sum += w * ref.pixels[yy][xx][0].real();
+                    weight += w;
+                }
+            }
+            error += std::fabs(sum / weight - img.pixels[y][x][0].real());
+            removed += std::fabs(sum / weight - ref.pixels[y][x][0].real());
+        }
+    }
+    return error < 0.2 * removed;
+}
+
+
+
+// A finished pack job, once dropped, leaves the slot the only holder of its pixels
+static bool packReleasesPixels() {
+    ImageData img = randomImage(64, 48, false);
+    ThreadPool pool(1);
+    std::shared_ptr<PackJob> job = startPack(pool, img.pixels, Precision::f64, img.realMask);
+    job->done.wait();
+    std::vector<Triple> back(img.pixels.size());
+    bool decoded = unpackPixels(*job->blob, back.data(), back.size())
+        && std::equal(back.begin(), back.end(), img.pixels.raw());
+    job.reset();
+    return decoded && !img.pixels.shared();
+}
+
+
+
+int main() {
+    std::vector<std::pair<const char*, std::function<bool()>>> checks = {
+        {"philox known answers", philoxAnswers},
+        {"pack job releases pixels", packReleasesPixels},
+        {"ziggurat moments", gaussMoments},
+        {"jump flooding nearest seeds", voronoiNearest},
+        {"rank filter brute force", rankBruteForce},
+        {"morphology brute force", morphBruteForce},
+        {"convolution methods agree", convMethodsAgree},
+        {"bilateral grid brute force", [] { return bilateralBruteForce(6); }},
+        {"bilateral small sigma brute force", [] { return bilateralBruteForce(1.5); }},
+    };
+
+    int failed = 0;
+    for (auto& [name, check] : checks) {
+        bool ok = check();
+        std::printf("%s %s\n", ok ? "ok  " : "FAIL", name);
+        if (!ok) failed++;
+    }
+    return failed;
+}